@@ -0,0 +1,269 @@
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "main/tree.h"
+
+namespace {
+
+// entries loaded before the YCSB workloads run. their keys are even, and
+// keys inserted by the workloads lie above all of them
+constexpr uint64_t kRecords = uint64_t{1} << 20;
+
+// one operation in this many is timed on its own for the latency percentiles
+constexpr uint64_t kSampleEvery = 16;
+
+constexpr uint64_t kMaxScanLength = 100;
+
+const int kMaxThreads =
+    static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+
+// the YCSB core workloads, out of 100 operations
+// - A: 50 reads, 50 updates
+// - B: 95 reads, 5 updates
+// - C: 100 reads
+// - E: 95 scans of 1 to kMaxScanLength entries, 5 inserts
+enum Workload : int64_t { kA, kB, kC, kE };
+
+enum Distribution : int64_t { kUniform, kZipfian };
+
+enum Order : int64_t { kSequential, kRandom };
+
+template <int MinOrder>
+using BenchTree = Tree<uint64_t, uint64_t, MinOrder>;
+
+/**
+ * Draws ranks in [0, n) from a Zipfian distribution, rank 0 being the most
+ * popular, the way YCSB does (Gray et al., "Quickly Generating Billion-Record
+ * Synthetic Databases"). The normalization constant takes O(n) to compute,
+ * so a generator is built once and shared
+ */
+class ZipfianGenerator {
+   public:
+    explicit ZipfianGenerator(uint64_t n, double theta = 0.99)
+        : n_{n},
+          theta_{theta},
+          alpha_{1.0 / (1.0 - theta)},
+          zeta_n_{Zeta(n, theta)},
+          eta_{(1.0 - std::pow(2.0 / n, 1.0 - theta)) /
+               (1.0 - Zeta(2, theta) / zeta_n_)} {}
+
+    template <typename R>
+    auto operator()(R& rng) const -> uint64_t {
+        auto u = std::uniform_real_distribution<double>{0.0, 1.0}(rng);
+        auto uz = u * zeta_n_;
+        if (uz < 1.0) return 0;
+        if (uz < 1.0 + std::pow(0.5, theta_)) return 1;
+        auto rank = static_cast<uint64_t>(
+            n_ * std::pow(eta_ * u - eta_ + 1.0, alpha_));
+        return std::min(rank, n_ - 1);
+    }
+
+   private:
+    static auto Zeta(uint64_t n, double theta) -> double {
+        auto sum = 0.0;
+        for (uint64_t i = 1; i <= n; i++) sum += 1.0 / std::pow(i, theta);
+        return sum;
+    }
+
+    uint64_t n_;
+    double theta_;
+    double alpha_;
+    double zeta_n_;
+    double eta_;
+};
+
+// multiplying by an odd constant permutes the integers modulo a power of two.
+// it scatters popular ranks over the key space, so that they do not all
+// share a leaf, and random load orders never repeat a key
+inline auto Scramble(uint64_t i) -> uint64_t {
+    return i * 0x9e3779b97f4a7c15;
+}
+
+/**
+ * Picks the keys of existing entries for one thread
+ */
+class KeyChooser {
+   public:
+    explicit KeyChooser(Distribution distribution, uint64_t seed)
+        : distribution_{distribution}, rng_{seed} {}
+
+    auto Next() -> uint64_t {
+        static const auto zipfian = ZipfianGenerator{kRecords};
+        auto index = distribution_ == kUniform
+                         ? rng_() % kRecords
+                         : Scramble(zipfian(rng_)) % kRecords;
+        return 2 * index;
+    }
+
+    inline auto GetRng() -> std::mt19937_64& { return rng_; }
+
+   private:
+    Distribution distribution_;
+    std::mt19937_64 rng_;
+};
+
+/**
+ * Times a sample of one thread's operations, and reports the latency
+ * percentiles and throughput as counters
+ */
+class LatencyRecorder {
+   public:
+    template <typename F>
+    void Run(F&& op) {
+        if (count_++ % kSampleEvery != 0) {
+            op();
+            return;
+        }
+        auto start = std::chrono::steady_clock::now();
+        op();
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        samples_.push_back(static_cast<double>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed)
+                .count()));
+    }
+
+    // percentiles are averaged over the threads, and ops/s is summed
+    void Report(benchmark::State& state) {
+        state.counters["ops/s"] =
+            benchmark::Counter(static_cast<double>(state.iterations()),
+                               benchmark::Counter::kIsRate);
+        if (samples_.empty()) return;
+        for (auto [name, quantile] :
+             {std::pair{"p50_ns", 0.5}, std::pair{"p99_ns", 0.99},
+              std::pair{"p999_ns", 0.999}}) {
+            auto nth = samples_.begin() +
+                       static_cast<std::ptrdiff_t>(quantile *
+                                                   (samples_.size() - 1));
+            std::nth_element(samples_.begin(), nth, samples_.end());
+            state.counters[name] =
+                benchmark::Counter(*nth, benchmark::Counter::kAvgThreads);
+        }
+    }
+
+   private:
+    uint64_t count_ = 0;
+    std::vector<double> samples_;
+};
+
+/**
+ * The tree the YCSB workloads run against, loaded with kRecords entries the
+ * first time it is asked for. Bulk loading leaves room in every leaf, so the
+ * first updates do not all split
+ */
+template <int MinOrder>
+auto LoadedTree() -> BenchTree<MinOrder>& {
+    static const auto tree = [] {
+        auto entries = std::vector<std::pair<uint64_t, uint64_t>>{};
+        entries.reserve(kRecords);
+        for (uint64_t i = 0; i < kRecords; i++) entries.push_back({2 * i, i});
+        auto tree = std::make_unique<BenchTree<MinOrder>>();
+        tree->BulkLoad(entries.begin(), entries.end(), 0.7);
+        return tree;
+    }();
+    return *tree;
+}
+
+// keys inserted by workload E, above every loaded key. shared by every run,
+// since the loaded tree outlives them
+std::atomic<uint64_t> next_insert{2 * kRecords};
+
+template <int MinOrder>
+void BM_Ycsb(benchmark::State& state) {
+    auto workload = static_cast<Workload>(state.range(0));
+    auto distribution = static_cast<Distribution>(state.range(1));
+    auto& tree = LoadedTree<MinOrder>();
+    auto keys = KeyChooser{distribution,
+                           static_cast<uint64_t>(state.thread_index()) + 1};
+    auto latency = LatencyRecorder{};
+    auto reads = workload == kA ? 50u : workload == kC ? 100u : 95u;
+    for (auto _ : state) {
+        auto roll = keys.GetRng()() % 100;
+        auto key = keys.Next();
+        latency.Run([&] {
+            if (roll < reads && workload != kE) {
+                benchmark::DoNotOptimize(tree.Search(key));
+            } else if (roll < reads) {
+                auto length = keys.GetRng()() % kMaxScanLength + 1;
+                auto seen = uint64_t{0};
+                for (auto [k, v] :
+                     tree.Scan(key, std::numeric_limits<uint64_t>::max())) {
+                    benchmark::DoNotOptimize(v);
+                    if (++seen == length) break;
+                }
+            } else if (workload == kE) {
+                auto fresh =
+                    next_insert.fetch_add(1, std::memory_order_relaxed);
+                tree.Insert(fresh, fresh);
+            } else {
+                tree.Upsert(key, key + 1);
+            }
+        });
+    }
+    latency.Report(state);
+    static constexpr const char* kNames[] = {"A", "B", "C", "E"};
+    state.SetLabel(std::string{"ycsb-"} + kNames[workload] +
+                   (distribution == kUniform ? "/uniform" : "/zipfian"));
+}
+
+// one shared tree per load benchmark, created and destroyed by thread 0
+template <int MinOrder>
+std::unique_ptr<BenchTree<MinOrder>> load_tree;
+
+template <int MinOrder>
+std::atomic<uint64_t> next_load{0};
+
+template <int MinOrder>
+void BM_Load(benchmark::State& state) {
+    auto order = static_cast<Order>(state.range(0));
+    if (state.thread_index() == 0) {
+        load_tree<MinOrder> = std::make_unique<BenchTree<MinOrder>>();
+        next_load<MinOrder>.store(0, std::memory_order_relaxed);
+    }
+    auto latency = LatencyRecorder{};
+    // threads do not start the loop until thread 0 has set up
+    for (auto _ : state) {
+        auto n = next_load<MinOrder>.fetch_add(1, std::memory_order_relaxed);
+        auto key = order == kSequential ? n : Scramble(n);
+        latency.Run([&] { load_tree<MinOrder>->Insert(key, n); });
+    }
+    latency.Report(state);
+    state.SetLabel(order == kSequential ? "sequential" : "random");
+    if (state.thread_index() == 0) load_tree<MinOrder>.reset();
+}
+
+void YcsbArgs(benchmark::internal::Benchmark* b) {
+    b->ArgsProduct({{kA, kB, kC, kE}, {kUniform, kZipfian}})
+        ->ArgNames({"workload", "keys"})
+        ->ThreadRange(1, kMaxThreads)
+        ->UseRealTime();
+}
+
+void LoadArgs(benchmark::internal::Benchmark* b) {
+    b->ArgsProduct({{kSequential, kRandom}})
+        ->ArgNames({"order"})
+        ->ThreadRange(1, kMaxThreads)
+        ->UseRealTime();
+}
+
+}  // namespace
+
+BENCHMARK_TEMPLATE(BM_Ycsb, 2)->Apply(YcsbArgs);
+BENCHMARK_TEMPLATE(BM_Ycsb, 8)->Apply(YcsbArgs);
+BENCHMARK_TEMPLATE(BM_Ycsb, 32)->Apply(YcsbArgs);
+BENCHMARK_TEMPLATE(BM_Load, 2)->Apply(LoadArgs);
+BENCHMARK_TEMPLATE(BM_Load, 8)->Apply(LoadArgs);
+BENCHMARK_TEMPLATE(BM_Load, 32)->Apply(LoadArgs);
+
+BENCHMARK_MAIN();
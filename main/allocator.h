@@ -0,0 +1,187 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <vector>
+
+#include "main/numa.h"
+
+// nodes are aligned to, and padded out to, a whole number of cache lines
+constexpr std::size_t kCacheLineSize = 64;
+
+/**
+ * Node allocators hand out fixed-size, cache-line aligned blocks. A tree
+ * constructs its allocator with the size of its nodes, and allocators must
+ * support
+ * - Allocate() -> void*, which may be called from many threads at once
+ * - Deallocate(void*), which returns a block to the allocator. Blocks are
+ *   only ever deallocated once no thread can still reach them, so this is
+ *   also what a memory reclaimer calls to give retired nodes back
+ */
+
+/**
+ * Allocate every block separately from the general-purpose heap
+ */
+class HeapAllocator {
+   public:
+    explicit HeapAllocator(std::size_t block_size) : block_size_{block_size} {}
+
+    inline auto Allocate() -> void* {
+        return ::operator new(block_size_, std::align_val_t{kCacheLineSize});
+    }
+
+    inline void Deallocate(void* block) {
+        ::operator delete(block, std::align_val_t{kCacheLineSize});
+    }
+
+   private:
+    std::size_t block_size_;
+};
+
+/**
+ * Carve blocks out of large cache-line aligned chunks owned by the arena, so
+ * that allocating a node costs one atomic add instead of a trip through the
+ * general-purpose heap. Deallocated blocks are kept on a free list and handed
+ * out again before the current chunk is bumped. Chunks are only released when
+ * the arena is destroyed. An arena given a NUMA node, or Numa::kInterleave,
+ * places its chunks there with Numa::Place.
+ */
+class NodeArena {
+   public:
+    explicit NodeArena(std::size_t block_size, int node = Numa::kAnyNode)
+        : block_size_{RoundUp(block_size)},
+          chunk_size_{block_size_ * kBlocksPerChunk},
+          node_{node},
+          current_{nullptr},
+          free_count_{0} {}
+
+    NodeArena(const NodeArena&) = delete;
+    auto operator=(const NodeArena&) -> NodeArena& = delete;
+
+    ~NodeArena() {
+        for (auto chunk : chunks_) {
+            if (node_ == Numa::kAnyNode)
+                ::operator delete(chunk->data,
+                                  std::align_val_t{kCacheLineSize});
+            else
+                Numa::Free(chunk->data);
+            delete chunk;
+        }
+    }
+
+    auto Allocate() -> void* {
+        if (free_count_.load(std::memory_order_relaxed) > 0) {
+            std::lock_guard<std::mutex> lk{latch_};
+            if (!free_.empty()) {
+                auto block = free_.back();
+                free_.pop_back();
+                free_count_.store(free_.size(), std::memory_order_relaxed);
+                return block;
+            }
+        }
+        while (true) {
+            auto chunk = current_.load(std::memory_order_acquire);
+            if (chunk != nullptr) {
+                auto offset = chunk->used.fetch_add(
+                    block_size_, std::memory_order_relaxed);
+                if (offset + block_size_ <= chunk_size_)
+                    return chunk->data + offset;
+            }
+            // the chunk is used up. whichever thread gets here first installs
+            // a new one, everybody else retries on it
+            std::lock_guard<std::mutex> lk{latch_};
+            if (current_.load(std::memory_order_relaxed) == chunk) {
+                auto next = new Chunk{};
+                next->data = static_cast<char*>(
+                    node_ == Numa::kAnyNode
+                        ? ::operator new(chunk_size_,
+                                         std::align_val_t{kCacheLineSize})
+                        : Numa::AllocateOn(chunk_size_, node_));
+                chunks_.push_back(next);
+                current_.store(next, std::memory_order_release);
+            }
+        }
+    }
+
+    void Deallocate(void* block) {
+        std::lock_guard<std::mutex> lk{latch_};
+        free_.push_back(static_cast<char*>(block));
+        free_count_.store(free_.size(), std::memory_order_relaxed);
+    }
+
+   private:
+    struct Chunk {
+        std::atomic<std::size_t> used{0};
+        char* data;
+    };
+
+    // the number of blocks carved out of each chunk
+    static constexpr std::size_t kBlocksPerChunk = 512;
+
+    static constexpr auto RoundUp(std::size_t size) -> std::size_t {
+        return (size + kCacheLineSize - 1) / kCacheLineSize * kCacheLineSize;
+    }
+
+    std::size_t block_size_;
+    std::size_t chunk_size_;
+    // where chunks are placed, or Numa::kAnyNode to leave it to first touch
+    int node_;
+    std::atomic<Chunk*> current_;
+    // guards chunks_, free_, and installing a new chunk
+    std::mutex latch_;
+    std::vector<Chunk*> chunks_;
+    std::vector<char*> free_;
+    std::atomic<std::size_t> free_count_;
+};
+
+/**
+ * How a NumaArena places nodes
+ * - kLocal gives every thread blocks from an arena on its own NUMA node, the
+ *   way first-touch placement would, so that leaves end up near the threads
+ *   that split them off
+ * - kInterleave spreads every chunk page by page over all the nodes, so that
+ *   no one node serves every thread's misses
+ */
+enum class NumaPolicy { kLocal, kInterleave };
+
+/**
+ * A NodeArena for every NUMA node, or a single interleaved one, picked by
+ * Policy. A block is given back to the arena of the node it lives on, so
+ * that it is only reused by threads on that node under kLocal. On a machine
+ * with a single node this is a NodeArena
+ */
+template <NumaPolicy Policy = NumaPolicy::kLocal>
+class NumaArena {
+   public:
+    explicit NumaArena(std::size_t block_size) {
+        auto count = Policy == NumaPolicy::kLocal ? Numa::NodeCount() : 1;
+        for (auto node = 0; node < count; node++) {
+            arenas_.push_back(std::make_unique<NodeArena>(
+                block_size,
+                Policy == NumaPolicy::kLocal ? node : Numa::kInterleave));
+        }
+    }
+
+    inline auto Allocate() -> void* {
+        if (arenas_.size() == 1) return arenas_[0]->Allocate();
+        return arenas_[Numa::CurrentNode()]->Allocate();
+    }
+
+    void Deallocate(void* block) {
+        if (arenas_.size() == 1) {
+            arenas_[0]->Deallocate(block);
+            return;
+        }
+        // a page the kernel has not placed yet goes to the caller's node
+        auto node = Numa::NodeOf(block);
+        if (node < 0 || node >= static_cast<int>(arenas_.size()))
+            node = Numa::CurrentNode();
+        arenas_[node]->Deallocate(block);
+    }
+
+   private:
+    std::vector<std::unique_ptr<NodeArena>> arenas_;
+};
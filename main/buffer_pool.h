@@ -0,0 +1,406 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <mutex>
+#include <new>
+#include <optional>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// identifies a page of a file. page n starts at byte n * page size
+using PageId = uint64_t;
+
+constexpr PageId kInvalidPage = std::numeric_limits<PageId>::max();
+
+/**
+ * Caches the fixed-size pages of a file in a fixed number of frames. A page
+ * is pinned for as long as a PageGuard for it lives, and pinned pages are
+ * never evicted. When a page that is not cached is fetched, the frame of an
+ * unpinned page is reused, picked by the CLOCK algorithm, and written back
+ * first if it is dirty.
+ * - Every frame has a reader-writer latch, which callers use to coordinate
+ *   access to the page in it. The pool itself only touches unpinned frames
+ * - Fetching blocks while every frame is pinned, so there must be more frames
+ *   than pages pinned at once across all threads
+ * - Frames are aligned to the page size
+ * - Misses are read, and dirty pages written back before their frame is
+ *   reused, without holding the pool's own latch. Fetch reads misses itself;
+ *   Pin and FinishLoad split a miss in two, so that the read can be issued
+ *   asynchronously instead, straight into the frame
+ */
+class BufferPool {
+    struct Frame;
+
+   public:
+    /**
+     * Pins a page for as long as it lives. Move-only
+     */
+    class PageGuard {
+       public:
+        explicit PageGuard() : pool_{nullptr}, frame_{0} {}
+        explicit PageGuard(BufferPool* pool, std::size_t frame)
+            : pool_{pool}, frame_{frame} {}
+        PageGuard(PageGuard&& other)
+            : pool_{std::exchange(other.pool_, nullptr)},
+              frame_{other.frame_} {}
+        auto operator=(PageGuard&& other) -> PageGuard& {
+            Release();
+            pool_ = std::exchange(other.pool_, nullptr);
+            frame_ = other.frame_;
+            return *this;
+        }
+        ~PageGuard() { Release(); }
+
+        inline auto IsValid() const -> bool { return pool_ != nullptr; }
+        inline auto GetFrameIndex() const -> std::size_t { return frame_; }
+
+        /**
+         * Whether the page is still being read in by whoever pinned it first
+         */
+        inline auto IsLoading() const -> bool {
+            return GetFrame().loading.load(std::memory_order_acquire);
+        }
+        inline auto GetId() const -> PageId { return GetFrame().id; }
+        inline auto GetData() const -> char* { return GetFrame().data; }
+
+        /**
+         * Mark the page as changed, so that it is written back before its
+         * frame is reused. Call it while holding the latch exclusively
+         */
+        inline void MarkDirty() {
+            GetFrame().dirty.store(true, std::memory_order_relaxed);
+        }
+
+        inline void Latch() { GetFrame().latch.lock(); }
+        inline void Unlatch() { GetFrame().latch.unlock(); }
+        inline void LatchShared() { GetFrame().latch.lock_shared(); }
+        inline void UnlatchShared() { GetFrame().latch.unlock_shared(); }
+
+       private:
+        inline auto GetFrame() const -> Frame& {
+            return pool_->frames_[frame_];
+        }
+
+        void Release() {
+            if (pool_ == nullptr) return;
+            pool_->frames_[frame_].pins.fetch_sub(1, std::memory_order_release);
+            pool_ = nullptr;
+        }
+
+        BufferPool* pool_;
+        std::size_t frame_;
+    };
+
+    explicit BufferPool(const std::string& path, std::size_t page_size,
+                        std::size_t frame_count)
+        : id_{next_id_.fetch_add(1, std::memory_order_relaxed)},
+          page_size_{page_size},
+          fd_{::open(path.c_str(), O_RDWR | O_CREAT, 0644)},
+          next_page_{0},
+          hand_{0},
+          frames_(frame_count) {
+        for (auto& frame : frames_) {
+            frame.data = static_cast<char*>(
+                ::operator new(page_size_, std::align_val_t{page_size_}));
+        }
+        if (fd_ < 0) return;
+        auto size = ::lseek(fd_, 0, SEEK_END);
+        next_page_.store(size < 0 ? 0 : size / page_size_,
+                         std::memory_order_relaxed);
+    }
+
+    BufferPool(const BufferPool&) = delete;
+    auto operator=(const BufferPool&) -> BufferPool& = delete;
+
+    /**
+     * Write back every dirty page and close the file. No page may be pinned
+     */
+    ~BufferPool() {
+        Flush();
+        if (fd_ >= 0) ::close(fd_);
+        for (auto& frame : frames_)
+            ::operator delete(frame.data, std::align_val_t{page_size_});
+    }
+
+    /**
+     * Whether the file could be opened
+     */
+    inline auto IsOpen() const -> bool { return fd_ >= 0; }
+
+    /**
+     * An id no other pool in the process has had, even one since destroyed
+     * at the same address. It names the pool's frames when they are
+     * registered with an I/O ring
+     */
+    inline auto GetPoolId() const -> uint64_t { return id_; }
+
+    inline auto GetPageSize() const -> std::size_t { return page_size_; }
+
+    inline auto GetFd() const -> int { return fd_; }
+
+    inline auto GetFrameCount() const -> std::size_t { return frames_.size(); }
+
+    /**
+     * The position of the page in the file
+     */
+    inline auto GetOffset(PageId id) const -> off_t {
+        return static_cast<off_t>(id * page_size_);
+    }
+
+    /**
+     * The memory of every frame, in frame index order, for registering with
+     * an I/O ring
+     */
+    auto GetFrameBuffers() const -> std::vector<iovec> {
+        auto buffers = std::vector<iovec>{};
+        for (const auto& frame : frames_)
+            buffers.push_back({frame.data, page_size_});
+        return buffers;
+    }
+
+    /**
+     * The number of pages in the file, counting pages only allocated so far
+     */
+    inline auto GetPageCount() const -> PageId {
+        return next_page_.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * How Pin found the page
+     * - kReady: it is cached and can be used right away
+     * - kLoading: another thread is reading it in. Wait until the guard is
+     *   no longer IsLoading(), then check that it still holds the page, which
+     *   it does not if the read failed
+     * - kMustRead: it was not cached, and the caller has to read it into the
+     *   frame and then call FinishLoad
+     * - kFull: every frame is pinned, and the guard is invalid. Try again
+     *   once some page has been unpinned
+     */
+    enum class PinState { kReady, kLoading, kMustRead, kFull };
+
+    /**
+     * Pin a page of the file without reading it. Never blocks on I/O
+     */
+    auto Pin(PageId id) -> std::pair<PageGuard, PinState> {
+        std::unique_lock<std::mutex> lk{latch_};
+        auto hit = [&](std::size_t index) -> std::pair<PageGuard, PinState> {
+            auto& frame = frames_[index];
+            frame.pins.fetch_add(1, std::memory_order_acquire);
+            frame.referenced.store(true, std::memory_order_relaxed);
+            auto state = frame.loading.load(std::memory_order_acquire)
+                             ? PinState::kLoading
+                             : PinState::kReady;
+            return {PageGuard{this, index}, state};
+        };
+        auto it = table_.find(id);
+        if (it != table_.end()) return hit(it->second);
+        auto victim = Evict(lk);
+        if (!victim.has_value()) return {PageGuard{}, PinState::kFull};
+        // latch_ was let go if a victim was written back, so the page may
+        // have been pinned meanwhile. the unused victim stays free
+        it = table_.find(id);
+        if (it != table_.end()) return hit(it->second);
+        // whoever else pins the page before it is read waits for it
+        frames_[*victim].loading.store(true, std::memory_order_relaxed);
+        Install(*victim, id);
+        return {PageGuard{this, *victim}, PinState::kMustRead};
+    }
+
+    /**
+     * Finish loading a page Pin returned as kMustRead, given the number of
+     * bytes read into it or a negative number if the read failed. A page
+     * that could not be read is dropped and the guard is reset
+     */
+    void FinishLoad(PageGuard& page, ssize_t read) {
+        auto& frame = frames_[page.GetFrameIndex()];
+        if (read < 0) {
+            std::lock_guard<std::mutex> lk{latch_};
+            table_.erase(frame.id);
+            frame.id = kInvalidPage;
+        } else {
+            // pages allocated but never written back read as zeroes
+            std::memset(frame.data + read, 0, page_size_ - read);
+        }
+        frame.loading.store(false, std::memory_order_release);
+        if (read < 0) page = PageGuard{};
+    }
+
+    /**
+     * Pin a page of the file, reading it in if it is not cached. Returns an
+     * invalid guard if the page could not be read
+     */
+    auto Fetch(PageId id) -> PageGuard {
+        while (true) {
+            auto [page, state] = Pin(id);
+            switch (state) {
+                case PinState::kReady:
+                    return std::move(page);
+                case PinState::kLoading:
+                    while (page.IsLoading()) std::this_thread::yield();
+                    if (page.GetId() != id) return PageGuard{};
+                    return std::move(page);
+                case PinState::kMustRead:
+                    FinishLoad(page, ::pread(fd_, page.GetData(), page_size_,
+                                             GetOffset(id)));
+                    return std::move(page);
+                case PinState::kFull:
+                    // every frame is pinned. wait for somebody to unpin one
+                    std::this_thread::yield();
+                    break;
+            }
+        }
+    }
+
+    /**
+     * Allocate a new page at the end of the file and pin it. The page starts
+     * out zeroed and dirty
+     */
+    auto New() -> PageGuard {
+        while (true) {
+            std::unique_lock<std::mutex> lk{latch_};
+            auto victim = Evict(lk);
+            if (!victim.has_value()) {
+                lk.unlock();
+                std::this_thread::yield();
+                continue;
+            }
+            auto id = next_page_.fetch_add(1, std::memory_order_relaxed);
+            auto& frame = frames_[*victim];
+            std::memset(frame.data, 0, page_size_);
+            frame.dirty.store(true, std::memory_order_relaxed);
+            Install(*victim, id);
+            return PageGuard{this, *victim};
+        }
+    }
+
+    /**
+     * Write back every dirty page and sync the file. Each page is pinned and
+     * latched in shared mode while it is written, so it is written whole
+     */
+    auto Flush() -> bool {
+        if (fd_ < 0) return false;
+        auto ok = true;
+        for (std::size_t i = 0; i < frames_.size(); i++) {
+            auto page = PinDirty(i);
+            if (!page.IsValid()) continue;
+            page.LatchShared();
+            auto& frame = frames_[i];
+            frame.dirty.store(false, std::memory_order_relaxed);
+            ok = Write(frame.id, frame.data) && ok;
+            page.UnlatchShared();
+        }
+        return ::fsync(fd_) == 0 && ok;
+    }
+
+   private:
+    struct Frame {
+        PageId id = kInvalidPage;
+        std::atomic<int> pins{0};
+        // set on every hit, and cleared as the clock hand passes by
+        std::atomic<bool> referenced{false};
+        std::atomic<bool> dirty{false};
+        // set while the page is being read in
+        std::atomic<bool> loading{false};
+        std::shared_mutex latch;
+        char* data = nullptr;
+    };
+
+    // pick an unpinned frame to reuse, and take it out of the table. the
+    // hand gives every referenced frame a second chance, so two sweeps are
+    // enough to find a victim if there is one. a dirty page is written back
+    // first with lk let go, pinned meanwhile so that nobody else picks it,
+    // and its frame is only taken if nobody used it while it was written.
+    // the caller holds latch_ through lk, and gets it back held
+    auto Evict(std::unique_lock<std::mutex>& lk) -> std::optional<std::size_t> {
+        for (std::size_t step = 0; step < 2 * frames_.size(); step++) {
+            auto index = hand_;
+            hand_ = (hand_ + 1) % frames_.size();
+            auto& frame = frames_[index];
+            if (frame.pins.load(std::memory_order_acquire) > 0) continue;
+            if (frame.referenced.exchange(false, std::memory_order_relaxed))
+                continue;
+            if (frame.id != kInvalidPage &&
+                frame.dirty.load(std::memory_order_relaxed)) {
+                frame.pins.fetch_add(1, std::memory_order_acquire);
+                lk.unlock();
+                auto written = WriteBack(index);
+                frame.pins.fetch_sub(1, std::memory_order_release);
+                lk.lock();
+                if (!written ||
+                    frame.pins.load(std::memory_order_acquire) > 0 ||
+                    frame.referenced.load(std::memory_order_relaxed) ||
+                    frame.dirty.load(std::memory_order_relaxed))
+                    continue;
+            }
+            if (frame.id != kInvalidPage) table_.erase(frame.id);
+            frame.id = kInvalidPage;
+            frame.dirty.store(false, std::memory_order_relaxed);
+            return index;
+        }
+        return std::nullopt;
+    }
+
+    // write back the page in the pinned frame, latched in shared mode so that
+    // it is written whole. the page is marked dirty again if the write fails
+    auto WriteBack(std::size_t index) -> bool {
+        auto& frame = frames_[index];
+        frame.latch.lock_shared();
+        frame.dirty.store(false, std::memory_order_relaxed);
+        auto written = Write(frame.id, frame.data);
+        if (!written) frame.dirty.store(true, std::memory_order_relaxed);
+        frame.latch.unlock_shared();
+        return written;
+    }
+
+    // pin the frame if it holds a dirty page. latch_ is not held while the
+    // page is written, since a writer holding the page's latch may be
+    // waiting for it
+    auto PinDirty(std::size_t index) -> PageGuard {
+        std::lock_guard<std::mutex> lk{latch_};
+        auto& frame = frames_[index];
+        if (frame.id == kInvalidPage ||
+            !frame.dirty.load(std::memory_order_relaxed))
+            return PageGuard{};
+        frame.pins.fetch_add(1, std::memory_order_acquire);
+        return PageGuard{this, index};
+    }
+
+    // map the page to the frame and pin it. the caller holds latch_
+    void Install(std::size_t index, PageId id) {
+        auto& frame = frames_[index];
+        frame.id = id;
+        frame.pins.store(1, std::memory_order_relaxed);
+        frame.referenced.store(true, std::memory_order_relaxed);
+        table_[id] = index;
+    }
+
+    auto Write(PageId id, const char* data) -> bool {
+        return ::pwrite(fd_, data, page_size_, GetOffset(id)) ==
+               static_cast<ssize_t>(page_size_);
+    }
+
+    // the id the next pool gets. zero is never handed out
+    static inline std::atomic<uint64_t> next_id_{1};
+
+    uint64_t id_;
+    std::size_t page_size_;
+    int fd_;
+    std::atomic<PageId> next_page_;
+    // guards table_, hand_, and which page each frame holds
+    std::mutex latch_;
+    std::unordered_map<PageId, std::size_t> table_;
+    std::size_t hand_;
+    std::vector<Frame> frames_;
+};
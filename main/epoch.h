@@ -0,0 +1,324 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <limits>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "main/allocator.h"
+
+/**
+ * Epoch-based memory reclamation. Threads pin the manager for as long as they
+ * may hold pointers into a shared structure, and memory unlinked from the
+ * structure is retired rather than freed. Retired memory is freed once every
+ * thread that was pinned when it was retired has unpinned, so no reader can
+ * still be crossing it.
+ * - Pinning and unpinning touch only the calling thread's own slot
+ * - Slots are allocated kChunkSlots at a time, the first time a thread whose
+ *   index falls among them pins the manager, so an idle manager is small
+ * - Retired memory is kept on the retiring thread's own list, and any thread
+ *   may free what is safe to free from every list: each thread does every
+ *   kReclaimThreshold retirements, and so does Synchronize
+ * - At most kMaxThreads threads may use the manager at once
+ * - Trees all share the one manager Shared() returns, so a reader pinned
+ *   for long holds up reclamation in every tree, not just its own
+ */
+class EpochManager {
+   public:
+    // frees ptr. context is passed through from Retire
+    using Deleter = void (*)(void* context, void* ptr);
+
+    static constexpr int kMaxThreads = 512;
+    static constexpr int kChunkSlots = 16;
+
+    /**
+     * Keeps the calling thread pinned for as long as it lives. Guards nest, so
+     * an operation may pin the manager while its caller already has
+     */
+    class Guard {
+       public:
+        explicit Guard(EpochManager* manager) : manager_{manager} {
+            manager_->Enter();
+        }
+        Guard(const Guard& other) : manager_{other.manager_} {
+            manager_->Enter();
+        }
+        auto operator=(const Guard& other) -> Guard& {
+            other.manager_->Enter();
+            manager_->Exit();
+            manager_ = other.manager_;
+            return *this;
+        }
+        ~Guard() { manager_->Exit(); }
+
+       private:
+        EpochManager* manager_;
+    };
+
+    explicit EpochManager() : epoch_{0} {
+        for (auto& chunk : chunks_) chunk.store(nullptr);
+    }
+
+    EpochManager(const EpochManager&) = delete;
+    auto operator=(const EpochManager&) -> EpochManager& = delete;
+
+    /**
+     * Free everything still retired. No thread may be pinned
+     */
+    ~EpochManager() {
+        for (auto& chunk : chunks_) {
+            auto slots = chunk.load(std::memory_order_relaxed);
+            if (slots == nullptr) continue;
+            for (auto i = 0; i < kChunkSlots; i++) {
+                for (auto& retired : slots[i].retired)
+                    retired.deleter(retired.context, retired.ptr);
+            }
+            delete[] slots;
+        }
+    }
+
+    /**
+     * The manager every tree in the process shares
+     */
+    static auto Shared() -> EpochManager& {
+        static auto manager = EpochManager{};
+        return manager;
+    }
+
+    /**
+     * Pin the calling thread until the returned guard is destroyed
+     */
+    inline auto Pin() -> Guard { return Guard{this}; }
+
+    /**
+     * Free ptr by calling deleter(context, ptr) once no thread pinned right
+     * now is still pinned. ptr must already be unreachable for any thread
+     * that pins the manager from here on
+     */
+    void Retire(void* ptr, Deleter deleter, void* context) {
+        auto& slot = OwnSlot();
+        {
+            std::lock_guard<std::mutex> lk{slot.latch};
+            slot.retired.push_back(
+                {ptr, deleter, context,
+                 epoch_.load(std::memory_order_seq_cst)});
+        }
+        if (++slot.retirements % kReclaimThreshold == 0) Reclaim();
+    }
+
+    /**
+     * Free whatever any thread retired that is safe to free now. Lists that
+     * another thread is freeing from at the same time are skipped
+     */
+    void Reclaim() {
+        // the global epoch can only move on once every pinned thread has seen
+        // it. memory retired in epoch e is unreachable for threads pinned in
+        // e + 2 or later. the fence pairs with the one in Enter(), so that
+        // the unlinks made before retiring are seen by any thread this scan
+        // finds unpinned
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        auto epoch = epoch_.load(std::memory_order_seq_cst);
+        auto oldest = OldestPinned(epoch, -1);
+        if (oldest == epoch)
+            epoch_.compare_exchange_strong(epoch, epoch + 1,
+                                           std::memory_order_seq_cst);
+        ForEachSlot([&](Slot& slot) {
+            auto lk = std::unique_lock<std::mutex>{slot.latch,
+                                                   std::try_to_lock};
+            if (!lk.owns_lock()) return;
+            auto& retired = slot.retired;
+            auto keep = std::partition(
+                retired.begin(), retired.end(),
+                [&](const Retired& r) { return r.epoch + 2 > oldest; });
+            for (auto it = keep; it != retired.end(); ++it)
+                it->deleter(it->context, it->ptr);
+            retired.erase(keep, retired.end());
+        });
+    }
+
+    /**
+     * Wait until every other thread that is pinned right now has unpinned,
+     * then free what any thread retired before the call, unless a thread
+     * that pinned since holds some of it up. Threads that pin later do not
+     * hold up the wait for long, since the epoch moves on under them. The
+     * calling thread's own pin is not waited for, so it must not hold on to
+     * anything it is waiting to free
+     */
+    void Synchronize() {
+        auto target = epoch_.load(std::memory_order_seq_cst);
+        auto self = ThreadIndex();
+        while (true) {
+            auto epoch = epoch_.load(std::memory_order_seq_cst);
+            auto oldest = OldestPinned(epoch, self);
+            // a thread pinned before the call pinned target or earlier, and
+            // what was retired in target is free once none is pinned before
+            // target + 2. past the first, only a thread that pinned since
+            // can keep the epoch from getting there
+            if (oldest > target + 1) break;
+            if (oldest > target && oldest != epoch) break;
+            if (oldest == epoch)
+                epoch_.compare_exchange_strong(epoch, epoch + 1,
+                                               std::memory_order_seq_cst);
+            else
+                std::this_thread::yield();
+        }
+        Reclaim();
+    }
+
+    /**
+     * Free everything retired with context right away, without waiting for
+     * pinned threads. For when whatever context names is being destroyed,
+     * at which point no thread may be reading what it retired
+     */
+    void Release(void* context) {
+        ForEachSlot([&](Slot& slot) {
+            std::lock_guard<std::mutex> lk{slot.latch};
+            auto& retired = slot.retired;
+            auto keep = std::partition(
+                retired.begin(), retired.end(),
+                [&](const Retired& r) { return r.context != context; });
+            for (auto it = keep; it != retired.end(); ++it)
+                it->deleter(it->context, it->ptr);
+            retired.erase(keep, retired.end());
+        });
+    }
+
+    /**
+     * The calling thread's index in [0, kMaxThreads), shared by every manager
+     * and by anything else kept per thread. Indices are handed back when
+     * their thread exits so that thread churn does not run out of them
+     */
+    static auto ThreadIndex() -> int {
+        thread_local auto index = ThreadIndexOwner{};
+        return index.index;
+    }
+
+   private:
+    struct Retired {
+        void* ptr;
+        Deleter deleter;
+        void* context;
+        uint64_t epoch;
+    };
+
+    struct alignas(kCacheLineSize) Slot {
+        // the epoch the owning thread pinned, or kUnpinned
+        std::atomic<uint64_t> epoch{kUnpinned};
+        // only touched by the owning thread
+        int depth = 0;
+        std::size_t retirements = 0;
+        // appended to by the owning thread, and freed from by any
+        std::mutex latch;
+        std::vector<Retired> retired;
+    };
+
+    static constexpr uint64_t kUnpinned = std::numeric_limits<uint64_t>::max();
+
+    // how many retirements a thread makes between reclaiming
+    static constexpr std::size_t kReclaimThreshold = 64;
+
+    inline void Enter() {
+        auto& slot = OwnSlot();
+        if (slot.depth++ > 0) return;
+        // the store must be visible before any shared pointer is read, or a
+        // reclaimer could miss this thread. a store alone does not keep the
+        // loads that follow it from moving ahead of it, so a full fence does
+        slot.epoch.store(epoch_.load(std::memory_order_relaxed),
+                         std::memory_order_seq_cst);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+
+    inline void Exit() {
+        auto& slot = OwnSlot();
+        if (--slot.depth > 0) return;
+        slot.epoch.store(kUnpinned, std::memory_order_release);
+    }
+
+    // the calling thread's slot, allocating its chunk if no thread has yet
+    inline auto OwnSlot() -> Slot& {
+        auto index = ThreadIndex();
+        auto& chunk = chunks_[index / kChunkSlots];
+        auto slots = chunk.load(std::memory_order_acquire);
+        if (slots == nullptr) {
+            auto fresh = new Slot[kChunkSlots];
+            if (chunk.compare_exchange_strong(slots, fresh,
+                                              std::memory_order_acq_rel))
+                slots = fresh;
+            else
+                delete[] fresh;
+        }
+        return slots[index % kChunkSlots];
+    }
+
+    // call fn on every slot allocated so far
+    template <typename F>
+    void ForEachSlot(F&& fn) {
+        auto threads = thread_count_.load(std::memory_order_acquire);
+        for (auto c = 0; c * kChunkSlots < threads; c++) {
+            auto slots = chunks_[c].load(std::memory_order_acquire);
+            if (slots == nullptr) continue;
+            for (auto i = 0; i < kChunkSlots; i++) fn(slots[i]);
+        }
+    }
+
+    // the oldest epoch any thread but skip is pinned in, or epoch if none is
+    // pinned in an older one
+    auto OldestPinned(uint64_t epoch, int skip) -> uint64_t {
+        auto oldest = epoch;
+        auto threads = thread_count_.load(std::memory_order_acquire);
+        for (auto c = 0; c * kChunkSlots < threads; c++) {
+            auto slots = chunks_[c].load(std::memory_order_acquire);
+            if (slots == nullptr) continue;
+            for (auto i = 0; i < kChunkSlots; i++) {
+                if (c * kChunkSlots + i == skip) continue;
+                auto pinned = slots[i].epoch.load(std::memory_order_seq_cst);
+                oldest = std::min(oldest, pinned);
+            }
+        }
+        return oldest;
+    }
+
+    struct ThreadIndexOwner {
+        ThreadIndexOwner() {
+            std::lock_guard<std::mutex> lk{IndexLatch()};
+            auto& free = FreeIndices();
+            if (!free.empty()) {
+                index = free.back();
+                free.pop_back();
+                return;
+            }
+            index = thread_count_.load(std::memory_order_relaxed);
+            // the hard limit on threads using the tree at once
+            if (index >= kMaxThreads) std::abort();
+            thread_count_.store(index + 1, std::memory_order_release);
+        }
+        ~ThreadIndexOwner() {
+            std::lock_guard<std::mutex> lk{IndexLatch()};
+            FreeIndices().push_back(index);
+        }
+        int index;
+    };
+
+    static auto IndexLatch() -> std::mutex& {
+        static auto latch = std::mutex{};
+        return latch;
+    }
+
+    static auto FreeIndices() -> std::vector<int>& {
+        static auto free = std::vector<int>{};
+        return free;
+    }
+
+    static_assert(kMaxThreads % kChunkSlots == 0);
+
+    // one past the highest thread index handed out so far
+    static inline std::atomic<int> thread_count_{0};
+
+    std::atomic<uint64_t> epoch_;
+    // kChunkSlots slots each, or null until a thread among them pins
+    std::atomic<Slot*> chunks_[kMaxThreads / kChunkSlots];
+};
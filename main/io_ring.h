@@ -0,0 +1,280 @@
+#pragma once
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <span>
+#include <vector>
+
+/**
+ * A minimal io_uring submission and completion ring, driven through the raw
+ * system calls. Reads are queued with PrepareRead, handed to the kernel with
+ * Submit, and their results collected with Reap.
+ * - A ring belongs to one thread at a time
+ * - Buffers registered with RegisterBuffers are pinned by the kernel once,
+ *   and reads into them skip the per-I/O page mapping. They are registered
+ *   on behalf of an owner, named by an id no other owner in the process
+ *   has, such as BufferPool::GetPoolId(), so that a ring can tell whose
+ *   buffers it holds. An owner about to free its buffers calls Unregister,
+ *   which takes them out of every ring. A ring remembers the last owner
+ *   the kernel refused, so that it is not asked again
+ * - IsOpen() is false if the kernel has no io_uring or refuses to set one
+ *   up, and callers are expected to fall back to blocking reads
+ */
+class IoRing {
+   public:
+    explicit IoRing(unsigned entries)
+        : fd_{-1},
+          depth_{0},
+          sq_ring_{MAP_FAILED},
+          cq_ring_{MAP_FAILED},
+          sqes_{MAP_FAILED},
+          sq_ring_size_{0},
+          cq_ring_size_{0},
+          sqes_size_{0},
+          pending_{0},
+          owner_{0},
+          refused_{0} {
+        auto params = io_uring_params{};
+        fd_ = static_cast<int>(
+            ::syscall(__NR_io_uring_setup, entries, &params));
+        if (fd_ < 0) return;
+        sq_ring_size_ =
+            params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_ring_size_ =
+            params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        auto single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if (single)
+            sq_ring_size_ = cq_ring_size_ =
+                std::max(sq_ring_size_, cq_ring_size_);
+        sq_ring_ = Map(sq_ring_size_, IORING_OFF_SQ_RING);
+        cq_ring_ = single ? sq_ring_ : Map(cq_ring_size_, IORING_OFF_CQ_RING);
+        sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+        sqes_ = Map(sqes_size_, IORING_OFF_SQES);
+        if (sq_ring_ == MAP_FAILED || cq_ring_ == MAP_FAILED ||
+            sqes_ == MAP_FAILED) {
+            Close();
+            return;
+        }
+        auto sq = static_cast<char*>(sq_ring_);
+        sq_head_ = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+        sq_tail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        sq_mask_ = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        sq_array_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        auto cq = static_cast<char*>(cq_ring_);
+        cq_head_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cq_tail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cq_mask_ = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cqes_ = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+        depth_ = params.sq_entries;
+        std::lock_guard<std::mutex> lk{RegistryLatch()};
+        Rings().push_back(this);
+    }
+
+    IoRing(const IoRing&) = delete;
+    auto operator=(const IoRing&) -> IoRing& = delete;
+
+    /**
+     * Tear the ring down. Reads still in flight must have been reaped
+     */
+    ~IoRing() {
+        {
+            std::lock_guard<std::mutex> lk{RegistryLatch()};
+            auto& rings = Rings();
+            rings.erase(std::remove(rings.begin(), rings.end(), this),
+                        rings.end());
+        }
+        Close();
+    }
+
+    inline auto IsOpen() const -> bool { return fd_ >= 0; }
+
+    /**
+     * The most reads that can be queued at once
+     */
+    inline auto GetDepth() const -> unsigned { return depth_; }
+
+    /**
+     * Whether the ring holds buffers registered on behalf of owner
+     */
+    inline auto IsRegistered(uint64_t owner) const -> bool {
+        std::lock_guard<std::mutex> lk{RegistryLatch()};
+        return owner != 0 && owner_ == owner;
+    }
+
+    /**
+     * Whether the kernel refused the last buffers registered on behalf of
+     * owner, which RegisterBuffers then refuses without asking it again
+     */
+    inline auto IsRefused(uint64_t owner) const -> bool {
+        std::lock_guard<std::mutex> lk{RegistryLatch()};
+        return owner != 0 && refused_ == owner;
+    }
+
+    /**
+     * Register the buffers on behalf of owner, which must not be zero,
+     * replacing any registered before. Buffer i can then be read into with
+     * buffer index i. Returns false if the kernel refuses, for instance over
+     * the locked memory limit
+     */
+    auto RegisterBuffers(uint64_t owner, std::span<const iovec> buffers)
+        -> bool {
+        std::lock_guard<std::mutex> lk{RegistryLatch()};
+        if (fd_ < 0 || owner == refused_) return false;
+        if (owner_ != 0) {
+            ::syscall(__NR_io_uring_register, fd_, IORING_UNREGISTER_BUFFERS,
+                      nullptr, 0);
+            owner_ = 0;
+        }
+        if (::syscall(__NR_io_uring_register, fd_, IORING_REGISTER_BUFFERS,
+                      buffers.data(), buffers.size()) != 0) {
+            refused_ = owner;
+            return false;
+        }
+        owner_ = owner;
+        return true;
+    }
+
+    /**
+     * Take the buffers registered on behalf of owner out of every ring that
+     * holds them, so that the kernel lets go of them before they are freed.
+     * None of them may still be read into
+     */
+    static void Unregister(uint64_t owner) {
+        std::lock_guard<std::mutex> lk{RegistryLatch()};
+        for (auto ring : Rings()) {
+            if (ring->refused_ == owner) ring->refused_ = 0;
+            if (owner == 0 || ring->owner_ != owner) continue;
+            ::syscall(__NR_io_uring_register, ring->fd_,
+                      IORING_UNREGISTER_BUFFERS, nullptr, 0);
+            ring->owner_ = 0;
+        }
+    }
+
+    /**
+     * Queue a read of size bytes at offset of the file into data, which
+     * lies in registered buffer buffer_index, or in no registered buffer if
+     * it is negative. user_data comes back with the result. Returns false if
+     * the submission queue is full
+     */
+    auto PrepareRead(int fd, void* data, uint32_t size, uint64_t offset,
+                     int buffer_index, uint64_t user_data) -> bool {
+        auto tail = *sq_tail_;
+        auto head = std::atomic_ref<unsigned>{*sq_head_}.load(
+            std::memory_order_acquire);
+        if (tail - head == depth_) return false;
+        auto index = tail & sq_mask_;
+        auto& sqe = static_cast<io_uring_sqe*>(sqes_)[index];
+        std::memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = buffer_index >= 0 ? IORING_OP_READ_FIXED : IORING_OP_READ;
+        sqe.fd = fd;
+        sqe.addr = reinterpret_cast<uint64_t>(data);
+        sqe.len = size;
+        sqe.off = offset;
+        sqe.buf_index =
+            static_cast<uint16_t>(buffer_index < 0 ? 0 : buffer_index);
+        sqe.user_data = user_data;
+        sq_array_[index] = index;
+        // the entry must be filled in before the kernel can see the new tail
+        std::atomic_ref<unsigned>{*sq_tail_}.store(tail + 1,
+                                                  std::memory_order_release);
+        pending_++;
+        return true;
+    }
+
+    /**
+     * Hand every queued read to the kernel, and wait until at least
+     * wait_for reads have completed. Returns false on an error other than
+     * being interrupted
+     */
+    auto Submit(unsigned wait_for) -> bool {
+        auto flags = wait_for > 0 ? IORING_ENTER_GETEVENTS : 0u;
+        auto submitted = ::syscall(__NR_io_uring_enter, fd_, pending_,
+                                   wait_for, flags, nullptr, 0);
+        if (submitted < 0) return errno == EINTR;
+        pending_ -= static_cast<unsigned>(submitted);
+        return true;
+    }
+
+    /**
+     * Call fn(user_data, result) for every completed read, where result is
+     * the number of bytes read or a negated errno. Returns how many there
+     * were
+     */
+    template <typename F>
+    auto Reap(F&& fn) -> int {
+        auto head = *cq_head_;
+        auto tail = std::atomic_ref<unsigned>{*cq_tail_}.load(
+            std::memory_order_acquire);
+        auto count = 0;
+        for (; head != tail; head++, count++) {
+            const auto& cqe = cqes_[head & cq_mask_];
+            fn(cqe.user_data, cqe.res);
+        }
+        // hand the entries back to the kernel once they have been read
+        std::atomic_ref<unsigned>{*cq_head_}.store(head,
+                                                  std::memory_order_release);
+        return count;
+    }
+
+   private:
+    // guards every ring's owner_ and refused_, which Unregister changes from
+    // whatever thread frees the buffers, and the list of open rings
+    static auto RegistryLatch() -> std::mutex& {
+        static auto latch = std::mutex{};
+        return latch;
+    }
+
+    static auto Rings() -> std::vector<IoRing*>& {
+        static auto rings = std::vector<IoRing*>{};
+        return rings;
+    }
+
+    auto Map(std::size_t size, off_t offset) -> void* {
+        return ::mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd_, offset);
+    }
+
+    void Close() {
+        if (sqes_ != MAP_FAILED) ::munmap(sqes_, sqes_size_);
+        if (cq_ring_ != MAP_FAILED && cq_ring_ != sq_ring_)
+            ::munmap(cq_ring_, cq_ring_size_);
+        if (sq_ring_ != MAP_FAILED) ::munmap(sq_ring_, sq_ring_size_);
+        sqes_ = cq_ring_ = sq_ring_ = MAP_FAILED;
+        if (fd_ >= 0) ::close(fd_);
+        fd_ = -1;
+    }
+
+    int fd_;
+    unsigned depth_;
+    void* sq_ring_;
+    void* cq_ring_;
+    void* sqes_;
+    std::size_t sq_ring_size_;
+    std::size_t cq_ring_size_;
+    std::size_t sqes_size_;
+    unsigned* sq_head_;
+    unsigned* sq_tail_;
+    unsigned sq_mask_;
+    unsigned* sq_array_;
+    unsigned* cq_head_;
+    unsigned* cq_tail_;
+    unsigned cq_mask_;
+    io_uring_cqe* cqes_;
+    // entries queued but not yet handed to the kernel
+    unsigned pending_;
+    // the owner of the registered buffers, and the last owner whose buffers
+    // the kernel refused. zero for none
+    uint64_t owner_;
+    uint64_t refused_;
+};
@@ -0,0 +1,164 @@
+#pragma once
+
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <new>
+
+/**
+ * The NUMA topology of the machine, and placing memory on its nodes, driven
+ * through the raw system calls so that nothing has to link libnuma. On a
+ * machine, or in a container, without NUMA everything reports a single node
+ * and placing memory does nothing.
+ */
+class Numa {
+   public:
+    // the most nodes placement masks cover
+    static constexpr int kMaxNodes = 64;
+
+    // memory is bound a page at a time, so placed blocks are whole pages
+    static constexpr std::size_t kPageSize = 4096;
+
+    // where Place puts memory that is spread page by page over every node
+    static constexpr int kInterleave = -1;
+
+    // where Place leaves memory to the kernel's default, which is the node of
+    // the thread that first touches it
+    static constexpr int kAnyNode = -2;
+
+    /**
+     * The number of NUMA nodes, counting from node 0 to the highest online
+     * one
+     */
+    static auto NodeCount() -> int {
+        static const auto count = ReadNodeCount();
+        return count;
+    }
+
+    /**
+     * The node the calling thread runs on. Asking the kernel costs a little
+     * even through the vDSO, so the answer is cached for kRefresh calls,
+     * after which a thread the scheduler has moved notices
+     */
+    static auto CurrentNode() -> int {
+        constexpr unsigned kRefresh = 256;
+        thread_local unsigned calls = 0;
+        thread_local int node = 0;
+        if (calls++ % kRefresh == 0) {
+            auto cpu = 0u;
+            auto current = 0u;
+            node = ::getcpu(&cpu, &current) == 0
+                       ? std::min(static_cast<int>(current), NodeCount() - 1)
+                       : 0;
+        }
+        return node;
+    }
+
+    /**
+     * The node the page holding addr lives on, or -1 if the kernel does not
+     * say
+     */
+    static auto NodeOf(const void* addr) -> int {
+        auto node = 0;
+        if (::syscall(SYS_get_mempolicy, &node, nullptr, 0, addr,
+                      MPOL_F_NODE | MPOL_F_ADDR) != 0)
+            return -1;
+        return node;
+    }
+
+    /**
+     * Ask for the pages of the block, which must be page aligned and not
+     * touched yet, to be put on the node, or on every node in turn for
+     * kInterleave. Only a preference, so a full node never fails an
+     * allocation. Does nothing on a machine with a single node
+     */
+    static void Place(void* block, std::size_t size, int node) {
+        if (NodeCount() < 2 || node == kAnyNode) return;
+        auto mask = uint64_t{0};
+        if (node != kInterleave)
+            mask = uint64_t{1} << node;
+        else if (NodeCount() == kMaxNodes)
+            mask = ~uint64_t{0};
+        else
+            mask = (uint64_t{1} << NodeCount()) - 1;
+        auto mode = node == kInterleave ? MPOL_INTERLEAVE : MPOL_PREFERRED;
+        ::syscall(SYS_mbind, block, size, mode, &mask, kMaxNodes + 1, 0);
+    }
+
+    /**
+     * Allocate size bytes, rounded up to whole pages, and place them
+     */
+    static auto AllocateOn(std::size_t size, int node) -> void* {
+        auto block = ::operator new(RoundUp(size), std::align_val_t{kPageSize});
+        Place(block, RoundUp(size), node);
+        return block;
+    }
+
+    /**
+     * Free a block from AllocateOn
+     */
+    static void Free(void* block) {
+        ::operator delete(block, std::align_val_t{kPageSize});
+    }
+
+    static constexpr auto RoundUp(std::size_t size) -> std::size_t {
+        return (size + kPageSize - 1) / kPageSize * kPageSize;
+    }
+
+   private:
+    // one past the highest online node, from sysfs, which lists the nodes as
+    // ranges such as "0-1,3"
+    static auto ReadNodeCount() -> int {
+        auto file = std::fopen("/sys/devices/system/node/online", "r");
+        if (file == nullptr) return 1;
+        auto count = 1;
+        auto lo = 0;
+        auto hi = 0;
+        while (std::fscanf(file, "%d", &lo) == 1) {
+            hi = lo;
+            auto separator = std::fgetc(file);
+            if (separator == '-' && std::fscanf(file, "%d", &hi) == 1)
+                separator = std::fgetc(file);
+            count = std::max(count, hi + 1);
+            if (separator != ',') break;
+        }
+        std::fclose(file);
+        return std::min(count, kMaxNodes);
+    }
+};
+
+/**
+ * Standard allocator for containers whose memory belongs on one node
+ */
+template <typename U>
+class NumaAllocator {
+   public:
+    using value_type = U;
+
+    explicit NumaAllocator(int node) : node_{node} {}
+
+    template <typename V>
+    NumaAllocator(const NumaAllocator<V>& other) : node_{other.GetNode()} {}
+
+    auto allocate(std::size_t n) -> U* {
+        return static_cast<U*>(Numa::AllocateOn(n * sizeof(U), node_));
+    }
+
+    void deallocate(U* block, std::size_t) { Numa::Free(block); }
+
+    inline auto GetNode() const -> int { return node_; }
+
+    template <typename V>
+    auto operator==(const NumaAllocator<V>& other) const -> bool {
+        return node_ == other.GetNode();
+    }
+
+   private:
+    int node_;
+};
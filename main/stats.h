@@ -0,0 +1,156 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+
+#include "main/allocator.h"
+#include "main/epoch.h"
+
+// define MEMORYTREE_STATS to count what the hot paths of a tree run into.
+// without it every hook below compiles to nothing and trees keep no counters
+#if defined(MEMORYTREE_STATS)
+constexpr bool kCollectStats = true;
+#else
+constexpr bool kCollectStats = false;
+#endif
+
+// splits are counted per level up to here, and higher ones with the top level
+constexpr int kStatsLevels = 32;
+
+/**
+ * A tree's counters summed over every thread, as returned by Tree::Stats()
+ * - right_moves: right links followed because a split moved keys away from
+ *   the node a thread arrived at
+ * - latch_waits, latch_wait_ns: how often and for how long threads waited on
+ *   a latch another thread held
+ * - splits: node splits on each level, the leaves being level 0
+ * - root_promotions: splits of the root, each adding a level to the tree
+ * - max_depth: the most levels a single descent went through
+ */
+struct TreeStats {
+    uint64_t right_moves = 0;
+    uint64_t latch_waits = 0;
+    uint64_t latch_wait_ns = 0;
+    std::array<uint64_t, kStatsLevels> splits{};
+    uint64_t root_promotions = 0;
+    uint64_t max_depth = 0;
+};
+
+/**
+ * One thread's counters for one tree, on cache lines of their own. Only the
+ * owning thread writes them, so counting is a relaxed load and store rather
+ * than a locked read-modify-write, and Tree::Stats() may read them a little
+ * stale
+ */
+class alignas(kCacheLineSize) StatsSlot {
+   public:
+    inline void CountRightMove() { Add(right_moves_, 1); }
+
+    inline void CountLatchWait(std::chrono::steady_clock::duration waited) {
+        Add(latch_waits_, 1);
+        Add(latch_wait_ns_,
+            std::chrono::duration_cast<std::chrono::nanoseconds>(waited)
+                .count());
+    }
+
+    inline void CountSplit(int level) {
+        Add(splits_[level < kStatsLevels ? level : kStatsLevels - 1], 1);
+    }
+
+    inline void CountRootPromotion() { Add(root_promotions_, 1); }
+
+    inline void CountDepth(int depth) {
+        auto value = static_cast<uint64_t>(depth);
+        if (value > max_depth_.load(std::memory_order_relaxed))
+            max_depth_.store(value, std::memory_order_relaxed);
+    }
+
+    void AddTo(TreeStats& totals) const {
+        totals.right_moves += right_moves_.load(std::memory_order_relaxed);
+        totals.latch_waits += latch_waits_.load(std::memory_order_relaxed);
+        totals.latch_wait_ns += latch_wait_ns_.load(std::memory_order_relaxed);
+        for (auto i = 0; i < kStatsLevels; i++)
+            totals.splits[i] += splits_[i].load(std::memory_order_relaxed);
+        totals.root_promotions +=
+            root_promotions_.load(std::memory_order_relaxed);
+        totals.max_depth = std::max(
+            totals.max_depth, max_depth_.load(std::memory_order_relaxed));
+    }
+
+   private:
+    static inline void Add(std::atomic<uint64_t>& counter, uint64_t n) {
+        counter.store(counter.load(std::memory_order_relaxed) + n,
+                      std::memory_order_relaxed);
+    }
+
+    std::atomic<uint64_t> right_moves_{0};
+    std::atomic<uint64_t> latch_waits_{0};
+    std::atomic<uint64_t> latch_wait_ns_{0};
+    std::array<std::atomic<uint64_t>, kStatsLevels> splits_{};
+    std::atomic<uint64_t> root_promotions_{0};
+    std::atomic<uint64_t> max_depth_{0};
+};
+
+/**
+ * Times a wait that may never happen. The clock is only read once Start()
+ * is first called, so an uncontended latch costs nothing, and Stop() counts
+ * the wait against stats if there was one. Stats may be null
+ */
+class StatsTimer {
+   public:
+    inline void Start() {
+        if constexpr (kCollectStats) {
+            if (!started_) start_ = std::chrono::steady_clock::now();
+            started_ = true;
+        }
+    }
+
+    inline void Stop(StatsSlot* stats) {
+        if constexpr (kCollectStats) {
+            if (started_ && stats != nullptr)
+                stats->CountLatchWait(std::chrono::steady_clock::now() -
+                                      start_);
+        }
+    }
+
+   private:
+    bool started_ = false;
+    std::chrono::steady_clock::time_point start_;
+};
+
+/**
+ * The per-thread counters of one tree, which are only allocated when stats
+ * are compiled in. Operations fetch the calling thread's slot once with
+ * Local(), which is null when they are not, and hand it to the hooks
+ */
+class StatsRecorder {
+    using Slots = std::array<StatsSlot, EpochManager::kMaxThreads>;
+
+   public:
+    explicit StatsRecorder()
+        : slots_{kCollectStats ? std::make_unique<Slots>() : nullptr} {}
+
+    inline auto Local() -> StatsSlot* {
+        if constexpr (kCollectStats)
+            return &(*slots_)[EpochManager::ThreadIndex()];
+        else
+            return nullptr;
+    }
+
+    /**
+     * Sum the counters of every thread. All zero when stats are compiled out
+     */
+    auto Collect() const -> TreeStats {
+        auto totals = TreeStats{};
+        if (slots_ == nullptr) return totals;
+        for (const auto& slot : *slots_) slot.AddTo(totals);
+        return totals;
+    }
+
+   private:
+    std::unique_ptr<Slots> slots_;
+};
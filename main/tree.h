@@ -0,0 +1,5515 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <optional>
+#include <ostream>
+#include <shared_mutex>
+#include <span>
+#include <stop_token>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "main/allocator.h"
+#include "main/buffer_pool.h"
+#include "main/epoch.h"
+#include "main/io_ring.h"
+#include "main/numa.h"
+#include "main/stats.h"
+#include "main/wal.h"
+
+#if defined(__AVX512F__) || defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+/**
+ * Intra-node search. LowerBound returns the index of the first of the count
+ * sorted keys that is not less than key, which is count if there is none.
+ * - Uses binary search
+ * - Requires operator== and operator< to be overloaded
+ */
+template <typename T>
+class KeySearch {
+   public:
+    static auto LowerBound(const T* keys, int count, const T& key) -> int {
+        auto start = 0;
+        auto end = count - 1;
+        while (start <= end) {
+            auto mid = (start + end) / 2;
+            if (keys[mid] == key)
+                return mid;
+            else if (keys[mid] < key)
+                start = mid + 1;
+            else
+                end = mid - 1;
+        }
+        return end + 1;
+    }
+};
+
+/**
+ * Intra-node search for integer keys. Since the keys are sorted, the lower
+ * bound is the number of keys less than key, so rather than taking log2(n)
+ * unpredictable branches this compares a whole vector register of keys at a
+ * time and counts the matching lanes. Uses AVX-512 or AVX2 on x86 and NEON on
+ * AArch64, whichever the build targets, falling back to a branch-free scalar
+ * loop for the tail of the node and for other targets.
+ */
+template <typename T>
+class VectorKeySearch {
+   public:
+    // the keys compared at once
+#if defined(__AVX512F__)
+    static constexpr int kLanes = static_cast<int>(64 / sizeof(T));
+#elif defined(__AVX2__)
+    static constexpr int kLanes = static_cast<int>(32 / sizeof(T));
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    static constexpr int kLanes = static_cast<int>(16 / sizeof(T));
+#else
+    static constexpr int kLanes = 1;
+#endif
+
+    static auto LowerBound(const T* keys, int count, const T& key) -> int {
+        auto index = 0;
+        auto less = 0;
+#if defined(__AVX512F__)
+        for (; index + kLanes <= count; index += kLanes) {
+            auto data = _mm512_loadu_si512(keys + index);
+            __mmask16 mask;
+            if constexpr (sizeof(T) == 4)
+                mask = _mm512_cmplt_epi32_mask(data, _mm512_set1_epi32(key));
+            else if constexpr (std::is_signed_v<T>)
+                mask = _mm512_cmplt_epi64_mask(data, _mm512_set1_epi64(key));
+            else
+                mask = _mm512_cmplt_epu64_mask(
+                    data, _mm512_set1_epi64(static_cast<int64_t>(key)));
+            less += std::popcount(static_cast<unsigned>(mask));
+        }
+#elif defined(__AVX2__)
+        for (; index + kLanes <= count; index += kLanes) {
+            auto data = _mm256_loadu_si256(
+                reinterpret_cast<const __m256i*>(keys + index));
+            if constexpr (sizeof(T) == 4) {
+                auto greater = _mm256_cmpgt_epi32(_mm256_set1_epi32(key), data);
+                less += std::popcount(static_cast<unsigned>(
+                    _mm256_movemask_ps(_mm256_castsi256_ps(greater))));
+            } else {
+                auto probe = _mm256_set1_epi64x(static_cast<int64_t>(key));
+                if constexpr (!std::is_signed_v<T>) {
+                    // AVX2 only compares signed lanes, so flip the sign bit of
+                    // both sides to compare unsigned keys in the same order
+                    auto bias = _mm256_set1_epi64x(INT64_MIN);
+                    data = _mm256_xor_si256(data, bias);
+                    probe = _mm256_xor_si256(probe, bias);
+                }
+                auto greater = _mm256_cmpgt_epi64(probe, data);
+                less += std::popcount(static_cast<unsigned>(
+                    _mm256_movemask_pd(_mm256_castsi256_pd(greater))));
+            }
+        }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+        for (; index + kLanes <= count; index += kLanes) {
+            // each matching lane is all ones, so shifting it down to a single
+            // bit and summing the lanes counts the matches
+            if constexpr (sizeof(T) == 4) {
+                auto lt = vcltq_s32(vld1q_s32(keys + index), vdupq_n_s32(key));
+                less += vaddvq_u32(vshrq_n_u32(lt, 31));
+            } else if constexpr (std::is_signed_v<T>) {
+                auto lt = vcltq_s64(vld1q_s64(keys + index), vdupq_n_s64(key));
+                less += vaddvq_u64(vshrq_n_u64(lt, 63));
+            } else {
+                auto lt = vcltq_u64(vld1q_u64(keys + index), vdupq_n_u64(key));
+                less += vaddvq_u64(vshrq_n_u64(lt, 63));
+            }
+        }
+#endif
+        for (; index < count; index++) less += keys[index] < key;
+        return less;
+    }
+};
+
+/**
+ * Intra-node search for integer keys in large nodes, where counting every
+ * key less than the probe costs more than it saves. The node's first and
+ * last keys make a linear model of where a key sits, which is exact for
+ * evenly spread keys. From the predicted slot the search gallops outwards
+ * until it brackets the key, halves the bracket down to a few vectors, and
+ * counts those with VectorKeySearch, so a bad prediction costs O(log n) like
+ * binary search rather than a scan of the node.
+ * - Nodes with fewer than kMinKeys keys go straight to VectorKeySearch. The
+ *   wider the vectors, the longer counting them all stays cheaper
+ */
+template <typename T>
+class InterpolationKeySearch {
+   public:
+    static constexpr int kMinKeys = 48 * VectorKeySearch<T>::kLanes;
+
+    static auto LowerBound(const T* keys, int count, const T& key) -> int {
+        if (count < kMinKeys)
+            return VectorKeySearch<T>::LowerBound(keys, count, key);
+        if (!(keys[0] < key)) return 0;
+        if (keys[count - 1] < key) return count;
+        // from here keys[lo] < key <= keys[hi] holds
+        auto lo = 0;
+        auto hi = count - 1;
+        auto fraction = (static_cast<double>(key) - keys[0]) /
+                        (static_cast<double>(keys[hi]) - keys[0]);
+        auto guess = std::clamp(static_cast<int>(fraction * hi), 1, hi - 1);
+        if (keys[guess] < key) {
+            lo = guess;
+            for (auto step = kWindow; lo + step < hi; step *= 2) {
+                if (!(keys[lo + step] < key)) {
+                    hi = lo + step;
+                    break;
+                }
+                lo += step;
+            }
+        } else {
+            hi = guess;
+            for (auto step = kWindow; hi - step > lo; step *= 2) {
+                if (keys[hi - step] < key) {
+                    lo = hi - step;
+                    break;
+                }
+                hi -= step;
+            }
+        }
+        while (hi - lo > kWindow) {
+            auto mid = lo + (hi - lo) / 2;
+            if (keys[mid] < key)
+                lo = mid;
+            else
+                hi = mid;
+        }
+        return lo + 1 +
+               VectorKeySearch<T>::LowerBound(keys + lo + 1, hi - lo - 1, key);
+    }
+
+   private:
+    // keys counted with vectors once the bracket is this small
+    static constexpr int kWindow = static_cast<int>(64 / sizeof(T));
+};
+
+template <>
+class KeySearch<int32_t> : public InterpolationKeySearch<int32_t> {};
+
+template <>
+class KeySearch<int64_t> : public InterpolationKeySearch<int64_t> {};
+
+template <>
+class KeySearch<uint64_t> : public InterpolationKeySearch<uint64_t> {};
+
+/**
+ * How a leaf stores a value of type K in the value array that runs parallel
+ * to its keys. Small trivially copyable values are kept inline, so a hit
+ * costs no memory access beyond the leaf itself. Anything else is boxed on
+ * the heap and the array holds the pointer, which keeps leaves compact and
+ * lets optimistic readers copy a slot without tearing the value.
+ */
+template <typename K>
+class ValueSlot {
+   public:
+    static constexpr bool kInline =
+        std::is_trivially_copyable_v<K> && sizeof(K) <= 2 * sizeof(void*);
+
+    using Slot = std::conditional_t<kInline, K, K*>;
+
+    static auto Box(const K& val) -> Slot {
+        if constexpr (kInline)
+            return val;
+        else
+            return new K(val);
+    }
+
+    static auto Unbox(const Slot& slot) -> const K& {
+        if constexpr (kInline)
+            return slot;
+        else
+            return *slot;
+    }
+
+    static void Free(Slot& slot) {
+        if constexpr (!kInline) delete slot;
+    }
+};
+
+// a split that makes room for appends at the right end of a level moves
+// one in this many keys into the new node, so that sequential inserts leave
+// nearly full nodes behind
+constexpr int kAppendShare = 10;
+
+/**
+ * How a node stores its keys and its high key. Nodes pass in how many keys
+ * they hold, and only ever call the mutating members while latched. The
+ * default keeps the keys in an inline array and searches them with
+ * KeySearch<T>.
+ * - kBounded is whether keys also take up a byte budget, kBudget, on top of
+ *   their slot. Fits() and the other Can*() members are how nodes check it
+ * - Keys must lie within the bounds passed to SetFences(), so a key store may
+ *   drop whatever prefix the bounds have in common
+ */
+template <typename T, int N>
+class KeyArray {
+   public:
+    static constexpr bool kBounded = false;
+    static constexpr int kBudget = 0;
+
+    // how much of the byte budget the key takes up in a node without a prefix
+    static auto Weight(const T&) -> int { return 0; }
+
+    inline auto Get(int i) const -> const T& { return keys_[i]; }
+
+    inline auto LowerBound(int count, const T& key) const -> int {
+        return KeySearch<T>::LowerBound(keys_, count, key);
+    }
+
+    inline auto Equals(int i, const T& key) const -> bool {
+        return keys_[i] == key;
+    }
+
+    inline auto GetHighKey() const -> std::optional<T> { return high_key_; }
+
+    inline auto HighKeyBelow(const T& key) const -> bool {
+        return high_key_.has_value() && *high_key_ < key;
+    }
+
+    // the new high key must not be below any key held
+    inline void SetHighKey(const std::optional<T>& high_key) {
+        high_key_ = high_key;
+    }
+
+    inline void SetFences(int, const std::optional<T>&,
+                          const std::optional<T>& high_key) {
+        high_key_ = high_key;
+    }
+
+    inline auto Fits(int, const T&) const -> bool { return true; }
+
+    inline auto CanReplace(int, int, const T&) const -> bool { return true; }
+
+    inline auto CanAbsorb(int, const KeyArray&, int, bool) const -> bool {
+        return true;
+    }
+
+    inline auto CanShiftRight(int, int, const KeyArray&, int, bool) const
+        -> bool {
+        return true;
+    }
+
+    // the number of keys the left half of a split keeps, the promoted key
+    // included. the left half keeps the larger half of the keys, or all but
+    // a tenth of them when the split makes room for appends
+    inline auto SplitPoint(int count, bool, bool append) const -> int {
+        if (append) return count - std::max(count / kAppendShare, 1);
+        return count % 2 == 0 ? count / 2 : count / 2 + 1;
+    }
+
+    void Insert(int count, int at, const T& key) {
+        std::move_backward(keys_ + at, keys_ + count, keys_ + count + 1);
+        keys_[at] = key;
+    }
+
+    void Remove(int count, int at) {
+        std::move(keys_ + at + 1, keys_ + count, keys_ + at);
+    }
+
+    inline void Replace(int, int i, const T& key) { keys_[i] = key; }
+
+    // move the keys from mid on into the empty right array, keep the first
+    // keep keys, and return the key at mid - 1 that now bounds the two
+    auto Split(int count, int mid, int, KeyArray& right) -> T {
+        auto promoted_key = keys_[mid - 1];
+        right.high_key_ = high_key_;
+        std::move(keys_ + mid, keys_ + count, right.keys_);
+        high_key_ = promoted_key;
+        return promoted_key;
+    }
+
+    // take over the keys and the high key of the right array. with separator
+    // set, the old high key is kept as a key between the two sets of keys
+    void Absorb(int count, KeyArray& right, int right_count, bool separator) {
+        if (separator) keys_[count++] = *high_key_;
+        std::move(right.keys_, right.keys_ + right_count, keys_ + count);
+        high_key_ = right.high_key_;
+    }
+
+    // move the last moved keys onto the front of the right array, and return
+    // the new high key. internal nodes hand their old high key down to the
+    // right and promote the key before the moved ones instead
+    auto ShiftRight(int count, int moved, KeyArray& right, int right_count,
+                    bool leaf) -> T {
+        std::move_backward(right.keys_, right.keys_ + right_count,
+                           right.keys_ + right_count + moved);
+        if (leaf) {
+            std::move(keys_ + count - moved, keys_ + count, right.keys_);
+            high_key_ = keys_[count - moved - 1];
+        } else {
+            std::move(keys_ + count - moved + 1, keys_ + count, right.keys_);
+            right.keys_[moved - 1] = *high_key_;
+            high_key_ = keys_[count - moved];
+        }
+        return *high_key_;
+    }
+
+    // free whatever the first count keys hold off the node, which is nothing
+    void Free(int) {}
+
+   private:
+    // the largest key this node may hold. only the rightmost node on each
+    // level has none
+    std::optional<T> high_key_;
+    T keys_[N];
+};
+
+/**
+ * Keys for std::string. Since a node's keys all lie between its bounds, they
+ * all start with the prefix its low and high keys share, so the prefix is
+ * kept once per node (as the front of the high key) and only the suffixes
+ * are stored. The first kSliceBytes bytes of each suffix are kept inline as
+ * a big-endian integer, so most comparisons are one integer compare and the
+ * slices are searched with VectorKeySearch. The rest of each suffix goes into
+ * a heap inside the node, sized from N, which keeps the node self-contained
+ * for keys of ordinary length: every offset an optimistic reader reads is
+ * clamped to the node, so a torn read is only ever wrong, never unsafe.
+ * - A suffix with more than kSpillBytes past its slice is spilled: the whole
+ *   key goes into an immutable string off the node, and so does a high key
+ *   longer than kInlineLength. A spilled string moves with its key when keys
+ *   move between nodes, and one the keys drop is retired through
+ *   EpochManager::Shared(), so a reader may follow the pointer for as long
+ *   as it is pinned. Keys of any length can be stored
+ * - The heap takes every inline suffix byte past the slice out of kBudget,
+ *   and a node splits when it runs out of either slots or budget
+ */
+template <int N>
+class KeyArray<std::string, N> {
+   public:
+    static constexpr bool kBounded = true;
+    static constexpr int kSliceBytes = sizeof(uint64_t);
+    static constexpr int kHeapBytes = 32 * N;
+    // longer suffixes are spilled, so every inline one fits in a quarter of
+    // the heap, which is what lets a split always leave both halves within
+    // budget
+    static constexpr int kSpillBytes = kHeapBytes / 4;
+    static constexpr int kBudget = kHeapBytes - kSpillBytes;
+    // the longest suffix, and high key, kept in the node
+    static constexpr int kInlineLength = kSliceBytes + kSpillBytes;
+
+    static_assert(kHeapBytes <= std::numeric_limits<uint16_t>::max() / 2,
+                  "heap offsets and suffix lengths are 16 bits");
+
+    static auto Weight(const std::string& key) -> int {
+        return HeapBytes(Clamp(key.size()));
+    }
+
+    auto Get(int i) const -> std::string {
+        if (auto spill = spills_[i]; spill != nullptr) return *spill;
+        auto length = Length(i);
+        auto key = std::string{Prefix()};
+        for (auto b = 0; b < std::min(length, kSliceBytes); b++)
+            key.push_back(static_cast<char>(slices_[i] >> (56 - 8 * b)));
+        if (length > kSliceBytes) key.append(Remainder(i, length));
+        return key;
+    }
+
+    auto LowerBound(int count, const std::string& key) const -> int {
+        auto prefix = Prefix();
+        auto order = std::string_view{key}.compare(0, prefix.size(), prefix);
+        if (order < 0) return 0;
+        if (order > 0) return count;
+        auto suffix = std::string_view{key}.substr(prefix.size());
+        auto slice = Slice(suffix);
+        // narrow down to the keys whose slice matches with a vector search,
+        // and only compare the rest of those
+        auto lo = VectorKeySearch<uint64_t>::LowerBound(slices_, count, slice);
+        auto hi = count;
+        if (slice != std::numeric_limits<uint64_t>::max())
+            hi = lo + VectorKeySearch<uint64_t>::LowerBound(
+                          slices_ + lo, count - lo, slice + 1);
+        while (lo < hi) {
+            auto mid = (lo + hi) / 2;
+            if (Compare(mid, suffix, slice) < 0)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        return lo;
+    }
+
+    auto Equals(int i, const std::string& key) const -> bool {
+        auto prefix = Prefix();
+        if (!std::string_view{key}.starts_with(prefix)) return false;
+        auto suffix = std::string_view{key}.substr(prefix.size());
+        return Compare(i, suffix, Slice(suffix)) == 0;
+    }
+
+    auto GetHighKey() const -> std::optional<std::string> {
+        if (!has_high_key_) return std::nullopt;
+        return std::string{HighKey()};
+    }
+
+    inline auto HighKeyBelow(const std::string& key) const -> bool {
+        return has_high_key_ && HighKey() < key;
+    }
+
+    // the prefix is the front of the high key, so the new high key must start
+    // with it
+    void SetHighKey(const std::optional<std::string>& high_key) {
+        Retire(high_spill_);
+        high_spill_ = nullptr;
+        has_high_key_ = high_key.has_value();
+        high_key_length_ = 0;
+        if (!has_high_key_) return;
+        if (high_key->size() > kInlineLength)
+            high_spill_ = new std::string{*high_key};
+        else
+            std::memcpy(high_key_, high_key->data(), high_key->size());
+        high_key_length_ = static_cast<uint32_t>(high_key->size());
+    }
+
+    void SetFences(int count, const std::optional<std::string>& low_key,
+                   const std::optional<std::string>& high_key) {
+        auto keys = Decode(0, count);
+        SetHighKey(high_key);
+        prefix_ = low_key.has_value() && high_key.has_value()
+                      ? CommonPrefix(*low_key, *high_key)
+                      : 0;
+        Encode(keys);
+    }
+
+    inline auto Fits(int, const std::string& key) const -> bool {
+        return live_ + SuffixBytes(key) <= kBudget;
+    }
+
+    auto CanReplace(int, int i, const std::string& key) const -> bool {
+        return live_ - HeapBytes(Length(i)) + SuffixBytes(key) <= kBudget;
+    }
+
+    auto CanAbsorb(int count, const KeyArray& right, int right_count,
+                   bool separator) const -> bool {
+        auto prefix = CommonPrefix(Prefix(), right.Prefix());
+        auto bytes = HeapBytes(0, count, prefix) +
+                     right.HeapBytes(0, right_count, prefix) +
+                     (separator ? HeapBytes(HighKeyLength() - prefix) : 0);
+        return bytes <= kBudget;
+    }
+
+    auto CanShiftRight(int count, int moved, const KeyArray& right,
+                       int right_count, bool leaf) const -> bool {
+        auto prefix = CommonPrefix(Prefix(), right.Prefix());
+        auto bytes = right.HeapBytes(0, right_count, prefix);
+        if (leaf)
+            bytes += HeapBytes(count - moved, count, prefix);
+        else
+            bytes += HeapBytes(count - moved + 1, count, prefix) +
+                     HeapBytes(HighKeyLength() - prefix);
+        return bytes <= kBudget;
+    }
+
+    // split at the middle by count if both halves stay within budget, or else
+    // at the middle by bytes. a split that makes room for appends leaves only
+    // a tenth of the keys on the right, if the left stays within budget
+    auto SplitPoint(int count, bool leaf, bool append) const -> int {
+        if (append) {
+            auto mid = count - std::max(count / kAppendShare, 1);
+            for (; mid > 1; mid--) {
+                if (HeapBytes(0, leaf ? mid : mid - 1, prefix_) <= kBudget &&
+                    HeapBytes(mid, count, prefix_) <= kBudget)
+                    return mid;
+            }
+        }
+        auto mid = count % 2 == 0 ? count / 2 : count / 2 + 1;
+        auto keep = leaf ? mid : mid - 1;
+        if (HeapBytes(0, keep, prefix_) <= kBudget &&
+            HeapBytes(mid, count, prefix_) <= kBudget)
+            return mid;
+        auto total = HeapBytes(0, count, prefix_);
+        auto bytes = 0;
+        mid = 0;
+        while (mid < count - 1 && bytes < total / 2)
+            bytes += HeapBytes(Length(mid++));
+        return std::max(mid, 1);
+    }
+
+    void Insert(int count, int at, const std::string& key) {
+        if (used_ + SuffixBytes(key) > kHeapBytes) Pack(count);
+        std::move_backward(slices_ + at, slices_ + count, slices_ + count + 1);
+        std::move_backward(lengths_ + at, lengths_ + count,
+                           lengths_ + count + 1);
+        std::move_backward(offsets_ + at, offsets_ + count,
+                           offsets_ + count + 1);
+        std::move_backward(spills_ + at, spills_ + count, spills_ + count + 1);
+        Encode(at, key);
+    }
+
+    void Remove(int count, int at) {
+        live_ -= HeapBytes(Length(at));
+        Retire(spills_[at]);
+        std::move(slices_ + at + 1, slices_ + count, slices_ + at);
+        std::move(lengths_ + at + 1, lengths_ + count, lengths_ + at);
+        std::move(offsets_ + at + 1, offsets_ + count, offsets_ + at);
+        std::move(spills_ + at + 1, spills_ + count, spills_ + at);
+        spills_[count - 1] = nullptr;
+    }
+
+    void Replace(int count, int i, const std::string& key) {
+        live_ -= HeapBytes(Length(i));
+        // the old suffix is garbage from here on
+        lengths_[i] = 0;
+        Retire(spills_[i]);
+        spills_[i] = nullptr;
+        if (used_ + SuffixBytes(key) > kHeapBytes) Pack(count);
+        Encode(i, key);
+    }
+
+    auto Split(int count, int mid, int keep, KeyArray& right) -> std::string {
+        auto promoted_key = Get(mid - 1);
+        right.SetFences(0, promoted_key, GetHighKey());
+        right.Encode(Decode(mid, count));
+        live_ -= HeapBytes(keep, count, prefix_);
+        // the keys moved right took their spilled strings along, and the
+        // promoted key of an internal node is dropped
+        for (auto i = keep; i < mid; i++) Retire(spills_[i]);
+        Disown(keep, count);
+        SetHighKey(promoted_key);
+        return promoted_key;
+    }
+
+    void Absorb(int count, KeyArray& right, int right_count, bool separator) {
+        auto keys = Decode(0, count);
+        if (separator) keys.push_back({std::string{HighKey()}, nullptr});
+        auto right_keys = right.Decode(0, right_count);
+        keys.insert(keys.end(), right_keys.begin(), right_keys.end());
+        right.Disown(0, right_count);
+        // both prefixes are fronts of this node's new high key
+        auto prefix = CommonPrefix(Prefix(), right.Prefix());
+        SetHighKey(right.GetHighKey());
+        prefix_ = prefix;
+        Encode(keys);
+    }
+
+    auto ShiftRight(int count, int moved, KeyArray& right, int right_count,
+                    bool leaf) -> std::string {
+        auto first = leaf ? count - moved : count - moved + 1;
+        auto keys = Decode(first, count);
+        if (!leaf) keys.push_back({std::string{HighKey()}, nullptr});
+        auto right_keys = right.Decode(0, right_count);
+        keys.insert(keys.end(), right_keys.begin(), right_keys.end());
+        right.prefix_ = CommonPrefix(Prefix(), right.Prefix());
+        right.Encode(keys);
+        auto high_key = Get(leaf ? count - moved - 1 : count - moved);
+        live_ -= HeapBytes(count - moved, count, prefix_);
+        // the key an internal node sends up in place of its high key is
+        // dropped
+        for (auto i = count - moved; i < first; i++) Retire(spills_[i]);
+        Disown(count - moved, count);
+        SetHighKey(high_key);
+        return high_key;
+    }
+
+    /**
+     * Free the spilled strings of the first count keys and of the high key
+     * right away. Only for a node no reader can reach any more
+     */
+    void Free(int count) {
+        for (auto i = 0; i < count; i++) delete spills_[i];
+        delete high_spill_;
+    }
+
+   private:
+    // a key taken out of a node to be stored again, with the string it was
+    // spilled to if it was
+    struct Entry {
+        std::string key;
+        const std::string* spill;
+    };
+
+    // suffix lengths are stored clamped to this, which is still long enough
+    // to tell that the suffix is spilled
+    static constexpr int kMaxLength = std::numeric_limits<uint16_t>::max();
+
+    static constexpr auto Clamp(std::size_t length) -> int {
+        return static_cast<int>(std::min<std::size_t>(length, kMaxLength));
+    }
+
+    // the bytes of a suffix this long that go into the heap, which is none
+    // if it is spilled
+    static constexpr auto HeapBytes(int length) -> int {
+        auto bytes = std::max(length - kSliceBytes, 0);
+        return bytes > kSpillBytes ? 0 : bytes;
+    }
+
+    // the heap bytes the key would take up in this node
+    inline auto SuffixBytes(const std::string& key) const -> int {
+        return HeapBytes(Clamp(key.size() - prefix_));
+    }
+
+    // free a spilled string the keys no longer hold once no reader can still
+    // be following a pointer to it
+    static void Retire(const std::string* spill) {
+        if (spill == nullptr) return;
+        EpochManager::Shared().Retire(
+            const_cast<std::string*>(spill),
+            [](void*, void* ptr) { delete static_cast<std::string*>(ptr); },
+            nullptr);
+    }
+
+    // forget the spilled strings of keys first..last - 1, which have moved
+    // to another node. no slot past the last key may keep a pointer, since
+    // the string it points to is freed once the other node drops it
+    void Disown(int first, int last) {
+        std::fill(spills_ + first, spills_ + last, nullptr);
+    }
+
+    // the heap bytes keys first..last - 1 would take up under a prefix this
+    // long, which must be no longer than the current one
+    auto HeapBytes(int first, int last, int prefix) const -> int {
+        auto bytes = 0;
+        for (auto i = first; i < last; i++)
+            bytes += HeapBytes(prefix_ + Length(i) - prefix);
+        return bytes;
+    }
+
+    static auto CommonPrefix(std::string_view a, std::string_view b) -> int {
+        auto length = std::min(a.size(), b.size());
+        auto i = std::size_t{0};
+        while (i < length && a[i] == b[i]) i++;
+        return static_cast<int>(i);
+    }
+
+    // the first kSliceBytes bytes of the suffix as a big-endian integer, zero
+    // padded, so slices compare in the same order as the bytes they hold
+    static auto Slice(std::string_view suffix) -> uint64_t {
+        auto slice = uint64_t{0};
+        auto length = std::min<std::size_t>(suffix.size(), kSliceBytes);
+        for (std::size_t b = 0; b < length; b++)
+            slice |= uint64_t{static_cast<unsigned char>(suffix[b])}
+                     << (56 - 8 * b);
+        return slice;
+    }
+
+    // every length and offset below is clamped, so that an optimistic reader
+    // racing a writer never reads outside of the node. a spill pointer it
+    // reads is null or points to a string that is not freed before it unpins
+    inline auto Length(int i) const -> int { return lengths_[i]; }
+
+    inline auto Prefix() const -> std::string_view {
+        auto high_key = HighKey();
+        return high_key.substr(0, std::min<std::size_t>(prefix_,
+                                                        high_key.size()));
+    }
+
+    inline auto HighKey() const -> std::string_view {
+        if (auto spill = high_spill_; spill != nullptr) return *spill;
+        return {high_key_,
+                std::min<std::size_t>(high_key_length_, kInlineLength)};
+    }
+
+    inline auto HighKeyLength() const -> int {
+        return Clamp(HighKey().size());
+    }
+
+    inline auto Remainder(int i, int length) const -> std::string_view {
+        if (auto spill = spills_[i]; spill != nullptr) {
+            auto offset = std::min<std::size_t>(prefix_ + kSliceBytes,
+                                                spill->size());
+            return std::string_view{*spill}.substr(offset);
+        }
+        auto size = std::min(length - kSliceBytes, kSpillBytes);
+        auto offset = std::min<int>(offsets_[i], kHeapBytes - size);
+        return {heap_ + offset, static_cast<std::size_t>(size)};
+    }
+
+    // compare key i against a suffix and its slice
+    auto Compare(int i, std::string_view suffix, uint64_t slice) const
+        -> int {
+        if (slices_[i] != slice) return slices_[i] < slice ? -1 : 1;
+        auto length = Length(i);
+        auto size = static_cast<int>(suffix.size());
+        if (length > kSliceBytes && size > kSliceBytes)
+            return Remainder(i, length).compare(suffix.substr(kSliceBytes));
+        // the slices match, so whichever is shorter comes first
+        return length < size ? -1 : (length > size ? 1 : 0);
+    }
+
+    auto Decode(int first, int last) const -> std::vector<Entry> {
+        auto keys = std::vector<Entry>{};
+        keys.reserve(last - first);
+        for (auto i = first; i < last; i++)
+            keys.push_back({Get(i), spills_[i]});
+        return keys;
+    }
+
+    // replace every key with keys, under the current prefix. the heap is
+    // rebuilt from scratch
+    void Encode(const std::vector<Entry>& keys) {
+        used_ = 0;
+        live_ = 0;
+        for (std::size_t i = 0; i < keys.size(); i++)
+            Encode(static_cast<int>(i), keys[i].key, keys[i].spill);
+        Disown(static_cast<int>(keys.size()), N);
+    }
+
+    // store key i, in the string it was spilled to if it stays spilled. the
+    // heap must have room for its suffix
+    void Encode(int i, std::string_view key,
+                const std::string* spill = nullptr) {
+        auto suffix = key.substr(prefix_);
+        slices_[i] = Slice(suffix);
+        lengths_[i] = static_cast<uint16_t>(Clamp(suffix.size()));
+        offsets_[i] = used_;
+        spills_[i] = nullptr;
+        if (static_cast<int>(suffix.size()) - kSliceBytes > kSpillBytes) {
+            spills_[i] = spill != nullptr ? spill : new std::string{key};
+            return;
+        }
+        Retire(spill);
+        auto bytes = HeapBytes(static_cast<int>(suffix.size()));
+        if (bytes == 0) return;
+        std::memcpy(heap_ + used_, suffix.data() + kSliceBytes, bytes);
+        used_ += bytes;
+        live_ += bytes;
+    }
+
+    // move the suffixes of the first count keys to the front of the heap, in
+    // order, dropping the garbage left behind by removed keys
+    void Pack(int count) {
+        char packed[kHeapBytes];
+        auto used = 0;
+        for (auto i = 0; i < count; i++) {
+            auto bytes = HeapBytes(Length(i));
+            if (bytes == 0) continue;
+            std::memcpy(packed + used, heap_ + offsets_[i], bytes);
+            offsets_[i] = static_cast<uint16_t>(used);
+            used += bytes;
+        }
+        std::memcpy(heap_, packed, used);
+        used_ = static_cast<uint16_t>(used);
+    }
+
+    bool has_high_key_ = false;
+    uint32_t high_key_length_ = 0;
+    // the length of the prefix every key shares. the prefix itself is the
+    // front of the high key
+    uint32_t prefix_ = 0;
+    // the end of the heap, and how many bytes of it are still in use
+    uint16_t used_ = 0;
+    uint16_t live_ = 0;
+    uint64_t slices_[N] = {};
+    uint16_t lengths_[N] = {};
+    uint16_t offsets_[N] = {};
+    // the strings spilled keys are kept in. null for inline keys, and for
+    // every slot past the last key
+    const std::string* spills_[N] = {};
+    // the string a high key too long for high_key_ is kept in, or null
+    const std::string* high_spill_ = nullptr;
+    char high_key_[kInlineLength];
+    char heap_[kHeapBytes];
+};
+
+/**
+ * The entries of a cold leaf, packed into one block off the node that is
+ * never changed once built, so optimistic readers can read it for as long as
+ * they are pinned. Keys are stored frame-of-reference, as their difference
+ * from the smallest key in the fewest bytes that hold the largest one.
+ * Values are stored the same way if they are integers, or byte for byte if
+ * not, unless a dictionary of the distinct values and a code per entry is
+ * smaller. Every field is fixed width, so entry i is read without decoding
+ * the ones before it and the keys are binary searched in place.
+ * - Only integer keys and inline values can be packed (kSupported)
+ */
+template <typename T, typename K>
+class ColdLeaf {
+   public:
+    static constexpr bool kSupported =
+        std::is_integral_v<T> && ValueSlot<K>::kInline;
+
+    /**
+     * Pack the entries, which must be sorted by key, into a new block. Free
+     * it with Free()
+     */
+    static auto Build(std::span<const T> keys, std::span<const K> values)
+        -> ColdLeaf* {
+        auto count = static_cast<int>(keys.size());
+        auto key_base = count > 0 ? static_cast<uint64_t>(keys.front()) : 0;
+        auto key_width =
+            count > 0 ? WidthOf(static_cast<uint64_t>(keys.back()) - key_base)
+                      : 0;
+        // the smallest value and the largest difference from it, which is
+        // what frame-of-reference takes for integer values
+        auto value_base = uint64_t{0};
+        auto value_width = static_cast<int>(sizeof(K));
+        if constexpr (std::is_integral_v<K>) {
+            if (count > 0) {
+                auto [lo, hi] =
+                    std::minmax_element(values.begin(), values.end());
+                value_base = static_cast<uint64_t>(*lo);
+                value_width = WidthOf(static_cast<uint64_t>(*hi) - value_base);
+            }
+        }
+        // distinct values, compared byte for byte
+        auto dictionary = std::vector<K>(values.begin(), values.end());
+        std::sort(dictionary.begin(), dictionary.end(), ByteLess);
+        dictionary.erase(
+            std::unique(dictionary.begin(), dictionary.end(),
+                        [](const K& a, const K& b) {
+                            return std::memcmp(&a, &b, sizeof(K)) == 0;
+                        }),
+            dictionary.end());
+        auto code_width = dictionary.size() > 1
+                              ? WidthOf(dictionary.size() - 1)
+                              : 0;
+        auto entries = static_cast<std::size_t>(count);
+        auto use_dictionary =
+            dictionary.size() * sizeof(K) + entries * code_width <
+            entries * value_width;
+        if (!use_dictionary) dictionary.clear();
+
+        auto leaf_width = use_dictionary ? code_width : value_width;
+        auto bytes = entries * (key_width + leaf_width) +
+                     dictionary.size() * sizeof(K);
+        auto leaf = new (::operator new(sizeof(ColdLeaf) + bytes)) ColdLeaf{};
+        leaf->count_ = count;
+        leaf->key_width_ = static_cast<uint8_t>(key_width);
+        leaf->value_width_ = static_cast<uint8_t>(leaf_width);
+        leaf->dictionary_size_ = static_cast<uint32_t>(dictionary.size());
+        leaf->key_base_ = key_base;
+        leaf->value_base_ = value_base;
+        leaf->bytes_ = bytes;
+        for (auto i = 0; i < count; i++) {
+            leaf->Store(leaf->KeyAt(i), key_width,
+                        static_cast<uint64_t>(keys[i]) - key_base);
+            if (use_dictionary) {
+                auto code = std::lower_bound(dictionary.begin(),
+                                             dictionary.end(), values[i],
+                                             ByteLess) -
+                            dictionary.begin();
+                leaf->Store(leaf->ValueAt(i), code_width,
+                            static_cast<uint64_t>(code));
+            } else if constexpr (std::is_integral_v<K>) {
+                leaf->Store(leaf->ValueAt(i), value_width,
+                            static_cast<uint64_t>(values[i]) - value_base);
+            } else {
+                std::memcpy(leaf->ValueAt(i), &values[i], sizeof(K));
+            }
+        }
+        if (!dictionary.empty())
+            std::memcpy(leaf->DictionaryAt(0), dictionary.data(),
+                        dictionary.size() * sizeof(K));
+        return leaf;
+    }
+
+    static void Free(const ColdLeaf* leaf) {
+        leaf->~ColdLeaf();
+        ::operator delete(const_cast<ColdLeaf*>(leaf));
+    }
+
+    inline auto GetCount() const -> int { return count_; }
+
+    /**
+     * The bytes the block takes up, its header included
+     */
+    inline auto GetSize() const -> std::size_t {
+        return sizeof(ColdLeaf) + bytes_;
+    }
+
+    inline auto GetKey(int i) const -> T {
+        return static_cast<T>(key_base_ + Load(KeyAt(i), key_width_));
+    }
+
+    auto GetValue(int i) const -> K {
+        auto val = K{};
+        if (dictionary_size_ > 0) {
+            std::memcpy(&val, DictionaryAt(Load(ValueAt(i), value_width_)),
+                        sizeof(K));
+        } else if constexpr (std::is_integral_v<K>) {
+            val = static_cast<K>(value_base_ + Load(ValueAt(i), value_width_));
+        } else {
+            std::memcpy(&val, ValueAt(i), sizeof(K));
+        }
+        return val;
+    }
+
+    /**
+     * The index of the first key that is not less than key, or the count if
+     * there is none
+     */
+    auto LowerBound(const T& key) const -> int {
+        auto lo = 0;
+        auto hi = count_;
+        while (lo < hi) {
+            auto mid = lo + (hi - lo) / 2;
+            if (GetKey(mid) < key)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        return lo;
+    }
+
+   private:
+    // the fewest of 0, 1, 2, 4 or 8 bytes that hold every value up to max
+    static auto WidthOf(uint64_t max) -> int {
+        if (max == 0) return 0;
+        if (max <= std::numeric_limits<uint8_t>::max()) return 1;
+        if (max <= std::numeric_limits<uint16_t>::max()) return 2;
+        if (max <= std::numeric_limits<uint32_t>::max()) return 4;
+        return 8;
+    }
+
+    static auto ByteLess(const K& a, const K& b) -> bool {
+        return std::memcmp(&a, &b, sizeof(K)) < 0;
+    }
+
+    // fields are stored through integers of their width, so the block reads
+    // back the way it was written on either byte order
+    template <typename U>
+    static inline auto LoadAs(const unsigned char* at) -> uint64_t {
+        auto field = U{};
+        std::memcpy(&field, at, sizeof(U));
+        return field;
+    }
+
+    static inline auto Load(const unsigned char* at, int width) -> uint64_t {
+        switch (width) {
+            case 1:
+                return LoadAs<uint8_t>(at);
+            case 2:
+                return LoadAs<uint16_t>(at);
+            case 4:
+                return LoadAs<uint32_t>(at);
+            case 8:
+                return LoadAs<uint64_t>(at);
+            default:
+                return 0;
+        }
+    }
+
+    template <typename U>
+    static inline void StoreAs(unsigned char* at, uint64_t field) {
+        auto narrow = static_cast<U>(field);
+        std::memcpy(at, &narrow, sizeof(U));
+    }
+
+    static inline void Store(unsigned char* at, int width, uint64_t field) {
+        switch (width) {
+            case 1:
+                return StoreAs<uint8_t>(at, field);
+            case 2:
+                return StoreAs<uint16_t>(at, field);
+            case 4:
+                return StoreAs<uint32_t>(at, field);
+            case 8:
+                return StoreAs<uint64_t>(at, field);
+        }
+    }
+
+    // the keys come first, then a value or a code per entry, then the
+    // dictionary
+    inline auto Data() const -> unsigned char* {
+        return reinterpret_cast<unsigned char*>(
+            const_cast<ColdLeaf*>(this) + 1);
+    }
+
+    inline auto KeyAt(int i) const -> unsigned char* {
+        return Data() + static_cast<std::size_t>(i) * key_width_;
+    }
+
+    inline auto ValueAt(int i) const -> unsigned char* {
+        return Data() + static_cast<std::size_t>(count_) * key_width_ +
+               static_cast<std::size_t>(i) * value_width_;
+    }
+
+    inline auto DictionaryAt(uint64_t code) const -> unsigned char* {
+        return Data() +
+               static_cast<std::size_t>(count_) * (key_width_ + value_width_) +
+               code * sizeof(K);
+    }
+
+    int count_ = 0;
+    // the width of each key, and of each value or code
+    uint8_t key_width_ = 0;
+    uint8_t value_width_ = 0;
+    // the number of distinct values, or 0 if values are stored directly
+    uint32_t dictionary_size_ = 0;
+    uint64_t key_base_ = 0;
+    uint64_t value_base_ = 0;
+    std::size_t bytes_ = 0;
+};
+
+// the most cache lines of a node Node::Prefetch() asks for. the lines past it
+// are left to the hardware prefetcher
+constexpr std::size_t kMaxPrefetchLines = 8;
+
+template <typename T, typename K, int MinOrder = 2>
+class alignas(kCacheLineSize) Node {
+   private:
+    class SplitResult {
+       public:
+        explicit SplitResult(Node* left, Node* right, T promoted_key)
+            : left_{left},
+              right_{right},
+              new_root_{nullptr},
+              promoted_key_{promoted_key} {}
+        explicit SplitResult(Node* left, Node* right, Node* new_root,
+                             T promoted_key)
+            : left_{left},
+              right_{right},
+              new_root_{new_root},
+              promoted_key_{promoted_key} {}
+        ~SplitResult() = default;
+        inline auto GetLeft() -> Node* { return left_; }
+        inline auto GetRight() -> Node* { return right_; }
+        inline auto HasRoot() -> bool { return new_root_ != nullptr; }
+        inline auto GetRoot() -> Node* { return new_root_; }
+        inline auto GetPromotedKey() -> const T& { return promoted_key_; }
+
+       private:
+        Node* left_;
+        Node* right_;
+        Node* new_root_;
+        T promoted_key_;
+    };
+
+   public:
+    using Slot = typename ValueSlot<K>::Slot;
+
+    static_assert(MinOrder > 0, "a node must hold at least two keys");
+
+    static constexpr int kMinOrder = MinOrder;
+
+    // the most keys a node holds between operations. every array has room
+    // for one more entry so that a node can overflow until it is split
+    static constexpr int kCapacity = 2 * MinOrder;
+
+    using Keys = KeyArray<T, kCapacity + 1>;
+
+    using Cold = ColdLeaf<T, K>;
+
+    // whether leaves can be frozen into the cold layout at all
+    static constexpr bool kFreezable = Cold::kSupported;
+
+    // the most entries a cold leaf takes over, those of this many full leaves
+    static constexpr int kColdCapacity = 16 * kCapacity;
+
+    explicit Node()
+        : version_{0},
+          leaf_{true},
+          root_{false},
+          level_{0},
+          count_{0},
+          right_link_{nullptr},
+          out_link_{nullptr},
+          cold_{nullptr},
+          seen_{1} {}
+
+    explicit Node(std::span<const T> keys) : Node() { SetKeys(keys); }
+
+    explicit Node(std::span<const T> keys, std::span<Node* const> children)
+        : Node() {
+        leaf_ = false;
+        SetKeys(keys);
+        SetChildren(children);
+    }
+
+    ~Node() {
+        keys_.Free(count_);
+        if (!leaf_) return;
+        if constexpr (kFreezable) {
+            if (cold_ != nullptr) Cold::Free(cold_);
+        }
+        for (auto i = 0; i < count_; i++) ValueSlot<K>::Free(values_[i]);
+    }
+
+    /**
+     * Construct a node in a block from the allocator
+     */
+    template <typename Allocator, typename... Args>
+    static auto New(Allocator& allocator, Args&&... args) -> Node* {
+        return new (allocator.Allocate()) Node(std::forward<Args>(args)...);
+    }
+
+    /**
+     * Destroy a node and give its block back to the allocator
+     */
+    template <typename Allocator>
+    static void Delete(Allocator& allocator, Node* node) {
+        node->~Node();
+        allocator.Deallocate(node);
+    }
+
+    /**
+     * Unsafely latch this node in exclusive mode. The version is bumped to an
+     * odd value so that optimistic readers can tell a write is in progress.
+     * Time spent waiting for another writer is counted against stats
+     */
+    inline void Latch(StatsSlot* stats = nullptr) {
+        auto version = version_.load(std::memory_order_relaxed);
+        auto wait = StatsTimer{};
+        while (true) {
+            if (!(version & 1) &&
+                version_.compare_exchange_weak(version, version + 1,
+                                               std::memory_order_acquire))
+                break;
+            wait.Start();
+            std::this_thread::yield();
+            version = version_.load(std::memory_order_relaxed);
+        }
+        wait.Stop(stats);
+        std::atomic_thread_fence(std::memory_order_release);
+    }
+
+    /**
+     * Latch this node in exclusive mode, but only if it has not changed since
+     * ReadVersion() returned version
+     */
+    inline auto Upgrade(uint64_t version) -> bool {
+        if (!version_.compare_exchange_strong(version, version + 1,
+                                              std::memory_order_acquire))
+            return false;
+        std::atomic_thread_fence(std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * Unsafely unlatch this node. The version is bumped back to an even value,
+     * which publishes every write made while the latch was held
+     */
+    inline void Unlatch() {
+        version_.store(version_.load(std::memory_order_relaxed) + 1,
+                       std::memory_order_release);
+    }
+
+    /**
+     * Wait until no writer holds this node and return its version. Pass the
+     * result to Validate() after reading the node optimistically
+     */
+    inline auto ReadVersion() -> uint64_t {
+        auto version = version_.load(std::memory_order_acquire);
+        while (version & 1) {
+            std::this_thread::yield();
+            version = version_.load(std::memory_order_acquire);
+        }
+        return version;
+    }
+
+    /**
+     * Whether every optimistic read made since ReadVersion() returned version
+     * saw a consistent node
+     */
+    inline auto Validate(uint64_t version) -> bool {
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return version_.load(std::memory_order_relaxed) == version;
+    }
+
+    /**
+     * Return the number of keys in this node
+     */
+    inline auto GetCount() -> int { return count_; }
+
+    /**
+     * Return the key at the index
+     */
+    inline auto GetKey(int index) -> T { return keys_.Get(index); }
+
+    /**
+     * Return a view of the value slots of this node (leaf nodes only). Use
+     * ValueSlot<K>::Unbox to get at the values
+     */
+    inline auto GetValues() -> std::span<const Slot> {
+        return std::span<const Slot>(values_, count_);
+    }
+
+    /**
+     * The entries of a leaf as an optimistic reader sees them, whether the
+     * leaf is cold or not. Which layout the leaf is in is read only once, when
+     * the view is taken, so a freeze or thaw under way is never seen half
+     * done. Validate the node before trusting anything read through it
+     */
+    class EntryView {
+       public:
+        explicit EntryView(Node* node)
+            : node_{node}, cold_{node->cold_}, count_{node->count_} {}
+
+        inline auto GetCount() const -> int {
+            if constexpr (kFreezable) {
+                if (cold_ != nullptr) return cold_->GetCount();
+            }
+            return count_;
+        }
+
+        inline auto GetKey(int i) const -> T {
+            if constexpr (kFreezable) {
+                if (cold_ != nullptr) return cold_->GetKey(i);
+            }
+            return node_->keys_.Get(i);
+        }
+
+        inline auto GetSlot(int i) const -> Slot {
+            if constexpr (kFreezable) {
+                if (cold_ != nullptr) return cold_->GetValue(i);
+            }
+            return node_->values_[i];
+        }
+
+        inline auto LowerBound(const T& key) const -> int {
+            if constexpr (kFreezable) {
+                if (cold_ != nullptr) return cold_->LowerBound(key);
+            }
+            return node_->keys_.LowerBound(count_, key);
+        }
+
+       private:
+        Node* node_;
+        const Cold* cold_;
+        int count_;
+    };
+
+    /**
+     * Return a view of the entries of this node (leaf nodes only)
+     */
+    inline auto GetEntries() -> EntryView { return EntryView{this}; }
+
+    /**
+     * Return the packed entries of this node if it is a cold leaf, or null
+     */
+    inline auto GetCold() -> const Cold* { return cold_; }
+
+    /**
+     * Whether this node is a cold leaf, whose entries are packed into a block
+     * of their own instead of the node's arrays. Writers thaw a cold leaf
+     * before they change it
+     */
+    inline auto IsCold() -> bool { return cold_ != nullptr; }
+
+    /**
+     * Whether this node has not been written since MarkSeen() was last
+     * called on it. Only the freeze pass uses these
+     */
+    inline auto IsIdle() -> bool { return ReadVersion() == seen_; }
+
+    inline void MarkSeen() { seen_ = ReadVersion(); }
+
+    /**
+     * Return a view of the children of this node (internal nodes only)
+     */
+    inline auto GetChildren() -> std::span<Node* const> {
+        return std::span<Node* const>(children_, count_ + 1);
+    }
+
+    /**
+     * Return the level of this node. Leaves are at level 0
+     */
+    inline auto GetLevel() -> int { return level_; }
+
+    /**
+     * Return the right link of this node
+     */
+    inline auto GetRight() -> Node* { return right_link_; }
+
+    /**
+     * Return the high key of this node
+     */
+    inline auto GetHighKey() -> std::optional<T> { return keys_.GetHighKey(); }
+
+    /**
+     * Whether this node is the root or not
+     */
+    inline auto IsRoot() -> bool { return root_; }
+
+    /**
+     * Whether this node is a leaf node
+     */
+    inline auto IsLeaf() -> bool { return leaf_; }
+
+    /**
+     * Whether this node has been merged into its left sibling. A deleted node
+     * is unreachable from its parent, and its out link points at the node
+     * that took over its entries
+     */
+    inline auto IsDeleted() -> bool { return out_link_ != nullptr; }
+
+    /**
+     * Set/unset whether this node is the root or not
+     */
+    inline void SetRoot(bool root) { root_ = root; }
+
+    /**
+     * Set/unset whether this node is a leaf node or not
+     */
+    inline void SetLeaf(bool leaf) { leaf_ = leaf; }
+
+    /**
+     * Set the level of this node
+     */
+    inline void SetLevel(int level) { level_ = level; }
+
+    /**
+     * Set the keys of this node
+     */
+    inline void SetKeys(std::span<const T> keys) {
+        count_ = 0;
+        for (const auto& key : keys) {
+            keys_.Insert(count_, count_, key);
+            count_++;
+        }
+    }
+
+    /**
+     * Set the value slots of this node. The node takes ownership of any boxed
+     * values
+     */
+    inline void SetValues(std::span<const Slot> values) {
+        std::copy(values.begin(), values.end(), values_);
+    }
+
+    /**
+     * Set the children of this node
+     */
+    inline void SetChildren(std::span<Node* const> children) {
+        std::copy(children.begin(), children.end(), children_);
+    }
+
+    /**
+     * Set the high key of this node
+     */
+    inline void SetHighKey(const std::optional<T>& high_key) {
+        keys_.SetHighKey(high_key);
+    }
+
+    /**
+     * Set the bounds of this node, which its keys must lie between. The low
+     * key is the high key of the left sibling, and is only used to find the
+     * prefix the keys share
+     */
+    inline void SetFences(const std::optional<T>& low_key,
+                          const std::optional<T>& high_key) {
+        keys_.SetFences(count_, low_key, high_key);
+    }
+
+    /**
+     * Set the right link of this node
+     */
+    inline void SetRight(Node* right_link) { right_link_ = right_link; };
+
+    /**
+     * Set the out link of this node
+     */
+    inline void SetOut(Node* out_link) { out_link_ = out_link; };
+
+    /**
+     * Find the index at which this key exists, or return the index at which
+     * this key should be inserted at
+     * - Uses KeySearch<T>, which interpolates and is vectorized for integer
+     *   keys
+     * - Requires operator== and operator< to be overloaded
+     */
+    auto FindIndex(const T& key) -> int {
+        return keys_.LowerBound(count_, key);
+    }
+
+    /**
+     * Split an overflowing node into two halves. Update the required
+     * right_link_ fields. The caller must hold this node's latch. With append
+     * set, the node is expected to overflow again only from more appends, so
+     * it keeps nearly all of its keys and the new one starts nearly empty
+     */
+    template <typename Allocator>
+    auto Split(Allocator& allocator, bool append = false) -> SplitResult {
+        if constexpr (kFreezable) {
+            if (cold_ != nullptr) return SplitCold(allocator);
+        }
+        // usually the left half keeps the larger half of the keys
+        auto mid = keys_.SplitPoint(count_, leaf_, append);
+        // create new right sibling
+        auto new_right = New(allocator);
+        new_right->SetLeaf(leaf_);
+        new_right->SetLevel(level_);
+        // set the new right sibling's right_link_ field to the current node's
+        // right_link_ field
+        new_right->SetRight(right_link_);
+        // move the upper half straight into the sibling's arrays. the lower
+        // half stays where it is, so nothing is copied twice. this also moves
+        // the high key over and gives the current node its new one
+        auto promoted_key =
+            keys_.Split(count_, mid, leaf_ ? mid : mid - 1, new_right->keys_);
+        new_right->count_ = count_ - mid;
+        if (leaf_) {
+            std::move(values_ + mid, values_ + count_, new_right->values_);
+            count_ = mid;
+        } else {
+            // if the node's were internal nodes, split the children as well.
+            // the promoted key moves up into the parent instead of staying
+            // behind as the largest key of the left half
+            std::move(children_ + mid, children_ + count_ + 1,
+                      new_right->children_);
+            count_ = mid - 1;
+        }
+        // set the current node's right_link field to point to the fully
+        // built right sibling
+        right_link_ = new_right;
+        return Promote(allocator, new_right, promoted_key);
+    }
+
+    /**
+     * Unpack a cold leaf back into the node's own arrays if its entries fit
+     * there, and return whether the leaf is no longer cold. The caller must
+     * hold the latch, and retires the packed entries, which optimistic
+     * readers may still be reading
+     */
+    auto Thaw() -> bool {
+        if constexpr (kFreezable) {
+            if (cold_ == nullptr) return true;
+            if (cold_->GetCount() > kCapacity) return false;
+            auto keys = std::vector<T>{};
+            auto values = std::vector<K>{};
+            CopyEntries(keys, values);
+            SetEntries(keys, values);
+        }
+        return true;
+    }
+
+    /**
+     * Whether Freeze(right) would fit in one cold leaf
+     */
+    inline auto CanFreeze(Node* right) -> bool {
+        return kFreezable && GetEntries().GetCount() +
+                                     right->GetEntries().GetCount() <=
+                                 kColdCapacity;
+    }
+
+    /**
+     * Pack the entries of this leaf and its right sibling into one cold leaf,
+     * which this node becomes. Like Absorb, this node takes over the
+     * sibling's bounds and right link, and the sibling is left empty and
+     * deleted. The caller must hold both latches, and retires the packed
+     * entries either node had before
+     */
+    void Freeze(Node* right) {
+        if constexpr (kFreezable) {
+            auto keys = std::vector<T>{};
+            auto values = std::vector<K>{};
+            CopyEntries(keys, values);
+            right->CopyEntries(keys, values);
+            cold_ = Cold::Build(keys, values);
+            count_ = 0;
+            keys_.SetHighKey(right->keys_.GetHighKey());
+            right_link_ = right->right_link_;
+            right->count_ = 0;
+            right->cold_ = nullptr;
+            right->out_link_ = this;
+        }
+    }
+
+    /**
+     * If this node is safe, insert the key and its value (leaf nodes only)
+     */
+    auto InsertSafe(const T& key, const K& val) -> bool {
+        // quick check
+        if (!IsSafe(key)) return false;
+        return InsertUnsafe(key, val);
+    }
+
+    /**
+     * If this node is safe, insert the key and the child to its right
+     * (internal nodes only)
+     */
+    auto InsertSafe(const T& key, Node* child) -> bool {
+        if (!IsSafe(key)) return false;
+        return InsertUnsafe(key, child);
+    }
+
+    /**
+     * Insert the key and its value even if the node overflows (leaf nodes
+     * only). An overflowing node must be split before it is unlatched.
+     */
+    auto InsertUnsafe(const T& key, const K& val) -> bool {
+        // if this node already contains the key return
+        if (Contains(key)) return false;
+        // otherwise shift the larger keys up a slot, insert and return true
+        auto insert_at = FindIndex(key);
+        keys_.Insert(count_, insert_at, key);
+        std::move_backward(values_ + insert_at, values_ + count_,
+                           values_ + count_ + 1);
+        values_[insert_at] = ValueSlot<K>::Box(val);
+        count_++;
+        return true;
+    }
+
+    /**
+     * Append the key and its value after every key in the node (leaf nodes
+     * only). The key must be larger than every key in the node, and the node
+     * must not be full
+     */
+    inline void Append(const T& key, const K& val) {
+        keys_.Insert(count_, count_, key);
+        values_[count_] = ValueSlot<K>::Box(val);
+        count_++;
+    }
+
+    /**
+     * Insert the key and the child to its right even if the node overflows
+     * (internal nodes only). The child holds every key above the key and up
+     * to the separator that follows it.
+     */
+    auto InsertUnsafe(const T& key, Node* child) -> bool {
+        if (Contains(key)) return false;
+        auto insert_at = FindIndex(key);
+        keys_.Insert(count_, insert_at, key);
+        std::move_backward(children_ + insert_at + 1, children_ + count_ + 1,
+                           children_ + count_ + 2);
+        children_[insert_at + 1] = child;
+        count_++;
+        return true;
+    }
+
+    /**
+     * Remove the key, and return the slot that held its value if the key was
+     * in this node (leaf nodes only). The caller takes over the slot, and must
+     * not free a boxed value while an optimistic reader may still unbox it.
+     */
+    auto Remove(const T& key) -> std::optional<Slot> {
+        auto index = FindIndex(key);
+        if (index == count_ || !keys_.Equals(index, key)) return std::nullopt;
+        auto slot = values_[index];
+        keys_.Remove(count_, index);
+        std::move(values_ + index + 1, values_ + count_, values_ + index);
+        count_--;
+        return slot;
+    }
+
+    /**
+     * Store val under the key in place of its current value, and return the
+     * slot that held the old one, if the key was in this node (leaf nodes
+     * only). The caller takes over the old slot, as with Remove.
+     */
+    auto Replace(const T& key, const K& val) -> std::optional<Slot> {
+        auto index = FindIndex(key);
+        if (index == count_ || !keys_.Equals(index, key)) return std::nullopt;
+        return std::exchange(values_[index], ValueSlot<K>::Box(val));
+    }
+
+    /**
+     * Remove the key at the index and the child to its right (internal nodes
+     * only)
+     */
+    void RemoveAt(int index) {
+        keys_.Remove(count_, index);
+        std::move(children_ + index + 2, children_ + count_ + 1,
+                  children_ + index + 1);
+        count_--;
+    }
+
+    /**
+     * Replace the key at the index (internal nodes only)
+     */
+    inline void SetKey(int index, const T& key) {
+        keys_.Replace(count_, index, key);
+    }
+
+    /**
+     * Whether the key at the index can be replaced without overflowing this
+     * node (internal nodes only)
+     */
+    inline auto CanSetKey(int index, const T& key) -> bool {
+        return keys_.CanReplace(count_, index, key);
+    }
+
+    /**
+     * Return the index of the child, or -1 if it is not a child of this node
+     * (internal nodes only)
+     */
+    auto ChildIndex(Node* child) -> int {
+        for (auto i = 0; i <= count_; i++) {
+            if (children_[i] == child) return i;
+        }
+        return -1;
+    }
+
+    /**
+     * Move every entry of the right sibling into this node, which takes over
+     * its bounds and right link. The sibling is left empty and deleted, with
+     * its out link pointing at this node, so that readers that still reach it
+     * find its entries. The caller must hold both latches, and the entries
+     * must fit.
+     */
+    void Absorb(Node* right) {
+        // the separator between the two comes down from the parent
+        keys_.Absorb(count_, right->keys_, right->count_, !leaf_);
+        if (leaf_) {
+            std::move(right->values_, right->values_ + right->count_,
+                      values_ + count_);
+        } else {
+            count_++;
+            std::move(right->children_, right->children_ + right->count_ + 1,
+                      children_ + count_);
+        }
+        count_ += right->count_;
+        right_link_ = right->right_link_;
+        // the boxed values now belong to this node
+        right->count_ = 0;
+        right->out_link_ = this;
+    }
+
+    /**
+     * Move the last count keys of this node, with their values or children,
+     * to the front of the right sibling, and return the new separator between
+     * the two. Entries only ever move right, so a reader that has this node's
+     * old bounds still finds them by following the right link. The caller must
+     * hold both latches.
+     */
+    auto ShiftRight(Node* right, int count) -> T {
+        // the old separator comes down into an internal sibling, and the key
+        // before the moved children goes up in its place
+        auto separator =
+            keys_.ShiftRight(count_, count, right->keys_, right->count_, leaf_);
+        if (leaf_) {
+            std::move_backward(right->values_, right->values_ + right->count_,
+                               right->values_ + right->count_ + count);
+            std::move(values_ + count_ - count, values_ + count_,
+                      right->values_);
+        } else {
+            std::move_backward(right->children_,
+                               right->children_ + right->count_ + 1,
+                               right->children_ + right->count_ + 1 + count);
+            std::move(children_ + count_ + 1 - count, children_ + count_ + 1,
+                      right->children_);
+        }
+        count_ -= count;
+        right->count_ += count;
+        return separator;
+    }
+
+    /**
+     * Return the separator ShiftRight(right, count) would leave between this
+     * node and its right sibling
+     */
+    inline auto ShiftedSeparator(int count) -> T {
+        return keys_.Get(leaf_ ? count_ - count - 1 : count_ - count);
+    }
+
+    /**
+     * Whether Absorb(right) would fit in this node
+     */
+    inline auto CanAbsorb(Node* right) -> bool {
+        auto count = count_ + right->count_ + (leaf_ ? 0 : 1);
+        return count <= kCapacity &&
+               keys_.CanAbsorb(count_, right->keys_, right->count_, !leaf_);
+    }
+
+    /**
+     * Whether ShiftRight(right, count) would fit in the right sibling
+     */
+    inline auto CanShiftRight(Node* right, int count) -> bool {
+        return right->count_ + count <= kCapacity &&
+               keys_.CanShiftRight(count_, count, right->keys_, right->count_,
+                                   leaf_);
+    }
+
+    /**
+     * Return the slot holding the value stored under the key, if any (leaf
+     * nodes only). Optimistic readers must copy the slot and validate the
+     * node before unboxing it.
+     */
+    auto Find(const T& key) -> std::optional<Slot> {
+        if constexpr (kFreezable) {
+            // read once, since a writer may thaw the leaf meanwhile
+            auto cold = cold_;
+            if (cold != nullptr) {
+                auto index = cold->LowerBound(key);
+                if (index == cold->GetCount() || !(cold->GetKey(index) == key))
+                    return std::nullopt;
+                return cold->GetValue(index);
+            }
+        }
+        auto index = FindIndex(key);
+        if (index == count_ || !keys_.Equals(index, key)) return std::nullopt;
+        return values_[index];
+    }
+
+    /**
+     * Scan the current node and determine whether the bounds of this subtree
+     * are acceptable. If not, return right_link_, or out_link_ if this node
+     * has been deleted. If so, return the correct
+     * (acceptable) child, or the node itself if it is a leaf.
+     */
+    auto Scannode(const T& key) -> Node* {
+        if (out_link_ != nullptr) return out_link_;
+        if (right_link_ != nullptr && keys_.HighKeyBelow(key))
+            return right_link_;
+        if (leaf_) return this;
+        return children_[FindIndex(key)];
+    }
+
+    /**
+     * Ask the CPU to start loading this node into cache, so that a later
+     * visit does not stall on memory
+     */
+    inline void Prefetch() const {
+        constexpr auto kLines = std::min<std::size_t>(
+            sizeof(Node) / kCacheLineSize, kMaxPrefetchLines);
+        auto bytes = reinterpret_cast<const char*>(this);
+        for (std::size_t line = 0; line < kLines; line++)
+            __builtin_prefetch(bytes + line * kCacheLineSize);
+    }
+
+    /**
+     * Scannode without latching. Retries until a consistent version of the
+     * node has been read.
+     */
+    auto ScannodeUnlatched(const T& key) -> Node* {
+        while (true) {
+            auto version = ReadVersion();
+            auto next = Scannode(key);
+            if (Validate(version)) return next;
+        }
+    }
+
+    /**
+     * Whether this node is safe given its MinOrder, i.e. whether one more key
+     * can be inserted without overflowing it.
+     */
+    inline auto IsSafe() -> bool { return count_ < kCapacity; }
+
+    /**
+     * Whether the key can be inserted without overflowing this node. Unlike
+     * IsSafe() this also takes the byte budget of bounded keys into account
+     */
+    inline auto IsSafe(const T& key) -> bool {
+        return count_ < kCapacity && keys_.Fits(count_, key);
+    }
+
+
+    /**
+     * Whether this node holds fewer keys than MinOrder. Underfull nodes are
+     * left as they are by erases, and merged or refilled by compaction later.
+     * Cold leaves never are
+     */
+    inline auto IsUnderfull() -> bool {
+        return cold_ == nullptr && count_ < kMinOrder;
+    }
+
+    /**
+     * Whether the key is the largest one in this node, and this node is the
+     * rightmost one on its level, so that the key was appended to the level
+     */
+    inline auto IsAppend(const T& key) -> bool {
+        return right_link_ == nullptr && count_ > 0 &&
+               keys_.Equals(count_ - 1, key);
+    }
+
+    /**
+     * Whether this node contains the key passed in
+     */
+    inline auto Contains(const T& key) -> bool {
+        auto index = FindIndex(key);
+        // the passed in key cannot exist in keys_ if the index returned above
+        // is equal to the size of keys_
+        if (index == count_) return false;
+        return keys_.Equals(index, key);
+    }
+
+    /**
+     * Move right along a node until one is reached that has appropriate bounds
+     * for the key passed in, and return it latched. Nodes passed over on the
+     * way are only read optimistically. Right links followed, and time spent
+     * rescanning nodes a writer held, are counted against stats
+     */
+    static auto MoveRight(Node* current, const T& key,
+                          StatsSlot* stats = nullptr) -> Node* {
+        if (current == nullptr) return nullptr;
+        auto wait = StatsTimer{};
+        while (true) {
+            auto version = current->ReadVersion();
+            // scan the current node for the right link to follow.
+            Node* t = current->Scannode(key);
+            // go right until we reach a node with acceptable bounds or until
+            // we are at the rightmost node on the level (where right_link ==
+            // nullptr evaluates to true). a deleted node sends us to the node
+            // that absorbed it instead
+            auto move_right = current->out_link_ != nullptr ||
+                              (t == current->right_link_ &&
+                               current->right_link_ != nullptr);
+            if (!current->Validate(version)) {
+                wait.Start();
+                continue;
+            }
+            if (move_right) {
+                if constexpr (kCollectStats) {
+                    if (stats != nullptr) stats->CountRightMove();
+                }
+                current = t;
+                continue;
+            }
+            // latch the node only if its bounds have not changed since we
+            // scanned it, otherwise scan it again
+            if (current->Upgrade(version)) {
+                wait.Stop(stats);
+                return current;
+            }
+            wait.Start();
+        }
+    }
+
+   private:
+    // split a cold leaf that is being thawed in two halves, each of which
+    // is only packed again if it is still too big for a leaf's arrays. the
+    // caller retires the packed entries the leaf had
+    template <typename Allocator>
+    auto SplitCold(Allocator& allocator) -> SplitResult {
+        auto keys = std::vector<T>{};
+        auto values = std::vector<K>{};
+        CopyEntries(keys, values);
+        auto mid = keys.size() / 2;
+        auto new_right = New(allocator);
+        new_right->SetRight(right_link_);
+        new_right->SetHighKey(keys_.GetHighKey());
+        new_right->SetEntries(std::span{keys}.subspan(mid),
+                              std::span{values}.subspan(mid));
+        SetEntries(std::span{keys}.first(mid), std::span{values}.first(mid));
+        auto promoted_key = keys[mid - 1];
+        keys_.SetHighKey(promoted_key);
+        right_link_ = new_right;
+        return Promote(allocator, new_right, promoted_key);
+    }
+
+    // append the entries of this leaf, in either layout, to keys and values
+    void CopyEntries(std::vector<T>& keys, std::vector<K>& values) {
+        auto entries = GetEntries();
+        for (auto i = 0; i < entries.GetCount(); i++) {
+            keys.push_back(entries.GetKey(i));
+            values.push_back(entries.GetSlot(i));
+        }
+    }
+
+    // make the entries, which are sorted and within this leaf's bounds, the
+    // leaf's only ones. they go into its own arrays if they fit there, and
+    // are packed if not
+    void SetEntries(std::span<const T> keys, std::span<const K> values) {
+        auto count = static_cast<int>(keys.size());
+        if (count > kCapacity) {
+            cold_ = Cold::Build(keys, values);
+            count_ = 0;
+            return;
+        }
+        for (auto i = 0; i < count; i++) {
+            keys_.Insert(i, i, keys[i]);
+            values_[i] = ValueSlot<K>::Box(values[i]);
+        }
+        count_ = count;
+        cold_ = nullptr;
+    }
+
+    // finish a split of this node by giving the two halves a new root above
+    // them if this node was the root
+    template <typename Allocator>
+    auto Promote(Allocator& allocator, Node* new_right, const T& promoted_key)
+        -> SplitResult {
+        Node* new_root = nullptr;
+        if (root_) {
+            // if the current node is the root, create a new one and set the
+            // proper key and children
+            const T new_root_keys[] = {promoted_key};
+            Node* const new_root_children[] = {this, new_right};
+            new_root = New(allocator, new_root_keys, new_root_children);
+            new_root->SetLevel(level_ + 1);
+            new_root->SetRoot(true);
+            root_ = false;
+        }
+        return SplitResult(this, new_right, new_root, promoted_key);
+    }
+
+    friend auto operator<<(std::ostream& os, const Node& node)
+        -> std::ostream& {
+        os << "Node {\n\tleaf_: " << node.leaf_ << ",\n\troot_: " << node.root_
+           << ",\n\tmin_order_: " << kMinOrder << ",\n}";
+        return os;
+    }
+
+    friend auto operator<<(std::ostream& os, const Node* node)
+        -> std::ostream& {
+        os << "Node {\n\tleaf_: " << node->leaf_
+           << ",\n\troot_: " << node->root_ << ",\n\tmin_order_: " << kMinOrder
+           << ",\n}";
+        return os;
+    }
+
+    // the optimistic latch. even while the node is unlatched, odd while a
+    // writer holds it exclusively. every exclusive hold moves it forward
+    std::atomic<uint64_t> version_;
+    bool leaf_;
+    bool root_;
+    int level_;
+    int count_;
+    Node *right_link_, *out_link_;
+    // the packed entries of a cold leaf, which then leaves count_ at zero
+    const Cold* cold_;
+    // the version the freeze pass last saw this node at
+    uint64_t seen_;
+    // keys, the high key, and values or children are stored inline, so
+    // visiting a node touches no memory outside of it
+    Keys keys_;
+    union {
+        Slot values_[kCapacity + 1];
+        Node* children_[kCapacity + 2];
+    };
+};
+
+/**
+ * A read-only, pointer-free copy of a tree in a file, served straight from a
+ * read-only mapping of the file. Opening a snapshot costs one mmap whatever
+ * its size, pages are only read in as lookups touch them, and processes that
+ * map the same file share its page cache pages.
+ * - The file is a header followed by fixed-size records, one per node. Nodes
+ *   refer to their children and leaves to their right sibling by byte
+ *   offset. Each internal node holds the largest key under each child
+ * - Keys and values must be trivially copyable, since they are stored byte
+ *   for byte
+ * - Snapshots are written by a Builder, usually through Tree::SaveSnapshot
+ */
+template <typename T, typename K>
+class Snapshot {
+    static_assert(std::is_trivially_copyable_v<T> &&
+                      std::is_trivially_copyable_v<K>,
+                  "snapshot keys and values are stored byte for byte");
+
+   public:
+    // the most entries a record holds. records are about a page each
+    static constexpr int kFanout = static_cast<int>(
+        (4096 - 16) / (sizeof(T) + std::max(sizeof(K), sizeof(uint64_t))) -
+        1);
+
+   private:
+    struct Record {
+        uint32_t count;
+        uint32_t leaf;
+        // the offset of the right sibling of a leaf, or 0
+        uint64_t next;
+        T keys[kFanout];
+        union {
+            K values[kFanout];
+            uint64_t children[kFanout];
+        };
+    };
+
+    static_assert(kFanout >= 2, "records must hold at least two entries");
+
+    struct Header {
+        uint64_t magic;
+        uint32_t key_size;
+        uint32_t value_size;
+        uint32_t record_size;
+        uint64_t count;
+        // the offset of the root, or 0 if the snapshot is empty
+        uint64_t root;
+    };
+
+    static_assert(sizeof(Header) <= sizeof(Record));
+
+    static constexpr uint64_t kMagic = 0x31706e736d656d;  // "memsnp1"
+
+   public:
+    /**
+     * Write a snapshot from entries added in strictly increasing key order.
+     * Leaves are filled completely, and every record is written as soon as
+     * it is full, so only one record per level is held in memory. The file
+     * is written next to path and renamed over it by Finish(), so a snapshot
+     * already at path stays intact, and mapped, until the new one is done.
+     */
+    class Builder {
+       public:
+        explicit Builder(const std::string& path)
+            : path_{path},
+              temp_path_{path + ".tmp"},
+              fd_{::open(temp_path_.c_str(), O_WRONLY | O_CREAT | O_TRUNC,
+                         0644)},
+              ok_{fd_ >= 0},
+              count_{0},
+              // the header takes up the first record's place
+              end_{sizeof(Record)},
+              last_leaf_{0},
+              levels_(1) {
+            levels_[0].leaf = 1;
+        }
+
+        Builder(const Builder&) = delete;
+        auto operator=(const Builder&) -> Builder& = delete;
+
+        ~Builder() {
+            if (fd_ < 0) return;
+            ::close(fd_);
+            ::unlink(temp_path_.c_str());
+        }
+
+        // the key must be larger than every key added before it
+        void Add(const T& key, const K& val) {
+            if (levels_[0].count == kFanout) Flush(0);
+            auto& leaf = levels_[0];
+            leaf.keys[leaf.count] = key;
+            leaf.values[leaf.count] = val;
+            leaf.count++;
+            count_++;
+        }
+
+        /**
+         * Write out the records still being filled and the header, and
+         * move the snapshot into place. Returns whether every write worked
+         */
+        auto Finish() -> bool {
+            auto root = uint64_t{0};
+            // levels_ may grow while the levels below are flushed into it
+            for (std::size_t level = 0; level < levels_.size(); level++) {
+                if (levels_[level].count == 0) continue;
+                // a top level with a single child would be a root with one
+                // child, so that child is the root instead
+                if (level > 0 && level + 1 == levels_.size() &&
+                    levels_[level].count == 1) {
+                    root = levels_[level].children[0];
+                    break;
+                }
+                Flush(level);
+            }
+            auto header = Header{kMagic,        sizeof(T),
+                                 sizeof(K),     sizeof(Record),
+                                 count_,        root};
+            Write(&header, sizeof(header), 0);
+            ok_ = ok_ && ::fsync(fd_) == 0;
+            ::close(fd_);
+            fd_ = -1;
+            ok_ = ok_ && std::rename(temp_path_.c_str(), path_.c_str()) == 0;
+            if (!ok_) ::unlink(temp_path_.c_str());
+            return ok_;
+        }
+
+       private:
+        // write out the record being filled on the level, and add it to its
+        // parent on the level above
+        void Flush(std::size_t level) {
+            auto offset = end_;
+            end_ += sizeof(Record);
+            auto& record = levels_[level];
+            auto max_key = record.keys[record.count - 1];
+            Write(&record, sizeof(Record), offset);
+            if (record.leaf) {
+                // the previous leaf was written before this one's offset
+                // was known, so its right link is filled in now
+                if (last_leaf_ != 0)
+                    Write(&offset, sizeof(offset),
+                          last_leaf_ + offsetof(Record, next));
+                last_leaf_ = offset;
+            }
+            record = Record{};
+            record.leaf = level == 0;
+            if (level + 1 == levels_.size()) levels_.emplace_back();
+            auto& parent = levels_[level + 1];
+            if (parent.count == kFanout) Flush(level + 1);
+            // Flush may have grown levels_, so look the parent up again
+            auto& above = levels_[level + 1];
+            above.keys[above.count] = max_key;
+            above.children[above.count] = offset;
+            above.count++;
+        }
+
+        void Write(const void* data, std::size_t size, uint64_t offset) {
+            if (!ok_) return;
+            ok_ = ::pwrite(fd_, data, size, static_cast<off_t>(offset)) ==
+                  static_cast<ssize_t>(size);
+        }
+
+        std::string path_;
+        std::string temp_path_;
+        int fd_;
+        bool ok_;
+        uint64_t count_;
+        // the offset the next record is written at
+        uint64_t end_;
+        // the offset of the last leaf written, or 0
+        uint64_t last_leaf_;
+        // the record being filled on each level, leaves first
+        std::vector<Record> levels_;
+    };
+
+    /**
+     * Map the snapshot at path. Returns null if it cannot be mapped or is not
+     * a snapshot of this key and value type
+     */
+    static auto Open(const std::string& path) -> std::unique_ptr<Snapshot> {
+        auto fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return nullptr;
+        struct stat st;
+        auto size = ::fstat(fd, &st) == 0 ? static_cast<std::size_t>(st.st_size)
+                                          : std::size_t{0};
+        if (size < sizeof(Header)) {
+            ::close(fd);
+            return nullptr;
+        }
+        auto data = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        // the mapping outlives the descriptor
+        ::close(fd);
+        if (data == MAP_FAILED) return nullptr;
+        auto snapshot = std::unique_ptr<Snapshot>{
+            new Snapshot{static_cast<const char*>(data), size}};
+        const auto& header = snapshot->GetHeader();
+        if (header.magic != kMagic || header.key_size != sizeof(T) ||
+            header.value_size != sizeof(K) ||
+            header.record_size != sizeof(Record))
+            return nullptr;
+        return snapshot;
+    }
+
+    Snapshot(const Snapshot&) = delete;
+    auto operator=(const Snapshot&) -> Snapshot& = delete;
+
+    ~Snapshot() { ::munmap(const_cast<char*>(data_), size_); }
+
+    /**
+     * The number of entries in the snapshot
+     */
+    inline auto GetCount() const -> uint64_t { return GetHeader().count; }
+
+    /**
+     * Look up the value stored under the key
+     */
+    auto Search(const T& key) const -> std::optional<K> {
+        auto leaf = FindLeaf(key);
+        if (leaf == nullptr) return std::nullopt;
+        auto count = Count(leaf);
+        auto index = KeySearch<T>::LowerBound(leaf->keys, count, key);
+        if (index == count || !(leaf->keys[index] == key)) return std::nullopt;
+        return leaf->values[index];
+    }
+
+    /**
+     * Call fn(key, val) for every entry with a key in [lo, hi], in key order.
+     * The references passed to fn point into the mapping
+     */
+    template <typename F>
+    void Scan(const T& lo, const T& hi, F&& fn) const {
+        auto leaf = FindLeaf(lo);
+        if (leaf == nullptr) return;
+        auto index = KeySearch<T>::LowerBound(leaf->keys, Count(leaf), lo);
+        while (leaf != nullptr) {
+            for (auto count = Count(leaf); index < count; index++) {
+                if (hi < leaf->keys[index]) return;
+                fn(leaf->keys[index], leaf->values[index]);
+            }
+            leaf = At(leaf->next);
+            index = 0;
+        }
+    }
+
+    /**
+     * Call fn(key, val) for every entry, in key order
+     */
+    template <typename F>
+    void ForEach(F&& fn) const {
+        auto node = At(GetHeader().root);
+        while (node != nullptr && !node->leaf) node = At(node->children[0]);
+        for (; node != nullptr; node = At(node->next)) {
+            for (auto i = 0; i < Count(node); i++)
+                fn(node->keys[i], node->values[i]);
+        }
+    }
+
+   private:
+    explicit Snapshot(const char* data, std::size_t size)
+        : data_{data}, size_{size} {}
+
+    inline auto GetHeader() const -> const Header& {
+        return *reinterpret_cast<const Header*>(data_);
+    }
+
+    // the record at the offset, or null if there is none there. offsets are
+    // checked, so a damaged file cannot send a lookup outside the mapping
+    inline auto At(uint64_t offset) const -> const Record* {
+        if (offset == 0 || offset % sizeof(Record) != 0 ||
+            size_ < sizeof(Record) || offset > size_ - sizeof(Record))
+            return nullptr;
+        return reinterpret_cast<const Record*>(data_ + offset);
+    }
+
+    static inline auto Count(const Record* record) -> int {
+        return std::min<int>(record->count, kFanout);
+    }
+
+    // the leaf that holds the key if any leaf does, or null if every key in
+    // the snapshot is smaller
+    auto FindLeaf(const T& key) const -> const Record* {
+        auto node = At(GetHeader().root);
+        while (node != nullptr && !node->leaf) {
+            auto count = Count(node);
+            auto index = KeySearch<T>::LowerBound(node->keys, count, key);
+            if (index == count) return nullptr;
+            node = At(node->children[index]);
+        }
+        return node;
+    }
+
+    const char* data_;
+    std::size_t size_;
+};
+
+/**
+ * How Tree::LookupBatch executes a batch
+ * - kSorted sorts the keys so that runs of keys landing in the same leaf share
+ *   a descent. Best when the keys are clustered
+ * - kInterleaved runs several independent descents at once, prefetching the
+ *   next node of one descent while working on the others. Best when the keys
+ *   are scattered over a tree larger than the cache, where every level of a
+ *   descent would otherwise stall on memory
+ */
+enum class BatchMode { kSorted, kInterleaved };
+
+/**
+ * What Tree::Upsert did with its value
+ * - kInserted: the key was not in the tree, and now is
+ * - kReplaced: the key was in the tree, and its value is now the new one
+ * - kFailed: nothing was stored, or it was but the log could not make it
+ *   durable (see Tree::Recover)
+ */
+enum class UpsertResult { kInserted, kReplaced, kFailed };
+
+template <typename T, typename K, int MinOrder = 2,
+          typename Allocator = NodeArena>
+class Tree {
+   public:
+    /**
+     * Input iterator over the entries of a range scan, in key order. Holds a
+     * copy of the matching entries of one leaf at a time and streams across
+     * the leaf level through right links, so a scan descends the tree once.
+     */
+    class ScanIterator {
+       public:
+        using iterator_category = std::input_iterator_tag;
+        using value_type = std::pair<T, K>;
+        using difference_type = std::ptrdiff_t;
+        using reference = std::pair<const T&, const K&>;
+
+        explicit ScanIterator()
+            : leaf_{nullptr}, exclusive_{false}, count_{0}, pos_{0} {}
+
+        // the guard keeps the leaves, and the values copied out of them,
+        // alive for as long as the iterator is
+        explicit ScanIterator(const EpochManager::Guard& guard,
+                              Node<T, K, MinOrder>* leaf, const T& lo,
+                              const T& hi)
+            : guard_{guard},
+              leaf_{leaf},
+              lower_{lo},
+              upper_{hi},
+              exclusive_{false},
+              count_{0},
+              pos_{0} {
+            Load();
+        }
+
+        auto operator*() const -> reference {
+            return {keys_[pos_], ValueSlot<K>::Unbox(slots_[pos_])};
+        }
+
+        auto operator++() -> ScanIterator& {
+            if (++pos_ == count_) Load();
+            return *this;
+        }
+
+        void operator++(int) { ++*this; }
+
+        friend auto operator==(const ScanIterator& it, std::default_sentinel_t)
+            -> bool {
+            return it.pos_ >= it.count_;
+        }
+
+       private:
+        // copy the entries of the next leaf that has any in range. each leaf
+        // is read optimistically and re-read if a writer changed it mid-read.
+        // a leaf that split since the previous one was read simply has its
+        // upper half in the next leaf over, so resuming strictly after the
+        // previous high key never skips or repeats an entry. a cold leaf can
+        // hold more entries than fit here, and is resumed the same way after
+        // the last key copied
+        void Load() {
+            count_ = 0;
+            pos_ = 0;
+            while (leaf_ != nullptr && count_ == 0) {
+                auto version = leaf_->ReadVersion();
+                auto next = leaf_->Scannode(lower_);
+                auto entries = leaf_->GetEntries();
+                auto size = entries.GetCount();
+                auto index = entries.LowerBound(lower_);
+                if (exclusive_ && index < size &&
+                    entries.GetKey(index) == lower_)
+                    index++;
+                auto past_upper = false;
+                for (; index < size && count_ < kBuffered; index++) {
+                    auto key = entries.GetKey(index);
+                    if (upper_ < key) {
+                        past_upper = true;
+                        break;
+                    }
+                    keys_[count_] = std::move(key);
+                    slots_[count_] = entries.GetSlot(index);
+                    count_++;
+                }
+                auto high_key = leaf_->GetHighKey();
+                auto right = leaf_->GetRight();
+                if (!leaf_->Validate(version)) {
+                    count_ = 0;
+                    continue;
+                }
+                if (next != leaf_) {
+                    // lower_ has moved right of this leaf since we got here
+                    count_ = 0;
+                    leaf_ = next;
+                } else if (index < size && !past_upper) {
+                    lower_ = keys_[count_ - 1];
+                    exclusive_ = true;
+                } else if (past_upper || right == nullptr ||
+                           !high_key.has_value() || !(*high_key < upper_)) {
+                    leaf_ = nullptr;
+                } else {
+                    lower_ = *high_key;
+                    exclusive_ = true;
+                    leaf_ = right;
+                }
+            }
+        }
+
+        std::optional<EpochManager::Guard> guard_;
+        Node<T, K, MinOrder>* leaf_;
+        T lower_;
+        T upper_;
+        // whether lower_ itself has already been returned
+        bool exclusive_;
+        // the most entries copied out of a leaf at a time
+        static constexpr int kBuffered = Node<T, K, MinOrder>::kCapacity + 1;
+        std::array<T, kBuffered> keys_;
+        std::array<typename Node<T, K, MinOrder>::Slot, kBuffered> slots_;
+        int count_;
+        int pos_;
+    };
+
+    class ScanRange {
+       public:
+        explicit ScanRange(ScanIterator begin) : begin_{begin} {}
+        auto begin() const -> ScanIterator { return begin_; }
+        auto end() const -> std::default_sentinel_t { return {}; }
+
+       private:
+        ScanIterator begin_;
+    };
+
+    explicit Tree()
+        : allocator_{sizeof(Node<T, K, MinOrder>)},
+          epoch_{EpochManager::Shared()},
+          root_{nullptr},
+          tail_{nullptr},
+          log_{nullptr},
+          replicas_{std::make_unique<std::atomic<Replica*>[]>(
+              Numa::NodeCount())},
+          replica_nodes_{0},
+          replica_level_{kNoReplica},
+          retirements_{0},
+          reshapes_{0} {}
+
+    /**
+     * Destroy every node. No other thread may be using the tree
+     */
+    ~Tree() {
+        StopCompaction();
+        for (auto i = 0; i < Numa::NodeCount(); i++)
+            delete replicas_[i].load(std::memory_order_relaxed);
+        DeleteNodes(root_.load(std::memory_order_relaxed));
+        // nodes retired earlier may still be on some thread's list
+        epoch_.Release(this);
+    }
+
+    /**
+     * Look up the value stored under the key. Never latches: nodes are read
+     * optimistically and re-read if a writer changed them mid-read, and
+     * concurrent splits are recovered from by following right links.
+     */
+    auto Search(const T& key) -> std::optional<K> {
+        auto guard = epoch_.Pin();
+        auto current = StartNode(key);
+        if (current == nullptr) return std::nullopt;
+        while (true) {
+            auto version = current->ReadVersion();
+            auto next = current->Scannode(key);
+            // Scannode only returns the current node for a leaf whose bounds
+            // cover the key
+            auto slot = next == current ? current->Find(key) : std::nullopt;
+            if (!current->Validate(version)) continue;
+            if (next != current) {
+                current = next;
+                continue;
+            }
+            if (!slot.has_value()) return std::nullopt;
+            return ValueSlot<K>::Unbox(*slot);
+        }
+    }
+
+    /**
+     * Return the entries with keys in [lo, hi], in key order. Like Search this
+     * never latches, and it tolerates concurrent splits: every entry present
+     * for the whole scan is returned exactly once.
+     */
+    auto Scan(const T& lo, const T& hi) -> ScanRange {
+        if (GetRoot() == nullptr) return ScanRange{ScanIterator{}};
+        auto guard = epoch_.Pin();
+        return ScanRange{ScanIterator{guard, DescendUnlatched(lo), lo, hi}};
+    }
+
+    /**
+     * Call fn(key, val) for every entry with a key in [lo, hi], in key order
+     */
+    template <typename F>
+    void Scan(const T& lo, const T& hi, F&& fn) {
+        for (auto [key, val] : Scan(lo, hi)) fn(key, val);
+    }
+
+    /**
+     * Insert the key with val, and return whether it was inserted, which it
+     * is not if the key is already in the tree, or if the log could not make
+     * it durable (see Recover)
+     */
+    auto Insert(const T& key, const K& val) -> bool {
+        return Put(key, val, false) == UpsertResult::kInserted;
+    }
+
+    /**
+     * Insert the key with val, or store val in place of its current value if
+     * the key is already in the tree, and return which it did
+     */
+    auto Upsert(const T& key, const K& val) -> UpsertResult {
+        return Put(key, val, true);
+    }
+
+    /**
+     * Store desired under the key if its value is equal to expected, and
+     * return whether it was stored, durably if there is a log. Nothing is
+     * stored if the key is not in the tree.
+     */
+    auto CompareExchange(const T& key, const K& expected, const K& desired)
+        -> bool {
+        return Modify(key, [&](const K& current) -> std::optional<K> {
+            if (!(current == expected)) return std::nullopt;
+            return desired;
+        });
+    }
+
+    /**
+     * Call fn(val) on a copy of the value stored under the key, store the
+     * copy in its place, and return whether the key was in the tree and,
+     * with a log, whether the new value is durable. fn runs with the key's
+     * leaf latched, so no other write to the key can come in between, and
+     * must not call back into the tree.
+     */
+    template <typename F>
+    auto Update(const T& key, F&& fn) -> bool {
+        return Modify(key, [&](const K& current) -> std::optional<K> {
+            auto val = current;
+            fn(val);
+            return val;
+        });
+    }
+
+    /**
+     * Remove the key and its value from the tree, and return whether it was
+     * there and, with a log, whether the erase is durable. Only the leaf
+     * holding the key is latched: the leaf is allowed to become underfull,
+     * and is merged or refilled later by Compact().
+     */
+    auto Erase(const T& key) -> bool {
+        auto guard = epoch_.Pin();
+        if (GetRoot() == nullptr || !IsLogHealthy()) return false;
+        auto leaf = LatchLeaf(key);
+        // leaf is now LATCHED. a cold one is only thawed if the key is there
+        // to erase
+        if (leaf->IsCold()) {
+            if (!leaf->Find(key).has_value()) {
+                leaf->Unlatch();
+                return false;
+            }
+            leaf = ThawLeaf(leaf, key);
+        }
+        auto slot = leaf->Remove(key);
+        auto position = slot.has_value() ? Log(LogOp::kErase, key, nullptr) : 0;
+        leaf->Unlatch();
+        if (!slot.has_value()) return false;
+        RetireValue(*slot);
+        return Sync(position);
+    }
+
+    /**
+     * Merge or refill underfull nodes, one level at a time from the leaves
+     * up, and return how many pairs of siblings were fixed. Siblings are only
+     * ever merged or rebalanced under the same parent, with the two siblings
+     * and the parent latched, so this runs alongside every other operation.
+     * Nodes merged away are retired through the epoch manager. The root is
+     * never merged away, so the tree does not get any shallower.
+     */
+    auto Compact() -> int {
+        std::lock_guard<std::mutex> lk{compact_latch_};
+        auto fixed = 0;
+        {
+            auto guard = epoch_.Pin();
+            // nodes are only ever merged into their left sibling, so the
+            // leftmost node of every level stays put and each level can be
+            // walked from it
+            auto firsts = std::vector<Node<T, K, MinOrder>*>{};
+            for (auto node = GetRoot(); node != nullptr && !node->IsLeaf();) {
+                firsts.push_back(node);
+                node = FirstChild(node);
+            }
+            for (auto it = firsts.rbegin(); it != firsts.rend(); ++it)
+                fixed += CompactLevel(*it);
+        }
+        // give back what this pass retired, if no reader still needs it
+        epoch_.Reclaim();
+        return fixed;
+    }
+
+    /**
+     * Pack the leaves that have not been written since the previous pass
+     * into cold leaves, and return how many leaves were packed away. A cold
+     * leaf takes over the entries of up to 16 full leaves under the same
+     * parent, stored frame-of-reference or through a dictionary in a block
+     * of their own, so idle key ranges take up several times less memory.
+     * Cold leaves are read like any other, and a write to one thaws it back
+     * into leaves of the usual layout first, splitting it for as long as its
+     * entries do not fit in one leaf. Erases of keys that are not there, and
+     * updates that store nothing, leave it cold. Runs alongside every other
+     * operation, like Compact(). Rightmost leaves are left alone, since
+     * appends go there, and so are trees whose keys are not integers or
+     * whose values are not kept inline, for which this does nothing.
+     */
+    auto Freeze() -> int {
+        if constexpr (!Node<T, K, MinOrder>::kFreezable) return 0;
+        std::lock_guard<std::mutex> lk{compact_latch_};
+        auto frozen = 0;
+        {
+            auto guard = epoch_.Pin();
+            auto parent = GetRoot();
+            if (parent == nullptr || parent->IsLeaf()) return 0;
+            while (parent->GetLevel() > 1) parent = FirstChild(parent);
+            frozen = FreezeLevel(parent);
+        }
+        epoch_.Reclaim();
+        return frozen;
+    }
+
+    /**
+     * Run Compact() on a background thread every interval, followed by
+     * Freeze() if freeze is set, until StopCompaction() is called or the
+     * tree is destroyed. With freeze set, a leaf is packed once it has not
+     * been written for about an interval
+     */
+    void StartCompaction(std::chrono::milliseconds interval,
+                         bool freeze = false) {
+        StopCompaction();
+        compactor_ =
+            std::jthread{[this, interval, freeze](std::stop_token stop) {
+                auto latch = std::mutex{};
+                auto wakeup = std::condition_variable_any{};
+                auto lk = std::unique_lock<std::mutex>{latch};
+                // sleep out the interval, but wake up as soon as a stop is
+                // asked
+                while (!wakeup.wait_for(lk, stop, interval, [&] {
+                    return stop.stop_requested();
+                })) {
+                    Compact();
+                    if (freeze) Freeze();
+                }
+            }};
+    }
+
+    /**
+     * Stop the background compaction thread, if it is running, and wait for
+     * it to finish its pass
+     */
+    void StopCompaction() {
+        if (!compactor_.joinable()) return;
+        compactor_.request_stop();
+        compactor_.join();
+    }
+
+    /**
+     * Keep a copy of the upper levels of the tree on every NUMA node, and
+     * start descents from the copy on the calling thread's node instead of
+     * from the root, so that the levels every operation crosses are read from
+     * local memory. A copy takes the levels from the root down for as long as
+     * they add up to at most max_nodes nodes, and leads to the real nodes on
+     * the level below. Zero drops the copies.
+     * - A copy is rebuilt lazily, by the first descent on its node after a
+     *   split has reached the copied levels. Until then the stale copy is
+     *   still used, since it only ever leads a descent to the left of where
+     *   it is going, which right links make up for
+     * - Once compaction or a rebuild of the tree retires a node, which a copy
+     *   may lead to, no copy built before is used again
+     */
+    void ReplicateUpperLevels(std::size_t max_nodes = kReplicaNodes) {
+        std::lock_guard<std::mutex> lk{replica_latch_};
+        replica_nodes_.store(max_nodes, std::memory_order_relaxed);
+        // copies of the old size are rebuilt
+        reshapes_.fetch_add(1, std::memory_order_relaxed);
+        if (max_nodes != 0) return;
+        for (auto i = 0; i < Numa::NodeCount(); i++)
+            RetireReplica(
+                replicas_[i].exchange(nullptr, std::memory_order_acq_rel));
+    }
+
+    /**
+     * Look up a batch of keys. Returns the value stored under each key, in
+     * the order the keys were passed in. See BatchMode for how the batch is
+     * executed.
+     */
+    auto LookupBatch(std::span<const T> keys,
+                     BatchMode mode = BatchMode::kSorted)
+        -> std::vector<std::optional<K>> {
+        auto results = std::vector<std::optional<K>>(keys.size());
+        if (GetRoot() == nullptr || keys.empty()) return results;
+        auto guard = epoch_.Pin();
+        if (mode == BatchMode::kInterleaved)
+            LookupInterleaved(keys, results);
+        else
+            LookupSorted(keys, results);
+        return results;
+    }
+
+    /**
+     * Insert a batch of entries and return how many were inserted, or -1 if
+     * the log could not make them durable. An entry is skipped if its key is
+     * already in the tree or earlier in the batch.
+     * The entries are sorted first so that every run of entries that lands in
+     * the same leaf shares one descent and is applied under a single latch
+     * acquisition.
+     */
+    auto InsertBatch(std::span<const std::pair<T, K>> entries) -> int {
+        auto order = SortedOrder(entries.size(), [&](size_t i) -> const T& {
+            return entries[i].first;
+        });
+        if (!IsLogHealthy()) return -1;
+        auto guard = epoch_.Pin();
+        auto inserted = 0;
+        // the whole batch is committed to the log at once, at the end
+        auto position = uint64_t{0};
+        size_t i = 0;
+        while (i < order.size() && GetRoot() == nullptr) {
+            if (Insert(entries[order[i]].first, entries[order[i]].second))
+                inserted++;
+            i++;
+        }
+        while (i < order.size()) {
+            auto ancestors = Ancestors{};
+            auto leaf = Descend(entries[order[i]].first, ancestors);
+            // leaf is now LATCHED
+            while (true) {
+                auto& [key, val] = entries[order[i++]];
+                if (leaf->Contains(key)) {
+                    // skip duplicates
+                } else if (leaf->IsSafe(key)) {
+                    position = Log(LogOp::kInsert, key, &val);
+                    leaf->InsertSafe(key, val);
+                    inserted++;
+                } else {
+                    // the leaf is full, so split it the usual way. this
+                    // unlatches it
+                    position = Log(LogOp::kInsert, key, &val);
+                    InsertLatched(leaf, key, val, ancestors);
+                    inserted++;
+                    break;
+                }
+                if (i == order.size() ||
+                    leaf->Scannode(entries[order[i]].first) != leaf) {
+                    leaf->Unlatch();
+                    break;
+                }
+            }
+        }
+        return Sync(position) ? inserted : -1;
+    }
+
+    /**
+     * Build the tree bottom-up from entries sorted by key, in one pass over
+     * them. Leaves are packed to fill_factor of their capacity and linked
+     * through their right links as they are filled, then each level of
+     * internal nodes is built on top of the one below in a single pass. With
+     * parallel set, the nodes of each internal level are built on several
+     * threads. Entries whose key equals the one before are skipped.
+     *
+     * Returns false without loading anything if the tree is not empty, if
+     * another thread inserts into it before the load is done, or if it logs
+     * its writes, since loads are not logged.
+     */
+    template <typename It>
+    auto BulkLoad(It first, It last, double fill_factor = 1.0,
+                  bool parallel = false) -> bool {
+        if (GetRoot() != nullptr || log_ != nullptr) return false;
+        auto per_node = FillCount(fill_factor);
+        auto leaves = LeafPacker{allocator_, per_node, std::nullopt};
+        for (; first != last; ++first) {
+            const auto& [key, val] = *first;
+            leaves.Add(key, val);
+        }
+        return Publish(std::move(leaves.GetNodes()), per_node, parallel);
+    }
+
+    /**
+     * Build the tree from entries in any order, on every core. The entries
+     * are sorted in runs on each thread and then merged in parallel rounds,
+     * the leaves of each run are packed on its own thread, the runs are
+     * stitched together through their right links, and the levels above are
+     * built in parallel as in BulkLoad. Where entries share a key the one
+     * that came first is kept.
+     *
+     * Returns false without loading anything if the tree is not empty, if
+     * another thread inserts into it before the build is done, or if it
+     * logs its writes, like BulkLoad.
+     */
+    auto ParallelBuild(std::vector<std::pair<T, K>> entries,
+                       double fill_factor = 1.0) -> bool {
+        if (GetRoot() != nullptr || log_ != nullptr) return false;
+        auto per_node = FillCount(fill_factor);
+        auto threads = std::clamp<size_t>(
+            entries.size() / (kMinParallelNodes * per_node), 1,
+            std::max(1u, std::thread::hardware_concurrency()));
+        auto bounds = std::vector<size_t>{};
+        for (size_t t = 0; t <= threads; t++)
+            bounds.push_back(t * entries.size() / threads);
+        ParallelSort(entries, bounds);
+        // every run starts right after the last key stored before it, so
+        // that it skips the same duplicates and gets the same fences a
+        // single pass would
+        auto runs = std::vector<LeafPacker>{};
+        for (size_t t = 0; t < threads; t++) {
+            std::optional<T> before;
+            if (bounds[t] > 0) before = entries[bounds[t] - 1].first;
+            runs.emplace_back(allocator_, per_node, before);
+        }
+        RunParallel(threads, [&](size_t t) {
+            for (auto i = bounds[t]; i < bounds[t + 1]; i++)
+                runs[t].Add(entries[i].first, entries[i].second);
+        });
+        auto leaves = std::vector<Node<T, K, MinOrder>*>{};
+        LeafPacker* previous = nullptr;
+        for (auto& run : runs) {
+            auto& nodes = run.GetNodes();
+            if (nodes.empty()) continue;
+            if (previous != nullptr) previous->Link(nodes.front());
+            leaves.insert(leaves.end(), nodes.begin(), nodes.end());
+            previous = &run;
+        }
+        return Publish(leaves, per_node, true);
+    }
+
+    /**
+     * Merge every entry of other into this tree by streaming the leaf levels
+     * of both trees together into new leaves, packed to fill_factor, and
+     * building the levels above them as in BulkLoad. Where both trees hold a
+     * key, other's value wins, so a delta index can be folded into the main
+     * one. The new nodes replace the old ones all at once and the old ones
+     * are retired, so readers of this tree may run meanwhile, but writers
+     * may not. other is left as it is, and may be used meanwhile with the
+     * guarantees of ForEach. Compaction of both trees waits until the merge
+     * is done.
+     *
+     * Returns false without merging anything if this tree logs its writes,
+     * since merges are not logged, or if its root was replaced meanwhile,
+     * which only a writer can do.
+     */
+    auto MergeFrom(Tree& other, double fill_factor = 1.0) -> bool {
+        if (log_ != nullptr) return false;
+        if (&other == this) return true;
+        std::scoped_lock lk{compact_latch_, other.compact_latch_};
+        // both trees share the one epoch manager
+        auto guard = epoch_.Pin();
+        auto per_node = FillCount(fill_factor);
+        auto leaves = LeafPacker{allocator_, per_node, std::nullopt};
+        auto old_root = GetRoot();
+        auto mine = LeafCursor{FirstLeaf(old_root)};
+        auto theirs = LeafCursor{FirstLeaf(other.GetRoot())};
+        while (mine.IsValid() || theirs.IsValid()) {
+            // on equal keys other's entry goes first, and the packer skips
+            // the one from this tree that follows it
+            if (!theirs.IsValid() ||
+                (mine.IsValid() && mine.GetKey() < theirs.GetKey())) {
+                leaves.Add(mine.GetKey(), mine.GetValue());
+                mine.Next();
+            } else {
+                leaves.Add(theirs.GetKey(), theirs.GetValue());
+                theirs.Next();
+            }
+        }
+        if (leaves.GetNodes().empty()) return true;
+        // the old nodes are only retired once the new root is in place, and
+        // with it the new tail
+        if (!Publish(std::move(leaves.GetNodes()), per_node, true, old_root))
+            return false;
+        if (old_root != nullptr) RetireNodes(old_root);
+        return true;
+    }
+
+    /**
+     * Call fn(key, val) for every entry, in key order. Leaves are read
+     * optimistically one at a time and fn is called after each is read, so
+     * the tree stays fully usable meanwhile.
+     * Entries inserted or erased during the walk may or may not be seen;
+     * every other entry is seen exactly once. Compaction waits until the
+     * walk is done.
+     */
+    template <typename F>
+    void ForEach(F&& fn) {
+        // compaction is the only thing that unlinks leaves, so with it held
+        // off the right links of the leaf level reach every leaf
+        std::lock_guard<std::mutex> lk{compact_latch_};
+        auto guard = epoch_.Pin();
+        for (auto leaf = LeafCursor{FirstLeaf(GetRoot())}; leaf.IsValid();
+             leaf.Next())
+            fn(leaf.GetKey(), leaf.GetValue());
+    }
+
+    /**
+     * Write every entry of the tree to a snapshot at path, which Snapshot
+     * can then map (trivially copyable keys and values only). Runs alongside
+     * every other operation, with the guarantees of ForEach.
+     */
+    auto SaveSnapshot(const std::string& path) -> bool {
+        auto builder = typename Snapshot<T, K>::Builder{path};
+        ForEach([&](const T& key, const K& val) { builder.Add(key, val); });
+        return builder.Finish();
+    }
+
+    /**
+     * Rebuild the tree, which must be empty, from the snapshot at
+     * snapshot_path if there is one and every operation logged since, then
+     * log every write to the log from here on. Inserts, upserts, updates and
+     * erases only return once their record is durable, and concurrent ones
+     * share the log's group commits. A write whose commit fails returns
+     * false, though it stays applied in memory, and once the log has failed
+     * every write is refused. Bulk loads, parallel builds and merges are
+     * refused from here on, since they are not logged: load a tree first
+     * and save a snapshot of it to recover from instead. Returns false
+     * without recovering anything if the tree is not empty, and false if the
+     * snapshot cannot be read or loaded.
+     */
+    auto Recover(const std::string& snapshot_path, WriteAheadLog& log)
+        -> bool {
+        // replaying over entries the log knows nothing about would mix them
+        // into the recovered state
+        if (GetRoot() != nullptr) return false;
+        if (::access(snapshot_path.c_str(), F_OK) == 0) {
+            if constexpr (std::is_trivially_copyable_v<T> &&
+                          std::is_trivially_copyable_v<K>) {
+                auto snapshot = Snapshot<T, K>::Open(snapshot_path);
+                if (snapshot == nullptr) return false;
+                auto entries = std::vector<std::pair<T, K>>{};
+                entries.reserve(snapshot->GetCount());
+                snapshot->ForEach([&](const T& key, const K& val) {
+                    entries.emplace_back(key, val);
+                });
+                if (!BulkLoad(entries.begin(), entries.end())) return false;
+            } else {
+                // only trivially copyable entries can be snapshotted
+                return false;
+            }
+        }
+        // replaying from before the snapshot was taken is harmless: from
+        // any state the snapshot can have caught a key in, the rest of its
+        // inserts, upserts and erases end up where they did the first time
+        log.Replay([&](std::string_view record) {
+            if (record.empty()) return;
+            auto op = static_cast<LogOp>(record.front());
+            record.remove_prefix(1);
+            auto key = T{};
+            if (!LogCodec<T>::Decode(record, key)) return;
+            if (op == LogOp::kErase) {
+                Erase(key);
+                return;
+            }
+            auto val = K{};
+            if (!LogCodec<K>::Decode(record, val)) return;
+            // an insert leaves a key that is already there as it is
+            if (op == LogOp::kUpsert)
+                Upsert(key, val);
+            else
+                Insert(key, val);
+        });
+        log_ = &log;
+        return true;
+    }
+
+    /**
+     * Save a snapshot to snapshot_path for Recover to start from, and drop the
+     * log segments it makes redundant. Runs alongside every other operation,
+     * like SaveSnapshot.
+     */
+    auto Checkpoint(const std::string& snapshot_path) -> bool {
+        if (log_ == nullptr) return SaveSnapshot(snapshot_path);
+        // operations are logged while their leaf is latched, so everything
+        // logged before the rotation has been applied by the time the
+        // snapshot reads its leaf
+        auto segment = log_->Rotate();
+        if (!segment.has_value() || !SaveSnapshot(snapshot_path)) return false;
+        return log_->Truncate(*segment);
+    }
+
+    /**
+     * The hot-path counters of every thread that has used the tree, summed.
+     * Counters are only kept when the tree is compiled with MEMORYTREE_STATS
+     * defined, and are all zero otherwise. Safe to call at any time; counts
+     * from operations still running may be missing
+     */
+    auto Stats() const -> TreeStats { return stats_.Collect(); }
+
+   private:
+    using Slot = typename Node<T, K, MinOrder>::Slot;
+
+    // the kinds of records the tree writes to its log. an upsert stores its
+    // value whether or not the key is there
+    enum class LogOp : uint8_t { kInsert = 1, kErase = 2, kUpsert = 3 };
+
+    // insert the key with val, or if it is already in the tree and assign is
+    // set, replace its value under the same leaf latch. a key that is
+    // already there without assign set is kFailed, since nothing is stored
+    auto Put(const T& key, const K& val, bool assign) -> UpsertResult {
+        if (!IsLogHealthy()) return UpsertResult::kFailed;
+        auto guard = epoch_.Pin();
+        auto ancestors = Ancestors{};
+        auto current = GetRoot();
+        // if the root is null then just create a new node, insert the key, and
+        // try to publish it as this tree's root_. if another thread published
+        // a root first, the node was never visible and can just be deleted
+        if (current == nullptr) {
+            auto root = Node<T, K, MinOrder>::New(allocator_);
+            root->InsertSafe(key, val);
+            root->SetRoot(true);
+            // the root is published latched, so that nothing can be logged
+            // for the key ahead of this insert
+            root->Latch();
+            if (root_.compare_exchange_strong(current, root,
+                                              std::memory_order_acq_rel)) {
+                tail_.store(root, std::memory_order_release);
+                auto position = Log(LogOp::kInsert, key, &val);
+                root->Unlatch();
+                return Sync(position) ? UpsertResult::kInserted
+                                      : UpsertResult::kFailed;
+            }
+            Node<T, K, MinOrder>::Delete(allocator_, root);
+        }
+
+        current = LatchTail(key);
+        if (current == nullptr) {
+            current = Descend(key, ancestors);
+            // the descent may have found a new rightmost leaf, after
+            // compaction merged the last one away
+            if (current->GetRight() == nullptr &&
+                tail_.load(std::memory_order_relaxed) != current)
+                tail_.store(current, std::memory_order_release);
+        } else {
+            // the tail was reached without a descent, so a split finds its
+            // parent from the root
+            ancestors.stats = stats_.Local();
+        }
+        // current is now LATCHED
+        if (assign) {
+            auto old = current->Replace(key, val);
+            if (old.has_value()) {
+                auto position = Log(LogOp::kUpsert, key, &val);
+                current->Unlatch();
+                RetireValue(*old);
+                return Sync(position) ? UpsertResult::kReplaced
+                                      : UpsertResult::kFailed;
+            }
+        } else if (current->Contains(key)) {
+            current->Unlatch();
+            return UpsertResult::kFailed;
+        }
+        auto position = Log(LogOp::kInsert, key, &val);
+        // current is ALWAYS latched when the following procedure is called
+        auto inserted = InsertLatched(current, key, val, ancestors);
+        auto durable = Sync(position);
+        return inserted && durable ? UpsertResult::kInserted
+                                   : UpsertResult::kFailed;
+    }
+
+    // store what fn(current value) returns under the key, unless it returns
+    // nullopt. the leaf stays latched from reading the value to storing the
+    // new one, and the new value is logged like an upsert
+    template <typename F>
+    auto Modify(const T& key, F&& fn) -> bool {
+        auto guard = epoch_.Pin();
+        if (GetRoot() == nullptr || !IsLogHealthy()) return false;
+        auto leaf = LatchLeaf(key);
+        // leaf is now LATCHED
+        auto slot = leaf->Find(key);
+        auto val = slot.has_value() ? fn(ValueSlot<K>::Unbox(*slot))
+                                    : std::optional<K>{};
+        if (!val.has_value()) {
+            leaf->Unlatch();
+            return false;
+        }
+        // a cold leaf is only thawed once there is a value to write. the
+        // value cannot change meanwhile, since the latch is held throughout
+        leaf = ThawLeaf(leaf, key);
+        auto position = Log(LogOp::kUpsert, key, &*val);
+        auto old = leaf->Replace(key, *val);
+        leaf->Unlatch();
+        RetireValue(*old);
+        return Sync(position);
+    }
+
+    // append the operation to the log, if there is one, and return the
+    // position to commit, or 0. callers hold the latch of the key's leaf, so
+    // operations on the same key are logged in the order they apply
+    auto Log(LogOp op, const T& key, const K* val) -> uint64_t {
+        if (log_ == nullptr) return 0;
+        thread_local auto record = std::string{};
+        record.clear();
+        record.push_back(static_cast<char>(op));
+        LogCodec<T>::Encode(key, record);
+        if (val != nullptr) LogCodec<K>::Encode(*val, record);
+        return log_->Append(record);
+    }
+
+    // wait until the logged operation is durable, and return whether it is
+    inline auto Sync(uint64_t position) -> bool {
+        return position == 0 || log_->Commit(position);
+    }
+
+    // whether writes can be made durable, which they trivially are without a
+    // log. a failed log stays failed, so writes are refused up front rather
+    // than applied and then reported as lost
+    inline auto IsLogHealthy() const -> bool {
+        return log_ == nullptr || log_->IsHealthy();
+    }
+
+    // the number of keys a node packed to fill_factor holds
+    static auto FillCount(double fill_factor) -> int {
+        auto count = static_cast<int>(fill_factor *
+                                      Node<T, K, MinOrder>::kCapacity);
+        return std::clamp(count, 1, Node<T, K, MinOrder>::kCapacity);
+    }
+
+    // packs entries, added in key order, into leaves of per_node entries
+    // linked through their right links, skipping keys equal to the one
+    // before. every leaf but the last gets its fences as soon as the one
+    // after it is started
+    class LeafPacker {
+       public:
+        // before is the key stored right before the first one added, if any
+        explicit LeafPacker(Allocator& allocator, int per_node,
+                            std::optional<T> before)
+            : allocator_{&allocator},
+              per_node_{per_node},
+              count_{0},
+              low_key_{before},
+              last_key_{before} {}
+
+        void Add(const T& key, const K& val) {
+            if (last_key_.has_value() && !(*last_key_ < key)) return;
+            auto leaf = nodes_.empty() ? nullptr : nodes_.back();
+            if (leaf == nullptr || count_ == per_node_ || !leaf->IsSafe(key)) {
+                auto next = Node<T, K, MinOrder>::New(*allocator_);
+                if (leaf != nullptr) {
+                    leaf->SetFences(low_key_, last_key_);
+                    leaf->SetRight(next);
+                    low_key_ = last_key_;
+                }
+                nodes_.push_back(next);
+                leaf = next;
+                count_ = 0;
+            }
+            leaf->Append(key, val);
+            last_key_ = key;
+            count_++;
+        }
+
+        // link the last leaf to next, the first leaf of the entries that
+        // follow, and give it its fences
+        void Link(Node<T, K, MinOrder>* next) {
+            nodes_.back()->SetFences(low_key_, last_key_);
+            nodes_.back()->SetRight(next);
+        }
+
+        inline auto GetNodes() -> std::vector<Node<T, K, MinOrder>*>& {
+            return nodes_;
+        }
+
+       private:
+        Allocator* allocator_;
+        int per_node_;
+        // entries in the last leaf
+        int count_;
+        // the low bound of the last leaf
+        std::optional<T> low_key_;
+        std::optional<T> last_key_;
+        std::vector<Node<T, K, MinOrder>*> nodes_;
+    };
+
+    // walks the leaf level rightward from a leaf, copying out one leaf at a
+    // time after reading it optimistically. the caller is pinned and holds
+    // compact_latch_, so that the right links reach every leaf
+    class LeafCursor {
+       public:
+        explicit LeafCursor(Node<T, K, MinOrder>* leaf) : leaf_{leaf}, pos_{0} {
+            Load();
+        }
+
+        inline auto IsValid() const -> bool { return pos_ < keys_.size(); }
+        inline auto GetKey() const -> const T& { return keys_[pos_]; }
+        inline auto GetValue() const -> const K& {
+            return ValueSlot<K>::Unbox(slots_[pos_]);
+        }
+
+        void Next() {
+            if (++pos_ == keys_.size()) Load();
+        }
+
+       private:
+        // copy out the next leaf that is not empty
+        void Load() {
+            pos_ = 0;
+            keys_.clear();
+            while (leaf_ != nullptr && keys_.empty()) {
+                Node<T, K, MinOrder>* right;
+                while (true) {
+                    auto version = leaf_->ReadVersion();
+                    auto entries = leaf_->GetEntries();
+                    keys_.clear();
+                    slots_.clear();
+                    for (auto i = 0; i < entries.GetCount(); i++) {
+                        keys_.push_back(entries.GetKey(i));
+                        slots_.push_back(entries.GetSlot(i));
+                    }
+                    right = leaf_->GetRight();
+                    if (leaf_->Validate(version)) break;
+                }
+                leaf_ = right;
+            }
+        }
+
+        Node<T, K, MinOrder>* leaf_;
+        std::vector<T> keys_;
+        std::vector<Slot> slots_;
+        std::size_t pos_;
+    };
+
+    // the leftmost leaf under node
+    static auto FirstLeaf(Node<T, K, MinOrder>* node) -> Node<T, K, MinOrder>* {
+        while (node != nullptr && !node->IsLeaf()) node = FirstChild(node);
+        return node;
+    }
+
+    // build the levels of internal nodes above the linked leaves, and swap
+    // the new root in for expected. the whole tree becomes visible at once,
+    // or not at all: if the root is no longer expected the new nodes are
+    // deleted and false is returned
+    auto Publish(std::vector<Node<T, K, MinOrder>*> level, int per_node,
+                 bool parallel, Node<T, K, MinOrder>* expected = nullptr)
+        -> bool {
+        if (level.empty()) return true;
+        auto tail = level.back();
+        for (auto height = 1; level.size() > 1; height++)
+            level = BuildLevel(level, per_node + 1, height, parallel);
+        level.front()->SetRoot(true);
+        if (root_.compare_exchange_strong(expected, level.front(),
+                                          std::memory_order_acq_rel)) {
+            tail_.store(tail, std::memory_order_release);
+            return true;
+        }
+        DeleteNodes(level.front());
+        return false;
+    }
+
+    // sort entries stably by key: each range between two bounds on a thread
+    // of its own, then neighbouring ranges merged pairwise in parallel
+    // rounds until one is left
+    static void ParallelSort(std::vector<std::pair<T, K>>& entries,
+                             const std::vector<size_t>& bounds) {
+        auto by_key = [](const auto& a, const auto& b) {
+            return a.first < b.first;
+        };
+        auto at = [&](size_t run) { return entries.begin() + bounds[run]; };
+        auto runs = bounds.size() - 1;
+        RunParallel(runs, [&](size_t run) {
+            std::stable_sort(at(run), at(run + 1), by_key);
+        });
+        for (size_t width = 1; width < runs; width *= 2) {
+            RunParallel((runs + 2 * width - 1) / (2 * width), [&](size_t i) {
+                auto first = 2 * width * i;
+                std::inplace_merge(at(first), at(std::min(first + width, runs)),
+                                   at(std::min(first + 2 * width, runs)),
+                                   by_key);
+            });
+        }
+    }
+
+    // call fn(0) to fn(count - 1), each on a thread of its own, and wait for
+    // all of them
+    template <typename F>
+    static void RunParallel(size_t count, F&& fn) {
+        auto workers = std::vector<std::thread>{};
+        for (size_t i = 1; i < count; i++)
+            workers.emplace_back([&fn, i] { fn(i); });
+        if (count > 0) fn(0);
+        for (auto& worker : workers) worker.join();
+    }
+
+    // build the level of internal nodes above children, spreading the
+    // children evenly over as few nodes of at most fanout children as
+    // possible. keys with a byte budget are packed greedily instead, cutting a
+    // node short wherever its keys would not fit
+    auto BuildLevel(const std::vector<Node<T, K, MinOrder>*>& children,
+                    int fanout, int height, bool parallel)
+        -> std::vector<Node<T, K, MinOrder>*> {
+        using Keys = typename Node<T, K, MinOrder>::Keys;
+        // where the children of each node start, and where the last one ends
+        auto starts = std::vector<size_t>{0};
+        if constexpr (Keys::kBounded) {
+            auto in_node = 1;
+            auto bytes = 0;
+            for (size_t child = 1; child < children.size(); child++) {
+                auto weight = Keys::Weight(*children[child - 1]->GetHighKey());
+                if (in_node == fanout || bytes + weight > Keys::kBudget) {
+                    starts.push_back(child);
+                    in_node = 1;
+                    bytes = 0;
+                } else {
+                    in_node++;
+                    bytes += weight;
+                }
+            }
+        } else {
+            auto count = (children.size() + fanout - 1) / fanout;
+            for (size_t i = 1; i < count; i++)
+                starts.push_back(i * children.size() / count);
+        }
+        starts.push_back(children.size());
+        auto count = starts.size() - 1;
+        auto parents = std::vector<Node<T, K, MinOrder>*>(count);
+        auto build = [&](size_t begin, size_t end) {
+            auto keys = std::array<T, Node<T, K, MinOrder>::kCapacity>{};
+            for (auto i = begin; i < end; i++) {
+                auto first = starts[i];
+                auto last = starts[i + 1];
+                // every child but the last is split off from the next one by
+                // its high key
+                for (auto child = first; child + 1 < last; child++)
+                    keys[child - first] = *children[child]->GetHighKey();
+                auto parent_keys =
+                    std::span<const T>(keys.data(), last - first - 1);
+                auto parent_children = std::span<Node<T, K, MinOrder>* const>(
+                    children.data() + first, last - first);
+                auto parent = Node<T, K, MinOrder>::New(
+                    allocator_, parent_keys, parent_children);
+                parent->SetLevel(height);
+                auto low_key = first == 0 ? std::nullopt
+                                          : children[first - 1]->GetHighKey();
+                parent->SetFences(low_key, children[last - 1]->GetHighKey());
+                parents[i] = parent;
+            }
+        };
+        auto cores = std::max(1u, std::thread::hardware_concurrency());
+        auto threads =
+            parallel ? std::clamp<size_t>(count / kMinParallelNodes, 1, cores)
+                     : 1;
+        RunParallel(threads, [&](size_t t) {
+            build(t * count / threads, (t + 1) * count / threads);
+        });
+        for (size_t i = 0; i + 1 < count; i++)
+            parents[i]->SetRight(parents[i + 1]);
+        return parents;
+    }
+
+    // the fewest nodes of a level BuildLevel builds on each thread. below it
+    // starting a thread costs more than it saves
+    static constexpr size_t kMinParallelNodes = 1024;
+
+    // the most levels above the leaves a descent remembers. the parent of a
+    // node higher up than that is found again from the root, which is slower
+    // but just as correct
+    static constexpr int kMaxHeight = 32;
+
+    // the rightmost node a descent visited on each level above the leaves,
+    // indexed by level, so that a split can go straight to the parent. lives
+    // on the stack of the inserting thread and never allocates
+    struct Ancestors {
+        // remember node, which the descent is leaving downward
+        inline void Set(Node<T, K, MinOrder>* node) {
+            auto level = node->GetLevel();
+            if (level < kMaxHeight) nodes[level] = node;
+        }
+
+        // the node to start looking for the parent on the level from, or null
+        // if the descent did not reach that level
+        inline auto Get(int level) const -> Node<T, K, MinOrder>* {
+            return level <= top && level < kMaxHeight ? nodes[level] : nullptr;
+        }
+
+        // the level of the root the descent started from
+        int top = 0;
+        // the inserting thread's counters, null unless stats are compiled in
+        StatsSlot* stats = nullptr;
+        Node<T, K, MinOrder>* nodes[kMaxHeight];
+    };
+
+    // descend to the leaf whose bounds cover key and return it latched, and
+    // thawed if it was cold, recording the rightmost node visited on each
+    // level in ancestors
+    auto Descend(const T& key, Ancestors& ancestors) -> Node<T, K, MinOrder>* {
+        auto current = StartNode(key);
+        ancestors.top = current->GetLevel();
+        ancestors.stats = stats_.Local();
+        if constexpr (kCollectStats)
+            ancestors.stats->CountDepth(ancestors.top + 1);
+        // continue until we hit a leaf
+        while (!current->IsLeaf()) {
+            auto t = current;
+            current = current->ScannodeUnlatched(key);
+            // we only want to record the rightmost node at each level, so skip
+            // the nodes we only passed through going right
+            if (current->GetLevel() != t->GetLevel()) {
+                ancestors.Set(t);
+            } else if constexpr (kCollectStats) {
+                ancestors.stats->CountRightMove();
+            }
+        }
+        return Thaw(
+            Node<T, K, MinOrder>::MoveRight(current, key, ancestors.stats), key,
+            ancestors);
+    }
+
+    // latch the leaf whose bounds cover key, without keeping track of the
+    // nodes above it. the leaf may be cold, since reads of it need no thaw:
+    // callers thaw it with ThawLeaf once they know they will write to it
+    auto LatchLeaf(const T& key) -> Node<T, K, MinOrder>* {
+        return Node<T, K, MinOrder>::MoveRight(DescendUnlatched(key), key,
+                                               stats_.Local());
+    }
+
+    // thaw the latched leaf LatchLeaf returned for key if it is cold, and
+    // return the latched leaf that covers key
+    auto ThawLeaf(Node<T, K, MinOrder>* leaf, const T& key)
+        -> Node<T, K, MinOrder>* {
+        auto ancestors = Ancestors{};
+        ancestors.stats = stats_.Local();
+        return Thaw(leaf, key, ancestors);
+    }
+
+    // thaw the latched leaf if it is cold, and return the leaf that covers
+    // key latched. a cold leaf with more entries than a leaf holds is split
+    // in halves until the half the key goes in fits
+    auto Thaw(Node<T, K, MinOrder>* leaf, const T& key,
+              const Ancestors& ancestors) -> Node<T, K, MinOrder>* {
+        if constexpr (Node<T, K, MinOrder>::kFreezable) {
+            while (leaf->IsCold()) {
+                auto cold = leaf->GetCold();
+                if (!leaf->Thaw()) {
+                    SplitUp(leaf, false, ancestors);
+                    leaf = Node<T, K, MinOrder>::MoveRight(leaf, key,
+                                                           ancestors.stats);
+                }
+                RetireCold(cold);
+            }
+        }
+        return leaf;
+    }
+
+    // descend to a leaf at or left of the one whose bounds cover key, without
+    // latching anything
+    auto DescendUnlatched(const T& key) -> Node<T, K, MinOrder>* {
+        auto current = StartNode(key);
+        while (!current->IsLeaf()) current = current->ScannodeUnlatched(key);
+        return current;
+    }
+
+    // sort the keys so that every run of keys that lands in the same leaf
+    // shares one descent and one optimistic read of the leaf
+    void LookupSorted(std::span<const T> keys,
+                      std::vector<std::optional<K>>& results) {
+        auto order = SortedOrder(keys.size(), [&](size_t i) -> const T& {
+            return keys[i];
+        });
+        auto slots = std::vector<std::optional<Slot>>(keys.size());
+        size_t i = 0;
+        auto leaf = DescendUnlatched(keys[order[0]]);
+        while (i < order.size()) {
+            auto version = leaf->ReadVersion();
+            auto next = leaf->Scannode(keys[order[i]]);
+            auto j = i;
+            if (next == leaf) {
+                // read every following key this leaf covers in one go
+                for (; j < order.size(); j++) {
+                    if (leaf->Scannode(keys[order[j]]) != leaf) break;
+                    slots[j] = leaf->Find(keys[order[j]]);
+                }
+            }
+            if (!leaf->Validate(version)) continue;
+            if (next != leaf) {
+                leaf = next;
+                continue;
+            }
+            for (; i < j; i++) {
+                if (slots[i].has_value())
+                    results[order[i]] = ValueSlot<K>::Unbox(*slots[i]);
+            }
+            if (i < order.size()) leaf = DescendUnlatched(keys[order[i]]);
+        }
+    }
+
+    // the number of descents LookupInterleaved keeps in flight. enough to
+    // cover a memory stall with the work of the other descents
+    static constexpr int kInterleaveWidth = 8;
+
+    // keep kInterleaveWidth descents in flight. each step of a descent reads
+    // one node and prefetches the next one, then moves on to the next
+    // descent, so that by the time it comes back around the node is cached
+    void LookupInterleaved(std::span<const T> keys,
+                           std::vector<std::optional<K>>& results) {
+        struct Lookup {
+            size_t index;
+            Node<T, K, MinOrder>* node;
+        };
+        // every descent starts where a single lookup's would, from the copy
+        // of the upper levels if there is one
+        auto start = [&](size_t index) -> Lookup {
+            return {index, StartNode(keys[index])};
+        };
+        auto inflight = std::array<Lookup, kInterleaveWidth>{};
+        auto active = 0;
+        size_t next_index = 0;
+        while (active < kInterleaveWidth && next_index < keys.size())
+            inflight[active++] = start(next_index++);
+        while (active > 0) {
+            for (auto i = 0; i < active;) {
+                auto& lookup = inflight[i];
+                auto& key = keys[lookup.index];
+                auto node = lookup.node;
+                auto version = node->ReadVersion();
+                auto next = node->Scannode(key);
+                auto slot = next == node ? node->Find(key) : std::nullopt;
+                if (!node->Validate(version)) {
+                    // leave it for the next pass
+                    i++;
+                    continue;
+                }
+                if (next != node) {
+                    next->Prefetch();
+                    lookup.node = next;
+                    i++;
+                    continue;
+                }
+                if (slot.has_value())
+                    results[lookup.index] = ValueSlot<K>::Unbox(*slot);
+                // start the next key in this slot, or retire the slot
+                if (next_index < keys.size()) {
+                    lookup = start(next_index++);
+                    i++;
+                } else {
+                    lookup = inflight[--active];
+                }
+            }
+        }
+    }
+
+    // the indices 0..count - 1, stably sorted by the key at each index
+    template <typename F>
+    static auto SortedOrder(size_t count, F&& key_at) -> std::vector<size_t> {
+        auto order = std::vector<size_t>(count);
+        for (size_t i = 0; i < count; i++) order[i] = i;
+        std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+            return key_at(a) < key_at(b);
+        });
+        return order;
+    }
+
+    // insert into the latched leaf, which must not hold the key, then split
+    // the way up the tree for as long as nodes overflow. only splits
+    // allocate, and every node is unlatched on the way out
+    auto InsertLatched(Node<T, K, MinOrder>* leaf, const T& key, const K& val,
+                       const Ancestors& ancestors) -> bool {
+        auto safe = leaf->IsSafe(key);
+        leaf->InsertUnsafe(key, val);
+        if (safe) {
+            leaf->Unlatch();
+            return true;
+        }
+        SplitUp(leaf, leaf->IsAppend(key), ancestors);
+        return true;
+    }
+
+    // split the latched node, which overflows or is cold, then the way up the
+    // tree for as long as nodes overflow. every node is unlatched on the way
+    // out
+    void SplitUp(Node<T, K, MinOrder>* current, bool append,
+                 const Ancestors& ancestors) {
+        while (true) {
+            // current is ALWAYS latched and overflowing, or a cold leaf being
+            // thawed, at this point. a node
+            // that overflowed from an append at the right end of its level
+            // splits off a nearly empty node for the appends that follow
+            auto split = current->Split(allocator_, append);
+            auto tail =
+                current->IsLeaf() && split.GetRight()->GetRight() == nullptr;
+            if constexpr (kCollectStats) {
+                ancestors.stats->CountSplit(current->GetLevel());
+                if (split.HasRoot()) ancestors.stats->CountRootPromotion();
+            }
+            // the separator goes into a level copies of the upper levels hold
+            if (current->GetLevel() >=
+                replica_level_.load(std::memory_order_relaxed))
+                reshapes_.fetch_add(1, std::memory_order_relaxed);
+            if (split.HasRoot()) {
+                // only the thread holding the old root's latch can replace it,
+                // so the exchange always succeeds. it publishes the new root,
+                // fully built, to every thread that loads root_ from here on
+                auto expected = current;
+                root_.compare_exchange_strong(expected, split.GetRoot(),
+                                              std::memory_order_acq_rel);
+                // a split of the new tail looks for its parent from the
+                // root, so the tail is only published once there is one
+                if (tail)
+                    tail_.store(split.GetRight(), std::memory_order_release);
+                current->Unlatch();
+                return;
+            }
+            // the new node is the new tail. it is published before it is
+            // linked into the parent, so compaction cannot have retired it
+            if (tail) tail_.store(split.GetRight(), std::memory_order_release);
+            const auto& separator = split.GetPromotedKey();
+            auto parent = ancestors.Get(current->GetLevel() + 1);
+            // if the descent did not reach the parent's level, the node was
+            // the root when we descended and a new root has been created above
+            // it since
+            if (parent == nullptr) parent = FindParent(current, separator);
+            // MoveRight latches the parent before the child is unlatched
+            parent = Node<T, K, MinOrder>::MoveRight(parent, separator,
+                                                     ancestors.stats);
+            current->Unlatch();
+            current = parent;
+            auto safe = current->IsSafe(separator);
+            current->InsertUnsafe(separator, split.GetRight());
+            if (safe) {
+                current->Unlatch();
+                return;
+            }
+            append = current->IsAppend(separator);
+        }
+    }
+
+    // latch the rightmost leaf and return it if the key is larger than every
+    // key in it, which is where increasing keys such as timestamps go, or
+    // return null if the key goes anywhere else. the leaf is checked
+    // optimistically first, so inserts elsewhere never latch it. the caller
+    // is pinned
+    auto LatchTail(const T& key) -> Node<T, K, MinOrder>* {
+        auto leaf = tail_.load(std::memory_order_acquire);
+        if (leaf == nullptr) return nullptr;
+        auto version = leaf->ReadVersion();
+        if (!IsTailFor(leaf, key) || !leaf->Validate(version)) return nullptr;
+        leaf->Latch(stats_.Local());
+        if (IsTailFor(leaf, key)) return leaf;
+        leaf->Unlatch();
+        return nullptr;
+    }
+
+    // the rightmost leaf covers every key from its low bound on, so a key
+    // larger than the largest one in it belongs there
+    static auto IsTailFor(Node<T, K, MinOrder>* leaf, const T& key) -> bool {
+        return leaf->GetRight() == nullptr && !leaf->IsDeleted() &&
+               leaf->GetCount() > 0 && leaf->FindIndex(key) == leaf->GetCount();
+    }
+
+    // find the node on the level above node to start moving right from
+    auto FindParent(Node<T, K, MinOrder>* node, const T& key)
+        -> Node<T, K, MinOrder>* {
+        auto current = GetRoot();
+        while (current->GetLevel() > node->GetLevel() + 1)
+            current = current->ScannodeUnlatched(key);
+        return current;
+    }
+
+    // the leftmost child of an internal node
+    static auto FirstChild(Node<T, K, MinOrder>* node)
+        -> Node<T, K, MinOrder>* {
+        while (true) {
+            auto version = node->ReadVersion();
+            auto child = node->GetChildren().front();
+            if (node->Validate(version)) return child;
+        }
+    }
+
+    // fix the underfull children of every node on the level that starts at
+    // parent, one adjacent pair of children at a time
+    auto CompactLevel(Node<T, K, MinOrder>* parent) -> int {
+        constexpr auto kMaxChildren = Node<T, K, MinOrder>::kCapacity + 2;
+        auto fixed = 0;
+        auto index = 0;
+        while (parent != nullptr) {
+            auto children = std::array<Node<T, K, MinOrder>*, kMaxChildren>{};
+            auto count = 0;
+            Node<T, K, MinOrder>* right;
+            auto deleted = false;
+            while (true) {
+                auto version = parent->ReadVersion();
+                auto read = parent->GetChildren();
+                count = static_cast<int>(read.size());
+                std::copy(read.begin(), read.end(), children.begin());
+                right = parent->GetRight();
+                deleted = parent->IsDeleted();
+                if (parent->Validate(version)) break;
+            }
+            if (deleted || index + 1 >= count) {
+                parent = right;
+                index = 0;
+                continue;
+            }
+            auto left = children[index];
+            auto sibling = children[index + 1];
+            // the counts are only a hint here. Rebalance checks them again
+            // under the latches. after a merge the same left node is tried
+            // against its new right sibling
+            if ((left->IsUnderfull() || sibling->IsUnderfull()) &&
+                Rebalance(parent, left, sibling))
+                fixed++;
+            else
+                index++;
+        }
+        return fixed;
+    }
+
+    // merge right into left if their entries fit in one node, or else move
+    // entries over from left if right is underfull. entries never move left
+    // between live nodes, since a reader that read the parent before the move
+    // could not find them again. returns whether anything was done
+    auto Rebalance(Node<T, K, MinOrder>* parent, Node<T, K, MinOrder>* left,
+                   Node<T, K, MinOrder>* right) -> bool {
+        // latch left to right and bottom up, the same order splits use
+        left->Latch();
+        right->Latch();
+        parent->Latch();
+        auto index = parent->ChildIndex(left);
+        // cold leaves are only ever packed further by Freeze()
+        auto adjacent = !parent->IsDeleted() && !left->IsDeleted() &&
+                        index >= 0 && index < parent->GetCount() &&
+                        parent->GetChildren()[index + 1] == right &&
+                        !left->IsCold() && !right->IsCold();
+        auto merged = false;
+        auto shifted = false;
+        if (adjacent) {
+            auto moved = (left->GetCount() - right->GetCount()) / 2;
+            if (left->CanAbsorb(right)) {
+                left->Absorb(right);
+                parent->RemoveAt(index);
+                merged = true;
+            } else if (right->IsUnderfull() && right->GetRight() != nullptr &&
+                       moved > 0 &&
+                       left->CanShiftRight(right, moved) &&
+                       parent->CanSetKey(index,
+                                         left->ShiftedSeparator(moved))) {
+                parent->SetKey(index, left->ShiftRight(right, moved));
+                shifted = true;
+            }
+        }
+        parent->Unlatch();
+        right->Unlatch();
+        left->Unlatch();
+        if (merged) Retire(right);
+        return merged || shifted;
+    }
+
+    // pack runs of idle leaves on the level of leaves, whose parents start
+    // at parent, into cold leaves. a leaf counts as idle if its version has
+    // not moved since the previous pass marked it
+    auto FreezeLevel(Node<T, K, MinOrder>* parent) -> int {
+        constexpr auto kMaxChildren = Node<T, K, MinOrder>::kCapacity + 2;
+        auto frozen = 0;
+        auto index = 0;
+        while (parent != nullptr) {
+            auto children = std::array<Node<T, K, MinOrder>*, kMaxChildren>{};
+            auto count = 0;
+            Node<T, K, MinOrder>* right;
+            auto deleted = false;
+            while (true) {
+                auto version = parent->ReadVersion();
+                auto read = parent->GetChildren();
+                count = static_cast<int>(read.size());
+                std::copy(read.begin(), read.end(), children.begin());
+                right = parent->GetRight();
+                deleted = parent->IsDeleted();
+                if (parent->Validate(version)) break;
+            }
+            if (deleted || index >= count) {
+                parent = right;
+                index = 0;
+                continue;
+            }
+            auto left = children[index];
+            // after a freeze the same left node is tried against its new
+            // right sibling
+            if (index + 1 < count && left->IsIdle() &&
+                children[index + 1]->IsIdle() &&
+                FreezePair(parent, left, children[index + 1])) {
+                frozen++;
+            } else {
+                left->MarkSeen();
+                index++;
+            }
+        }
+        return frozen;
+    }
+
+    // pack right into left, which becomes or stays cold, if their entries
+    // fit in one cold leaf. returns whether right was packed away
+    auto FreezePair(Node<T, K, MinOrder>* parent, Node<T, K, MinOrder>* left,
+                    Node<T, K, MinOrder>* right) -> bool {
+        // latch left to right and bottom up, the same order splits use
+        left->Latch();
+        right->Latch();
+        parent->Latch();
+        auto index = parent->ChildIndex(left);
+        // the rightmost leaf is where appends go, so it is never packed
+        auto frozen = !parent->IsDeleted() && !left->IsDeleted() &&
+                      index >= 0 && index < parent->GetCount() &&
+                      parent->GetChildren()[index + 1] == right &&
+                      right->GetRight() != nullptr && left->CanFreeze(right);
+        auto left_cold = left->GetCold();
+        auto right_cold = right->GetCold();
+        if (frozen) {
+            left->Freeze(right);
+            parent->RemoveAt(index);
+        }
+        parent->Unlatch();
+        right->Unlatch();
+        left->Unlatch();
+        if (!frozen) return false;
+        // the pass's own latch does not count as a write
+        left->MarkSeen();
+        RetireCold(left_cold);
+        RetireCold(right_cold);
+        Retire(right);
+        return true;
+    }
+
+    // the current root. the acquire pairs with the exchange that published
+    // it, so the root is seen fully built
+    inline auto GetRoot() -> Node<T, K, MinOrder>* {
+        return root_.load(std::memory_order_acquire);
+    }
+
+    // retire every node of the tree under root, level by level, once it has
+    // been replaced by another tree
+    void RetireNodes(Node<T, K, MinOrder>* root) {
+        auto level = root;
+        while (level != nullptr) {
+            auto below = level->IsLeaf() ? nullptr : level->GetChildren()[0];
+            for (auto node = level; node != nullptr;) {
+                auto right = node->GetRight();
+                Retire(node);
+                node = right;
+            }
+            level = below;
+        }
+    }
+
+    // delete every node of the tree under root, level by level. no other
+    // thread may be able to reach them
+    void DeleteNodes(Node<T, K, MinOrder>* root) {
+        auto level = root;
+        while (level != nullptr) {
+            auto below = level->IsLeaf() ? nullptr : level->GetChildren()[0];
+            for (auto node = level; node != nullptr;) {
+                auto right = node->GetRight();
+                Node<T, K, MinOrder>::Delete(allocator_, node);
+                node = right;
+            }
+            level = below;
+        }
+    }
+
+    // hand a node that has been unlinked from the tree to the epoch manager,
+    // which gives it back to the allocator once no reader can still be
+    // crossing it
+    void Retire(Node<T, K, MinOrder>* node) {
+        // the append path must never find a node that may be freed
+        auto tail = node;
+        tail_.compare_exchange_strong(tail, nullptr, std::memory_order_acq_rel);
+        // nor may a copy of the upper levels. a descent that still finds the
+        // count unchanged after pinning was pinned before the node was retired
+        retirements_.fetch_add(1, std::memory_order_seq_cst);
+        epoch_.Retire(
+            node,
+            [](void* context, void* ptr) {
+                Node<T, K, MinOrder>::Delete(
+                    static_cast<Tree*>(context)->allocator_,
+                    static_cast<Node<T, K, MinOrder>*>(ptr));
+            },
+            this);
+    }
+
+    // free a boxed value that has been removed from its leaf once no reader
+    // can still be unboxing it. inline values need no freeing
+    void RetireValue(Slot slot) {
+        if constexpr (!ValueSlot<K>::kInline) {
+            epoch_.Retire(
+                slot,
+                [](void*, void* ptr) { delete static_cast<K*>(ptr); },
+                nullptr);
+        }
+    }
+
+    // free the packed entries of a cold leaf once no reader can still be
+    // reading them
+    void RetireCold(const typename Node<T, K, MinOrder>::Cold* cold) {
+        if (cold == nullptr) return;
+        epoch_.Retire(
+            const_cast<typename Node<T, K, MinOrder>::Cold*>(cold),
+            [](void*, void* ptr) {
+                Node<T, K, MinOrder>::Cold::Free(
+                    static_cast<typename Node<T, K, MinOrder>::Cold*>(ptr));
+            },
+            nullptr);
+    }
+
+    // the most nodes a copy of the upper levels holds unless told otherwise.
+    // enough for the levels above the lowest two of most trees
+    static constexpr std::size_t kReplicaNodes = 256;
+
+    // replica_level_ until a copy has been built
+    static constexpr int kNoReplica = std::numeric_limits<int>::max();
+
+    // a copy of the upper levels of the tree, laid out flat in the memory of
+    // one NUMA node. node i's keys are keys[begin[i]] up to keys[begin[i +
+    // 1]], and its children start at child first[i] of the next level down,
+    // whose nodes start at starts[level]. children of the lowest copied level
+    // are the real nodes in targets. immutable once published
+    struct Replica {
+        explicit Replica(int numa_node)
+            : keys{NumaAllocator<T>{numa_node}},
+              begin{NumaAllocator<int>{numa_node}},
+              first{NumaAllocator<int>{numa_node}},
+              starts{NumaAllocator<int>{numa_node}},
+              targets{NumaAllocator<Node<T, K, MinOrder>*>{numa_node}} {}
+
+        // the real node a descent for the key continues from
+        auto Find(const T& key) const -> Node<T, K, MinOrder>* {
+            auto child = 0;
+            for (std::size_t level = 0; level < starts.size(); level++) {
+                auto i = starts[level] + child;
+                child = first[i] + KeySearch<T>::LowerBound(
+                                       keys.data() + begin[i],
+                                       begin[i + 1] - begin[i], key);
+            }
+            return targets[child];
+        }
+
+        // retirements_ and reshapes_ before the copy was taken
+        uint64_t retirements = 0;
+        uint64_t reshapes = 0;
+        // the level of the targets
+        int level = 0;
+        std::vector<T, NumaAllocator<T>> keys;
+        std::vector<int, NumaAllocator<int>> begin;
+        std::vector<int, NumaAllocator<int>> first;
+        std::vector<int, NumaAllocator<int>> starts;
+        std::vector<Node<T, K, MinOrder>*,
+                    NumaAllocator<Node<T, K, MinOrder>*>>
+            targets;
+    };
+
+    // where a descent for the key starts: the node the copy of the upper
+    // levels on the calling thread's NUMA node leads to, or else the root.
+    // the caller is pinned
+    inline auto StartNode(const T& key) -> Node<T, K, MinOrder>* {
+        if (replica_nodes_.load(std::memory_order_relaxed) == 0)
+            return GetRoot();
+        auto numa_node = Numa::CurrentNode();
+        auto replica = replicas_[numa_node].load(std::memory_order_acquire);
+        if (replica == nullptr ||
+            replica->reshapes != reshapes_.load(std::memory_order_relaxed) ||
+            replica->retirements !=
+                retirements_.load(std::memory_order_seq_cst)) {
+            RefreshReplica(numa_node);
+            replica = replicas_[numa_node].load(std::memory_order_acquire);
+        }
+        if (replica == nullptr ||
+            replica->retirements !=
+                retirements_.load(std::memory_order_seq_cst))
+            return GetRoot();
+        return replica->Find(key);
+    }
+
+    // rebuild the copy of the upper levels on the NUMA node, unless another
+    // thread is rebuilding one already. the caller is pinned
+    void RefreshReplica(int numa_node) {
+        auto lk =
+            std::unique_lock<std::mutex>{replica_latch_, std::try_to_lock};
+        if (!lk.owns_lock()) return;
+        auto max_nodes = replica_nodes_.load(std::memory_order_relaxed);
+        if (max_nodes == 0 || GetRoot() == nullptr) return;
+        auto replica = BuildReplica(numa_node, max_nodes);
+        replica_level_.store(replica->level, std::memory_order_relaxed);
+        RetireReplica(replicas_[numa_node].exchange(
+            replica.release(), std::memory_order_acq_rel));
+    }
+
+    // copy the levels of the tree from the root down, for as long as every
+    // level copied adds up to at most max_nodes nodes. a tree too small to
+    // copy any level gets a copy that leads straight to the root. each node
+    // is read optimistically on its own, so levels read later may have split
+    // since their parents were, which the targets' right links make up for.
+    // the caller is pinned, and holds replica_latch_
+    auto BuildReplica(int numa_node, std::size_t max_nodes)
+        -> std::unique_ptr<Replica> {
+        auto replica = std::make_unique<Replica>(numa_node);
+        // read before any node is, so that a node retired from here on makes
+        // the copy stale
+        replica->retirements = retirements_.load(std::memory_order_seq_cst);
+        replica->reshapes = reshapes_.load(std::memory_order_relaxed);
+        auto level = std::vector<Node<T, K, MinOrder>*>{GetRoot()};
+        auto below = std::vector<Node<T, K, MinOrder>*>{};
+        auto keys = std::vector<T>{};
+        auto copied = std::size_t{0};
+        replica->begin.push_back(0);
+        while (!level.front()->IsLeaf() && copied + level.size() <= max_nodes) {
+            replica->starts.push_back(static_cast<int>(copied));
+            below.clear();
+            for (auto node : level) {
+                auto children = std::span<Node<T, K, MinOrder>* const>{};
+                while (true) {
+                    auto version = node->ReadVersion();
+                    children = node->GetChildren();
+                    keys.clear();
+                    for (std::size_t i = 0; i + 1 < children.size(); i++)
+                        keys.push_back(node->GetKey(static_cast<int>(i)));
+                    if (node->Validate(version)) break;
+                }
+                replica->first.push_back(static_cast<int>(below.size()));
+                replica->keys.insert(replica->keys.end(), keys.begin(),
+                                     keys.end());
+                replica->begin.push_back(
+                    static_cast<int>(replica->keys.size()));
+                below.insert(below.end(), children.begin(), children.end());
+            }
+            copied += level.size();
+            std::swap(level, below);
+        }
+        replica->targets.assign(level.begin(), level.end());
+        replica->level = level.front()->GetLevel();
+        return replica;
+    }
+
+    // free a copy of the upper levels once no descent can still be in it
+    void RetireReplica(Replica* replica) {
+        if (replica == nullptr) return;
+        epoch_.Retire(
+            replica,
+            [](void*, void* ptr) { delete static_cast<Replica*>(ptr); },
+            nullptr);
+    }
+
+    Allocator allocator_;
+    // shared with every other tree. the destructor frees whatever nodes of
+    // this one are still retired while allocator_ is still around
+    EpochManager& epoch_;
+    // only ever changes from null to the first root, and from a root to the
+    // new root above it when it splits
+    std::atomic<Node<T, K, MinOrder>*> root_;
+    // the rightmost leaf, which inserts of keys larger than any in it latch
+    // directly. null until there is one, and whenever compaction has just
+    // merged it away
+    std::atomic<Node<T, K, MinOrder>*> tail_;
+    // where inserts and erases are logged, if anywhere. set by Recover
+    WriteAheadLog* log_;
+    // only one compaction pass runs at a time
+    std::mutex compact_latch_;
+    std::jthread compactor_;
+    // per-thread hot-path counters, empty unless MEMORYTREE_STATS is defined
+    StatsRecorder stats_;
+    // the copy of the upper levels on each NUMA node, null until built
+    std::unique_ptr<std::atomic<Replica*>[]> replicas_;
+    // the most nodes in a copy, or 0 while copies are off
+    std::atomic<std::size_t> replica_nodes_;
+    // the level the latest copy leads to. splits on it or above make copies
+    // stale
+    std::atomic<int> replica_level_;
+    // bumped before any node is retired, and by splits that make copies
+    // stale. read by every descent while copies are on
+    alignas(kCacheLineSize) std::atomic<uint64_t> retirements_;
+    std::atomic<uint64_t> reshapes_;
+    // only one copy is built at a time
+    std::mutex replica_latch_;
+};
+
+/**
+ * Spreads the key space over several independent trees, so that writers
+ * hitting one part of it, such as the rightmost leaf under monotonically
+ * increasing keys, do not all latch the same nodes.
+ * - Hash partitioning sends each key to shard Hash(key) % shard count. Keys
+ *   that follow each other land on different shards, which spreads even a
+ *   single hot key range, but a scan has to visit every shard
+ * - Range partitioning gives every shard a contiguous range of keys, so a
+ *   scan only visits the shards it overlaps. The boundaries can be moved
+ *   online with SplitShard and MergeShards
+ * - Every shard's tree sits on cache lines of its own
+ * - Scans merge the shards as they stream, and never collect their results
+ */
+template <typename T, typename K, int MinOrder = 2,
+          typename Hash = std::hash<T>>
+class ShardedTree {
+    struct Layout;
+
+   public:
+    /**
+     * Input iterator over the entries of a range scan across every shard, in
+     * key order. Holds a scan iterator into each shard it is reading: under
+     * hash partitioning all of them at once, merged through a heap on their
+     * current keys, and under range partitioning one shard after another.
+     * Entries present for the whole scan are returned exactly once, even if
+     * the shards are rebalanced meanwhile.
+     */
+    class ScanIterator {
+        using Cursor = typename Tree<T, K, MinOrder>::ScanIterator;
+
+       public:
+        using iterator_category = std::input_iterator_tag;
+        using value_type = std::pair<T, K>;
+        using difference_type = std::ptrdiff_t;
+        using reference = std::pair<const T&, const K&>;
+
+        explicit ScanIterator() : layout_{nullptr}, next_{0} {}
+
+        explicit ScanIterator(EpochManager::Guard guard, const Layout* layout,
+                              const T& lo, const T& hi)
+            : guard_{guard}, layout_{layout}, lo_{lo}, hi_{hi}, next_{0} {
+            if (layout_->hashed) {
+                for (const auto& shard : layout_->shards) {
+                    auto cursor = shard->tree.Scan(lo_, hi_).begin();
+                    if (cursor == std::default_sentinel) continue;
+                    cursors_.push_back(cursor);
+                    heap_.push_back(cursors_.size() - 1);
+                }
+                std::make_heap(heap_.begin(), heap_.end(), Later{this});
+            } else {
+                next_ = layout_->ShardOf(lo_);
+                OpenNext();
+            }
+        }
+
+        auto operator*() const -> reference {
+            return *cursors_[heap_.front()];
+        }
+
+        auto operator++() -> ScanIterator& {
+            if (!layout_->hashed) {
+                if (++cursors_.front() == std::default_sentinel) OpenNext();
+                return *this;
+            }
+            std::pop_heap(heap_.begin(), heap_.end(), Later{this});
+            if (++cursors_[heap_.back()] == std::default_sentinel) {
+                heap_.pop_back();
+            } else {
+                std::push_heap(heap_.begin(), heap_.end(), Later{this});
+            }
+            return *this;
+        }
+
+        void operator++(int) { ++*this; }
+
+        friend auto operator==(const ScanIterator& it, std::default_sentinel_t)
+            -> bool {
+            return it.heap_.empty();
+        }
+
+       private:
+        // orders cursor indices so that the heap yields the smallest key
+        struct Later {
+            auto operator()(std::size_t a, std::size_t b) const -> bool {
+                return (*it->cursors_[b]).first < (*it->cursors_[a]).first;
+            }
+            const ScanIterator* it;
+        };
+
+        // move on to the next shard under range partitioning that still
+        // holds keys up to hi_, or leave the heap empty if there is none
+        void OpenNext() {
+            cursors_.clear();
+            heap_.clear();
+            for (; next_ < layout_->shards.size(); next_++) {
+                if (next_ > 0 && hi_ < layout_->lower[next_ - 1]) break;
+                auto& tree = layout_->shards[next_]->tree;
+                auto cursor = tree.Scan(lo_, hi_).begin();
+                if (cursor == std::default_sentinel) continue;
+                cursors_.push_back(cursor);
+                heap_.push_back(0);
+                next_++;
+                return;
+            }
+        }
+
+        // keeps layout_, and with it every shard's tree, alive
+        std::optional<EpochManager::Guard> guard_;
+        const Layout* layout_;
+        T lo_;
+        T hi_;
+        std::vector<Cursor> cursors_;
+        // indices of the cursors that have not reached their end
+        std::vector<std::size_t> heap_;
+        // under range partitioning, the next shard to read
+        std::size_t next_;
+    };
+
+    class ScanRange {
+       public:
+        explicit ScanRange(ScanIterator begin) : begin_{begin} {}
+        auto begin() const -> ScanIterator { return begin_; }
+        auto end() const -> std::default_sentinel_t { return {}; }
+
+       private:
+        ScanIterator begin_;
+    };
+
+    /**
+     * Hash partition the key space over shard_count shards
+     */
+    explicit ShardedTree(std::size_t shard_count)
+        : layout_{new Layout{true, {}, {}, {}}} {
+        auto layout = layout_.load(std::memory_order_relaxed);
+        for (std::size_t i = 0; i < std::max<std::size_t>(shard_count, 1);
+             i++) {
+            layout->shards.push_back(std::make_shared<Shard>());
+            layout->frozen.push_back(false);
+        }
+    }
+
+    /**
+     * Range partition the key space into one more shard than there are
+     * boundaries. Boundaries must be sorted and distinct, and shard i + 1
+     * starts at boundary i
+     */
+    explicit ShardedTree(std::vector<T> boundaries)
+        : layout_{new Layout{false, std::move(boundaries), {}, {}}} {
+        auto layout = layout_.load(std::memory_order_relaxed);
+        for (std::size_t i = 0; i <= layout->lower.size(); i++) {
+            layout->shards.push_back(std::make_shared<Shard>());
+            layout->frozen.push_back(false);
+        }
+    }
+
+    ShardedTree(const ShardedTree&) = delete;
+    auto operator=(const ShardedTree&) -> ShardedTree& = delete;
+
+    /**
+     * Destroy every shard. No other thread may be using the tree
+     */
+    ~ShardedTree() { delete layout_.load(std::memory_order_relaxed); }
+
+    inline auto GetShardCount() -> std::size_t {
+        auto guard = epoch_.Pin();
+        return layout_.load(std::memory_order_seq_cst)->shards.size();
+    }
+
+    auto Search(const T& key) -> std::optional<K> {
+        auto guard = epoch_.Pin();
+        auto layout = layout_.load(std::memory_order_seq_cst);
+        return layout->shards[layout->ShardOf(key)]->tree.Search(key);
+    }
+
+    /**
+     * Return the entries with keys in [lo, hi] from every shard, in key
+     * order. Rebalancing waits for the scan to be destroyed, so a scan must
+     * not be kept open by a thread that also splits or merges shards
+     */
+    auto Scan(const T& lo, const T& hi) -> ScanRange {
+        auto guard = epoch_.Pin();
+        auto layout = layout_.load(std::memory_order_seq_cst);
+        return ScanRange{ScanIterator{guard, layout, lo, hi}};
+    }
+
+    /**
+     * Call fn(key, val) for every entry with a key in [lo, hi], in key order
+     */
+    template <typename F>
+    void Scan(const T& lo, const T& hi, F&& fn) {
+        for (auto [key, val] : Scan(lo, hi)) fn(key, val);
+    }
+
+    auto Insert(const T& key, const K& val) -> bool {
+        return Write(key, [&](Tree<T, K, MinOrder>& tree) {
+            return tree.Insert(key, val);
+        });
+    }
+
+    auto Upsert(const T& key, const K& val) -> UpsertResult {
+        return Write(key, [&](Tree<T, K, MinOrder>& tree) {
+            return tree.Upsert(key, val);
+        });
+    }
+
+    auto CompareExchange(const T& key, const K& expected, const K& desired)
+        -> bool {
+        return Write(key, [&](Tree<T, K, MinOrder>& tree) {
+            return tree.CompareExchange(key, expected, desired);
+        });
+    }
+
+    template <typename F>
+    auto Update(const T& key, F&& fn) -> bool {
+        return Write(key, [&](Tree<T, K, MinOrder>& tree) {
+            return tree.Update(key, fn);
+        });
+    }
+
+    auto Erase(const T& key) -> bool {
+        return Write(key, [&](Tree<T, K, MinOrder>& tree) {
+            return tree.Erase(key);
+        });
+    }
+
+    /**
+     * Under range partitioning, split the shard holding key in two, the new
+     * one on the right starting at key. Writes to the shard wait while its
+     * entries are moved, and everything else keeps running. Returns false
+     * under hash partitioning, or if a shard already starts at key
+     */
+    auto SplitShard(const T& key) -> bool {
+        std::lock_guard<std::mutex> lk{rebalance_latch_};
+        auto current = layout_.load(std::memory_order_relaxed);
+        if (current->hashed) return false;
+        auto index = current->ShardOf(key);
+        if (index > 0 && !(current->lower[index - 1] < key)) return false;
+        auto frozen = Freeze(current, index, index);
+        auto left = std::vector<std::pair<T, K>>{};
+        auto right = std::vector<std::pair<T, K>>{};
+        frozen->shards[index]->tree.ForEach([&](const T& k, const K& v) {
+            (k < key ? left : right).emplace_back(k, v);
+        });
+        auto next = std::make_unique<Layout>(*frozen);
+        next->shards[index] = Build(left);
+        next->shards.insert(next->shards.begin() + index + 1, Build(right));
+        next->lower.insert(next->lower.begin() + index, key);
+        next->frozen.assign(next->shards.size(), false);
+        Publish(std::move(next));
+        return true;
+    }
+
+    /**
+     * Under range partitioning, merge shard index with the shard to its
+     * right, the same way SplitShard splits one. Returns false under hash
+     * partitioning, or if there is no shard to its right
+     */
+    auto MergeShards(std::size_t index) -> bool {
+        std::lock_guard<std::mutex> lk{rebalance_latch_};
+        auto current = layout_.load(std::memory_order_relaxed);
+        if (current->hashed || index + 1 >= current->shards.size())
+            return false;
+        auto frozen = Freeze(current, index, index + 1);
+        auto entries = std::vector<std::pair<T, K>>{};
+        for (auto i : {index, index + 1}) {
+            frozen->shards[i]->tree.ForEach(
+                [&](const T& k, const K& v) { entries.emplace_back(k, v); });
+        }
+        auto next = std::make_unique<Layout>(*frozen);
+        next->shards[index] = Build(entries);
+        next->shards.erase(next->shards.begin() + index + 1);
+        next->lower.erase(next->lower.begin() + index);
+        next->frozen.assign(next->shards.size(), false);
+        Publish(std::move(next));
+        return true;
+    }
+
+   private:
+    struct alignas(kCacheLineSize) Shard {
+        Tree<T, K, MinOrder> tree;
+    };
+
+    // which shard holds which keys. a layout is never changed once it is
+    // published; rebalancing publishes a new one. shards are shared between
+    // layouts, and freed along with the last layout holding them
+    struct Layout {
+        auto ShardOf(const T& key) const -> std::size_t {
+            if (hashed) return Hash{}(key) % shards.size();
+            return std::upper_bound(lower.begin(), lower.end(), key) -
+                   lower.begin();
+        }
+
+        bool hashed;
+        // under range partitioning, the first key of every shard but the
+        // first
+        std::vector<T> lower;
+        std::vector<std::shared_ptr<Shard>> shards;
+        // shards being split or merged, which writers wait for
+        std::vector<char> frozen;
+    };
+
+    // apply op to the tree of the shard holding key, once it is not frozen.
+    // the layout is loaded while pinned, so a rebalance that freezes the
+    // shard afterwards waits for op to finish
+    template <typename F>
+    auto Write(const T& key, F&& op) -> decltype(auto) {
+        while (true) {
+            {
+                auto guard = epoch_.Pin();
+                auto layout = layout_.load(std::memory_order_seq_cst);
+                auto index = layout->ShardOf(key);
+                if (!layout->frozen[index])
+                    return op(layout->shards[index]->tree);
+            }
+            // the shard is being split or merged. wait for the layout that
+            // replaces it, unpinned so that the rebalance can finish
+            std::this_thread::yield();
+        }
+    }
+
+    // publish a copy of current with shards first to last frozen, and
+    // return it once no writer can still be in them
+    auto Freeze(const Layout* current, std::size_t first, std::size_t last)
+        -> const Layout* {
+        auto frozen = std::make_unique<Layout>(*current);
+        for (auto i = first; i <= last; i++) frozen->frozen[i] = true;
+        auto published = frozen.get();
+        Publish(std::move(frozen));
+        return published;
+    }
+
+    // replace the layout, and free the old one once no thread can still be
+    // reading it. the caller holds rebalance_latch_
+    void Publish(std::unique_ptr<Layout> layout) {
+        auto old =
+            layout_.exchange(layout.release(), std::memory_order_seq_cst);
+        epoch_.Synchronize();
+        delete old;
+    }
+
+    static auto Build(const std::vector<std::pair<T, K>>& entries)
+        -> std::shared_ptr<Shard> {
+        auto shard = std::make_shared<Shard>();
+        shard->tree.BulkLoad(entries.begin(), entries.end());
+        return shard;
+    }
+
+    // pins protect layouts, and the shards only they hold, from being freed.
+    // a manager of its own, so that rebalancing waits only for this tree's
+    // readers and not for those of every tree sharing EpochManager::Shared()
+    EpochManager epoch_;
+    std::atomic<Layout*> layout_;
+    // only one split or merge at a time
+    std::mutex rebalance_latch_;
+};
+
+/**
+ * A B-link tree kept in a file rather than in memory. Every node is one
+ * fixed-size page of the file, nodes refer to each other by page id, and pages
+ * are only cached in a BufferPool, so the tree can grow far past the memory
+ * given to the pool.
+ * - Keys and values must be trivially copyable, since pages are written to
+ *   the file byte for byte. Page 0 holds the id of the root
+ * - Readers latch one pinned page at a time in shared mode, and recover from
+ *   concurrent splits by following right links. Writers latch pages
+ *   exclusively, a child before its parent, like Tree
+ * - Pages are only written when the pool evicts them or on Flush(), so a
+ *   crash can leave the file inconsistent
+ * - The pool needs a few frames for every thread using the tree at once
+ *
+ * With Buffered set, the tree is a B-epsilon tree instead: every internal
+ * node owns a page of pending writes, and writes are queued at the root
+ * rather than applied to a leaf. When a buffer fills, the messages bound for
+ * the child most of them are bound for are moved down to it in one batch, so
+ * a leaf is written once per batch rather than once per write.
+ * - Insert overwrites the value of a key that is already there, and Insert
+ *   and Erase return as soon as the write is queued
+ * - Lookups check the buffer of every internal node they pass. The nearer a
+ *   message is to the root, the newer it is
+ * - Writers run one at a time and latch pages from the root down. The win is
+ *   in the pages written, not in writers running in parallel
+ * - Scan copies out the messages within its bounds, holding up writers
+ *   while it does, and lays them over the entries of each leaf it reads
+ * - Whether a tree is buffered is recorded in its file, and a file opened
+ *   the other way is refused
+ */
+template <typename T, typename K, std::size_t PageSize = 4096,
+          bool Buffered = false>
+class PagedTree {
+    static_assert(std::is_trivially_copyable_v<T> &&
+                      std::is_trivially_copyable_v<K>,
+                  "paged keys and values are stored byte for byte");
+    static_assert(PageSize % 4096 == 0 && PageSize <= 16384,
+                  "pages are 4, 8, 12 or 16 KiB");
+
+    // a write queued in the buffer of an internal node
+    struct Message {
+        T key;
+        K value;
+        uint32_t erase;
+    };
+
+   public:
+    // the most keys a page holds. a page briefly holds one more while it
+    // is being split
+    static constexpr int kCapacity = static_cast<int>(
+        (PageSize - 64 - sizeof(T)) /
+            (sizeof(T) + std::max(sizeof(K), sizeof(PageId))) -
+        2);
+
+    // the most messages the buffer of an internal node holds in buffered
+    // mode
+    static constexpr std::size_t kBufferCapacity =
+        (PageSize - sizeof(uint64_t)) / sizeof(Message);
+
+    /**
+     * Open the tree stored in the file at path, creating it if the file is
+     * empty, with a pool of the given number of frames. Returns null if the
+     * file cannot be opened or holds something else.
+     */
+    static auto Open(const std::string& path, std::size_t frames)
+        -> std::unique_ptr<PagedTree> {
+        auto tree = std::unique_ptr<PagedTree>{new PagedTree{path, frames}};
+        if (!tree->pool_.IsOpen()) return nullptr;
+        auto& pool = tree->pool_;
+        if (pool.GetPageCount() == 0) {
+            auto meta = pool.New();
+            auto root = pool.New();
+            auto node = Cast(root);
+            node->leaf = 1;
+            node->right = kInvalidPage;
+            tree->SetRoot(root.GetId());
+            return tree;
+        }
+        auto meta = pool.Fetch(kMetaPage);
+        if (!meta.IsValid()) return nullptr;
+        auto header = Meta{};
+        std::memcpy(&header, meta.GetData(), sizeof(header));
+        if (header.magic != kMagic || header.page_size != PageSize ||
+            header.buffered != Buffered)
+            return nullptr;
+        tree->root_.store(header.root, std::memory_order_release);
+        return tree;
+    }
+
+    PagedTree(const PagedTree&) = delete;
+    auto operator=(const PagedTree&) -> PagedTree& = delete;
+
+    /**
+     * Take the pool's frames out of every I/O ring SearchBatch registered
+     * them with, before the pool frees them. No other thread may be using
+     * the tree
+     */
+    ~PagedTree() { IoRing::Unregister(pool_.GetPoolId()); }
+
+    /**
+     * Look up the value stored under the key
+     */
+    auto Search(const T& key) -> std::optional<K> {
+        if constexpr (Buffered) return SearchBuffered(key);
+        auto page = DescendShared(key);
+        if (!page.IsValid()) return std::nullopt;
+        auto node = Cast(page);
+        auto index = FindIndex(node, key);
+        auto found = index < node->count && node->keys[index] == key
+                         ? std::optional<K>{node->values[index]}
+                         : std::nullopt;
+        page.UnlatchShared();
+        return found;
+    }
+
+    /**
+     * Call fn(key, val) for every entry with a key in [lo, hi], in key order.
+     * The entries of each leaf are copied out before fn is called on them, so
+     * fn runs without any latch held. Every entry present for the whole scan
+     * is passed to fn exactly once.
+     *
+     * In buffered mode the messages within [lo, hi] are first copied out of
+     * every internal node whose bounds overlap the range, with writers held
+     * up until they are. Nothing is written, and writers run again while the
+     * leaves are read. The copies take memory in proportion to the messages
+     * within the range, at most every buffer's worth for a scan of the whole
+     * tree
+     */
+    template <typename F>
+    void Scan(const T& lo, const T& hi, F&& fn) {
+        auto pending = std::vector<Message>{};
+        auto next = std::size_t{0};
+        if constexpr (Buffered) {
+            std::lock_guard<std::mutex> lk{write_latch_};
+            if (!CollectMessages(lo, hi, pending)) return;
+        }
+        auto entries = std::vector<std::pair<T, K>>{};
+        entries.reserve(kCapacity);
+        auto lower = lo;
+        auto exclusive = false;
+        auto page = DescendShared(lower);
+        while (page.IsValid()) {
+            auto node = Cast(page);
+            // lower has moved right of this leaf since its left sibling was
+            // read
+            if (!Covers(node, lower)) {
+                if (!Step(page, node->right)) return;
+                continue;
+            }
+            auto index = FindIndex(node, lower);
+            if (exclusive && index < node->count && node->keys[index] == lower)
+                index++;
+            auto past_upper = false;
+            for (; index < node->count; index++) {
+                if (hi < node->keys[index]) {
+                    past_upper = true;
+                    break;
+                }
+                entries.emplace_back(node->keys[index], node->values[index]);
+            }
+            auto right = node->right;
+            auto done = past_upper || right == kInvalidPage ||
+                        !node->has_high_key || !(node->high_key < hi);
+            lower = node->high_key;
+            exclusive = true;
+            page.UnlatchShared();
+            if constexpr (Buffered) {
+                // the messages for the keys this leaf covers take the place
+                // of its entries for them. leaves are read in key order, so
+                // those are the next ones up to its high key
+                auto end = next;
+                while (end < pending.size() &&
+                       (done || !(lower < pending[end].key)))
+                    end++;
+                entries = ApplyMessages(
+                    entries, std::span<const Message>{pending.data() + next,
+                                                      end - next});
+                next = end;
+            }
+            for (const auto& [key, val] : entries) fn(key, val);
+            entries.clear();
+            if (done) return;
+            page = pool_.Fetch(right);
+            if (page.IsValid()) page.LatchShared();
+        }
+    }
+
+    /**
+     * Insert the key and its value, and return false if the key is already
+     * there or a page could not be read. In buffered mode the key's value is
+     * replaced if it is there
+     */
+    auto Insert(const T& key, const K& val) -> bool {
+        if constexpr (Buffered) return Enqueue(Message{key, val, 0});
+        auto ancestors = Ancestors{};
+        auto page = Descend(key, ancestors);
+        if (!page.IsValid()) return false;
+        auto node = Cast(page);
+        auto index = FindIndex(node, key);
+        if (index < node->count && node->keys[index] == key) {
+            page.Unlatch();
+            return false;
+        }
+        std::move_backward(node->keys + index, node->keys + node->count,
+                           node->keys + node->count + 1);
+        std::move_backward(node->values + index, node->values + node->count,
+                           node->values + node->count + 1);
+        node->keys[index] = key;
+        node->values[index] = val;
+        node->count++;
+        page.MarkDirty();
+        while (node->count > kCapacity) {
+            // page is ALWAYS latched and overflowing at this point
+            auto right = pool_.New();
+            auto separator = Split(node, Cast(right), right.GetId());
+            page.MarkDirty();
+            if (page.GetId() == root_.load(std::memory_order_relaxed)) {
+                // only the thread holding the old root's latch can replace it
+                auto root = pool_.New();
+                auto top = Cast(root);
+                top->level = node->level + 1;
+                top->count = 1;
+                top->right = kInvalidPage;
+                top->keys[0] = separator;
+                top->children[0] = page.GetId();
+                top->children[1] = right.GetId();
+                SetRoot(root.GetId());
+                break;
+            }
+            // the parent is latched before the child is unlatched. if it
+            // cannot be read, the new sibling stays reachable through its
+            // right link, which is all a B-link tree needs to stay correct
+            auto parent = FindParent(node->level + 1, ancestors, separator);
+            page.Unlatch();
+            if (!parent.IsValid()) return true;
+            page = std::move(parent);
+            node = Cast(page);
+            index = FindIndex(node, separator);
+            std::move_backward(node->keys + index, node->keys + node->count,
+                               node->keys + node->count + 1);
+            std::move_backward(node->children + index + 1,
+                               node->children + node->count + 1,
+                               node->children + node->count + 2);
+            node->keys[index] = separator;
+            node->children[index + 1] = right.GetId();
+            node->count++;
+            page.MarkDirty();
+        }
+        page.Unlatch();
+        return true;
+    }
+
+    /**
+     * Remove the key and its value, and return false if the key is not there
+     * or a page could not be read. In buffered mode only the latter returns
+     * false. Leaves are never merged, and may be left empty
+     */
+    auto Erase(const T& key) -> bool {
+        if constexpr (Buffered) return Enqueue(Message{key, K{}, 1});
+        auto ancestors = Ancestors{};
+        auto page = Descend(key, ancestors);
+        if (!page.IsValid()) return false;
+        auto node = Cast(page);
+        auto index = FindIndex(node, key);
+        auto found = index < node->count && node->keys[index] == key;
+        if (found) {
+            std::move(node->keys + index + 1, node->keys + node->count,
+                      node->keys + index);
+            std::move(node->values + index + 1, node->values + node->count,
+                      node->values + index);
+            node->count--;
+            page.MarkDirty();
+        }
+        page.Unlatch();
+        return found;
+    }
+
+    /**
+     * Look up every key, with the page reads of many lookups in flight at
+     * once through the ring. Each lookup is a coroutine that suspends when
+     * its descent misses the pool instead of blocking the thread, so up to
+     * the ring's depth of reads stay queued at the drive while the lookups
+     * whose pages are cached carry on. At most half of the pool's frames are
+     * pinned by the batch at once. The pool's frames are registered with the
+     * ring the first time, so reads land in them without a copy. Falls back
+     * to Search if the ring could not be set up, and in buffered mode.
+     */
+    auto SearchBatch(std::span<const T> keys, IoRing& ring)
+        -> std::vector<std::optional<K>> {
+        auto results = std::vector<std::optional<K>>(keys.size());
+        if (!ring.IsOpen() || Buffered) {
+            for (std::size_t i = 0; i < keys.size(); i++)
+                results[i] = Search(keys[i]);
+            return results;
+        }
+        auto id = pool_.GetPoolId();
+        auto registered = ring.IsRegistered(id);
+        if (!registered && !ring.IsRefused(id))
+            registered = ring.RegisterBuffers(id, pool_.GetFrameBuffers());
+        auto batch = Batch{pool_, ring, registered};
+        // every running lookup pins a page. leave at least half of the
+        // frames to other threads, which may hold a latch a lookup waits on
+        // while they wait for a frame themselves. running no more lookups
+        // than the queue has slots means a lookup never finds it full
+        auto depth = std::max<std::size_t>(
+            1, std::min<std::size_t>(ring.GetDepth(),
+                                     pool_.GetFrameCount() / 2));
+        auto next = std::size_t{0};
+        auto running = std::size_t{0};
+        while (next < keys.size() || running > 0) {
+            while (running < depth && next < keys.size()) {
+                auto lookup = SearchAsync(keys[next], batch);
+                lookup.handle.promise().index = next++;
+                batch.ready.push_back(lookup.handle);
+                running++;
+            }
+            if (batch.ready.empty()) batch.Wait();
+            while (!batch.ready.empty()) {
+                auto handle = Lookup::Handle::from_address(
+                    batch.ready.back().address());
+                batch.ready.pop_back();
+                handle.resume();
+                if (!handle.done()) continue;
+                auto& promise = handle.promise();
+                results[promise.index] = std::move(promise.result);
+                handle.destroy();
+                running--;
+            }
+        }
+        return results;
+    }
+
+    /**
+     * Write every changed page back to the file and sync it
+     */
+    inline auto Flush() -> bool { return pool_.Flush(); }
+
+   private:
+    // a lookup in a batch, run as a coroutine. it starts suspended, and
+    // whoever resumes it destroys it once it is done
+    struct Lookup {
+        struct promise_type;
+        using Handle = std::coroutine_handle<promise_type>;
+
+        struct promise_type {
+            auto get_return_object() -> Lookup {
+                return Lookup{Handle::from_promise(*this)};
+            }
+            auto initial_suspend() -> std::suspend_always { return {}; }
+            auto final_suspend() noexcept -> std::suspend_always { return {}; }
+            void return_value(std::optional<K> found) {
+                result = std::move(found);
+            }
+            void unhandled_exception() { std::abort(); }
+
+            std::size_t index = 0;
+            std::optional<K> result;
+        };
+
+        Handle handle;
+    };
+
+    struct Batch;
+
+    // co_await on it to get a page pinned. completes right away if the page
+    // is cached, and otherwise suspends the lookup until the page is read in
+    // by the ring or by whichever thread got to it first
+    struct FetchAwaiter {
+        // pin the page, and start reading it if it is not cached. returns
+        // whether the lookup can go on right away
+        auto Start() -> bool {
+            std::tie(page, state) = batch->pool.Pin(id);
+            if (state != BufferPool::PinState::kMustRead) return IsDone();
+            auto& pool = batch->pool;
+            auto index = batch->fixed ? static_cast<int>(page.GetFrameIndex())
+                                      : -1;
+            if (batch->ring.PrepareRead(pool.GetFd(), page.GetData(),
+                                        pool.GetPageSize(), pool.GetOffset(id),
+                                        index,
+                                        reinterpret_cast<uint64_t>(this))) {
+                batch->in_flight++;
+                return false;
+            }
+            // no room in the ring after all. read it the blocking way
+            pool.FinishLoad(page, ::pread(pool.GetFd(), page.GetData(),
+                                          pool.GetPageSize(),
+                                          pool.GetOffset(id)));
+            state = BufferPool::PinState::kReady;
+            return true;
+        }
+
+        // whether a page that was being read in by another thread is in
+        inline auto IsDone() const -> bool {
+            return state == BufferPool::PinState::kReady ||
+                   (state == BufferPool::PinState::kLoading &&
+                    !page.IsLoading());
+        }
+
+        // the ring has read the page
+        void Complete(int read) {
+            batch->pool.FinishLoad(page, read);
+            state = BufferPool::PinState::kReady;
+            batch->ready.push_back(handle);
+        }
+
+        auto await_ready() -> bool { return Start(); }
+
+        void await_suspend(std::coroutine_handle<> suspended) {
+            handle = suspended;
+            if (state != BufferPool::PinState::kMustRead)
+                batch->waiting.push_back(this);
+        }
+
+        auto await_resume() -> BufferPool::PageGuard {
+            // a page another thread failed to read is dropped from its frame
+            if (page.IsValid() && page.GetId() != id)
+                return BufferPool::PageGuard{};
+            return std::move(page);
+        }
+
+        Batch* batch;
+        PageId id;
+        BufferPool::PageGuard page{};
+        BufferPool::PinState state = BufferPool::PinState::kFull;
+        std::coroutine_handle<> handle{};
+    };
+
+    // the lookups of one SearchBatch call, and the pages they wait for
+    struct Batch {
+        inline auto Fetch(PageId id) -> FetchAwaiter {
+            return FetchAwaiter{this, id};
+        }
+
+        // submit the queued reads and collect completions. if no lookup can
+        // go on, block for one of the reads in flight, since a lookup
+        // waiting on a page is often waiting on one of them. lookups that
+        // wait only for another thread, or for a free frame, are polled
+        void Wait() {
+            ring.Submit(0);
+            Collect();
+            if (!ready.empty()) return;
+            if (in_flight == 0) {
+                std::this_thread::yield();
+                return;
+            }
+            ring.Submit(1);
+            Collect();
+        }
+
+        // resume the lookups whose read completed, and those waiting for a
+        // page that is now in or for a frame that is now free
+        void Collect() {
+            ring.Reap([&](uint64_t data, int read) {
+                reinterpret_cast<FetchAwaiter*>(data)->Complete(read);
+                in_flight--;
+            });
+            auto kept = std::size_t{0};
+            for (auto awaiter : waiting) {
+                auto full = awaiter->state == BufferPool::PinState::kFull;
+                if (full ? awaiter->Start() : awaiter->IsDone())
+                    ready.push_back(awaiter->handle);
+                else if (awaiter->state != BufferPool::PinState::kMustRead)
+                    waiting[kept++] = awaiter;
+            }
+            waiting.resize(kept);
+        }
+
+        BufferPool& pool;
+        IoRing& ring;
+        // whether the pool's frames are registered with the ring
+        bool fixed;
+        std::vector<std::coroutine_handle<>> ready{};
+        std::vector<FetchAwaiter*> waiting{};
+        unsigned in_flight = 0;
+    };
+
+    // Search, suspending on every page that is not cached
+    auto SearchAsync(T key, Batch& batch) -> Lookup {
+        auto page = co_await batch.Fetch(GetRoot());
+        while (page.IsValid()) {
+            page.LatchShared();
+            auto node = Cast(page);
+            if (node->leaf && Covers(node, key)) {
+                auto index = FindIndex(node, key);
+                auto found = index < node->count && node->keys[index] == key
+                                 ? std::optional<K>{node->values[index]}
+                                 : std::nullopt;
+                page.UnlatchShared();
+                co_return found;
+            }
+            auto next = node->leaf ? node->right : Next(node, key);
+            page.UnlatchShared();
+            // nothing is latched across a suspension, and only the page
+            // being waited for is pinned
+            page = BufferPool::PageGuard{};
+            page = co_await batch.Fetch(next);
+        }
+        co_return std::nullopt;
+    }
+
+    // a node as laid out in its page
+    struct Page {
+        uint32_t leaf;
+        int32_t level;
+        int32_t count;
+        uint32_t has_high_key;
+        PageId right;
+        T high_key;
+        T keys[kCapacity + 1];
+        union {
+            K values[kCapacity + 1];
+            PageId children[kCapacity + 2];
+        };
+        // the page holding the buffer of an internal node in buffered mode,
+        // or 0 while it has none, since page 0 is the meta page
+        PageId buffer;
+    };
+
+    // the layout of the page holding a buffer. messages are sorted by key,
+    // with at most one for each key
+    struct BufferPage {
+        int32_t count;
+        Message messages[kBufferCapacity];
+    };
+
+    static_assert(sizeof(Page) <= PageSize);
+    static_assert(sizeof(BufferPage) <= PageSize);
+    static_assert(kCapacity >= 3, "pages must hold at least three keys");
+
+    // the layout of page 0
+    struct Meta {
+        uint64_t magic;
+        uint64_t page_size;
+        PageId root;
+        // files written before buffered mode read as zero here
+        uint64_t buffered;
+    };
+
+    static constexpr PageId kMetaPage = 0;
+    static constexpr uint64_t kMagic = 0x31656572746d656d;  // "memtree1"
+    static constexpr int kMaxHeight = 32;
+
+    // the rightmost page a descent visited on each level above the leaves,
+    // indexed by level, like Tree::Ancestors
+    struct Ancestors {
+        inline void Set(int level, PageId id) {
+            if (level < kMaxHeight) ids[level] = id;
+        }
+
+        inline auto Get(int level) const -> PageId {
+            return level <= top && level < kMaxHeight ? ids[level]
+                                                      : kInvalidPage;
+        }
+
+        int top = 0;
+        PageId ids[kMaxHeight];
+    };
+
+    explicit PagedTree(const std::string& path, std::size_t frames)
+        : pool_{path, PageSize, frames}, root_{kInvalidPage} {}
+    static inline auto Cast(const BufferPool::PageGuard& page) -> Page* {
+        return reinterpret_cast<Page*>(page.GetData());
+    }
+
+    static inline auto FindIndex(const Page* node, const T& key) -> int {
+        return KeySearch<T>::LowerBound(node->keys, node->count, key);
+    }
+
+    // whether the key is within the bounds of the node, or else lies to the
+    // right of it
+    static inline auto Covers(const Page* node, const T& key) -> bool {
+        return node->right == kInvalidPage || !node->has_high_key ||
+               !(node->high_key < key);
+    }
+
+    // the page to go to next from the node, looking for the key
+    static inline auto Next(const Page* node, const T& key) -> PageId {
+        if (!Covers(node, key)) return node->right;
+        return node->children[FindIndex(node, key)];
+    }
+
+    // move from the page, latched in shared mode, to the one with the id,
+    // and latch that one in shared mode. returns false if it cannot be read
+    auto Step(BufferPool::PageGuard& page, PageId id) -> bool {
+        page.UnlatchShared();
+        page = pool_.Fetch(id);
+        if (!page.IsValid()) return false;
+        page.LatchShared();
+        return true;
+    }
+
+    inline auto GetRoot() -> PageId {
+        return root_.load(std::memory_order_acquire);
+    }
+
+    // point the meta page at the new root. the caller holds the latch of the
+    // old root, or is the only thread using the tree
+    void SetRoot(PageId id) {
+        auto meta = pool_.Fetch(kMetaPage);
+        meta.Latch();
+        auto header = Meta{kMagic, PageSize, id, Buffered};
+        std::memcpy(meta.GetData(), &header, sizeof(header));
+        meta.MarkDirty();
+        meta.Unlatch();
+        root_.store(id, std::memory_order_release);
+    }
+
+    // descend to the leaf whose bounds cover key and return it latched in
+    // shared mode
+    auto DescendShared(const T& key) -> BufferPool::PageGuard {
+        auto page = pool_.Fetch(GetRoot());
+        if (!page.IsValid()) return page;
+        page.LatchShared();
+        while (true) {
+            auto node = Cast(page);
+            if (node->leaf && Covers(node, key)) return page;
+            auto next = node->leaf ? node->right : Next(node, key);
+            if (!Step(page, next)) return page;
+        }
+    }
+
+    // descend to the leaf whose bounds cover key and return it latched,
+    // recording the rightmost page visited on each level in ancestors
+    auto Descend(const T& key, Ancestors& ancestors)
+        -> BufferPool::PageGuard {
+        auto page = pool_.Fetch(GetRoot());
+        if (!page.IsValid()) return page;
+        page.LatchShared();
+        ancestors.top = Cast(page)->level;
+        while (true) {
+            auto node = Cast(page);
+            if (node->leaf) {
+                // pages never change level, so the leaf stays a leaf while
+                // it is unlatched. a split meanwhile is undone by MoveRight
+                page.UnlatchShared();
+                page.Latch();
+                return MoveRight(std::move(page), key);
+            }
+            if (Covers(node, key)) ancestors.Set(node->level, page.GetId());
+            if (!Step(page, Next(node, key))) return page;
+        }
+    }
+
+    // move right from the latched page until one is reached that has
+    // appropriate bounds for the key, and return it latched
+    auto MoveRight(BufferPool::PageGuard page, const T& key)
+        -> BufferPool::PageGuard {
+        while (!Covers(Cast(page), key)) {
+            auto next = pool_.Fetch(Cast(page)->right);
+            if (next.IsValid()) next.Latch();
+            page.Unlatch();
+            if (!next.IsValid()) return next;
+            page = std::move(next);
+        }
+        return page;
+    }
+
+    // find the page on the level to insert the separator into, and return
+    // it latched
+    auto FindParent(int level, const Ancestors& ancestors, const T& key)
+        -> BufferPool::PageGuard {
+        auto id = ancestors.Get(level);
+        if (id == kInvalidPage) {
+            // the descent did not reach the level, so a new root has been
+            // created above it since. find the level again from the root
+            auto page = pool_.Fetch(GetRoot());
+            if (!page.IsValid()) return page;
+            page.LatchShared();
+            while (Cast(page)->level > level) {
+                if (!Step(page, Next(Cast(page), key))) return page;
+            }
+            id = page.GetId();
+            page.UnlatchShared();
+        }
+        auto page = pool_.Fetch(id);
+        if (!page.IsValid()) return page;
+        page.Latch();
+        return MoveRight(std::move(page), key);
+    }
+
+    // move the upper half of the overflowing node into the empty page of the
+    // new right sibling, link it in, and return the key that separates the
+    // two. the sibling is unreachable until it is linked, so it needs no
+    // latch of its own
+    static auto Split(Page* node, Page* right, PageId right_id) -> T {
+        auto count = node->count;
+        auto mid = count % 2 == 0 ? count / 2 : count / 2 + 1;
+        auto separator = node->keys[mid - 1];
+        right->leaf = node->leaf;
+        right->level = node->level;
+        right->right = node->right;
+        right->has_high_key = node->has_high_key;
+        right->high_key = node->high_key;
+        right->count = count - mid;
+        std::copy(node->keys + mid, node->keys + count, right->keys);
+        if (node->leaf) {
+            std::copy(node->values + mid, node->values + count, right->values);
+            node->count = mid;
+        } else {
+            // the separator moves up instead of staying in the left half
+            std::copy(node->children + mid, node->children + count + 1,
+                      right->children);
+            node->count = mid - 1;
+        }
+        node->has_high_key = 1;
+        node->high_key = separator;
+        node->right = right_id;
+        return separator;
+    }
+
+    // keys of the new right siblings a page split into, each paired with the
+    // id of the sibling it is the lower bound of, in key order
+    using Siblings = std::vector<std::pair<T, PageId>>;
+
+    // Search in buffered mode, checking the buffer of every internal node on
+    // the way down. a node and its buffer are read under the node's latch,
+    // and messages only ever move down or right, into a page the descent has
+    // yet to reach, so the first message found is the newest
+    auto SearchBuffered(const T& key) -> std::optional<K> {
+        auto page = pool_.Fetch(GetRoot());
+        if (!page.IsValid()) return std::nullopt;
+        page.LatchShared();
+        while (true) {
+            auto node = Cast(page);
+            if (!Covers(node, key)) {
+                if (!Step(page, node->right)) return std::nullopt;
+                continue;
+            }
+            if (node->leaf) {
+                auto index = FindIndex(node, key);
+                auto found = index < node->count && node->keys[index] == key
+                                 ? std::optional<K>{node->values[index]}
+                                 : std::nullopt;
+                page.UnlatchShared();
+                return found;
+            }
+            if (auto message = FindMessage(node, key)) {
+                page.UnlatchShared();
+                return message->erase ? std::nullopt
+                                      : std::optional<K>{message->value};
+            }
+            if (!Step(page, Next(node, key))) return std::nullopt;
+        }
+    }
+
+    // the message for the key in the buffer of the internal node, which the
+    // caller has latched. buffers are only written under their node's latch
+    auto FindMessage(const Page* node, const T& key) -> std::optional<Message> {
+        if (node->buffer == 0) return std::nullopt;
+        auto page = pool_.Fetch(node->buffer);
+        if (!page.IsValid()) return std::nullopt;
+        auto buffer = reinterpret_cast<const BufferPage*>(page.GetData());
+        auto end = buffer->messages + buffer->count;
+        auto it = std::lower_bound(
+            buffer->messages, end, key,
+            [](const Message& m, const T& k) { return m.key < k; });
+        if (it == end || !(it->key == key)) return std::nullopt;
+        return *it;
+    }
+
+    // copy out the messages within [lo, hi] from the buffers of every
+    // internal node whose bounds overlap it, sorted by key and only the
+    // newest for each key. the caller holds write_latch_, so no buffer
+    // changes while they are read level by level from the root down.
+    // returns false if a page cannot be read
+    auto CollectMessages(const T& lo, const T& hi,
+                         std::vector<Message>& pending) -> bool {
+        auto page = pool_.Fetch(GetRoot());
+        if (!page.IsValid()) return false;
+        page.LatchShared();
+        auto level = std::vector<Message>{};
+        auto buffer = std::vector<Message>{};
+        while (!Cast(page)->leaf) {
+            // the node covering lo, and its right siblings up to the one
+            // covering hi
+            auto first = Next(Cast(page), lo);
+            level.clear();
+            while (true) {
+                auto node = Cast(page);
+                if (!ReadBuffer(node, buffer)) {
+                    page.UnlatchShared();
+                    return false;
+                }
+                for (const auto& message : buffer)
+                    if (!(message.key < lo) && !(hi < message.key))
+                        level.push_back(message);
+                if (Covers(node, hi)) break;
+                if (!Step(page, node->right)) return false;
+            }
+            // any level above holds newer messages than this one
+            pending = Merge(pending, level);
+            if (!Step(page, first)) return false;
+        }
+        page.UnlatchShared();
+        return true;
+    }
+
+    // the entries, sorted by key, with the sorted messages applied. each
+    // message replaces the entry for its key, and an erase drops it
+    static auto ApplyMessages(const std::vector<std::pair<T, K>>& entries,
+                              std::span<const Message> messages)
+        -> std::vector<std::pair<T, K>> {
+        auto applied = std::vector<std::pair<T, K>>{};
+        applied.reserve(entries.size() + messages.size());
+        auto i = std::size_t{0};
+        for (const auto& message : messages) {
+            for (; i < entries.size() && entries[i].first < message.key; i++)
+                applied.push_back(entries[i]);
+            if (i < entries.size() && entries[i].first == message.key) i++;
+            if (!message.erase)
+                applied.emplace_back(message.key, message.value);
+        }
+        for (; i < entries.size(); i++) applied.push_back(entries[i]);
+        return applied;
+    }
+
+    // copy the buffer of the internal node out. returns false if its page
+    // cannot be read
+    auto ReadBuffer(const Page* node, std::vector<Message>& messages)
+        -> bool {
+        messages.clear();
+        if (node->buffer == 0) return true;
+        auto page = pool_.Fetch(node->buffer);
+        if (!page.IsValid()) return false;
+        auto buffer = reinterpret_cast<const BufferPage*>(page.GetData());
+        messages.assign(buffer->messages, buffer->messages + buffer->count);
+        return true;
+    }
+
+    // replace the buffer of the internal node, which the caller has
+    // latched, giving the node a buffer page if it has none yet
+    auto WriteBuffer(Page* node, std::span<const Message> messages) -> bool {
+        if (messages.empty() && node->buffer == 0) return true;
+        auto page = node->buffer == 0 ? pool_.New() : pool_.Fetch(node->buffer);
+        if (!page.IsValid()) return false;
+        node->buffer = page.GetId();
+        // latched only so that Flush() never writes it back half changed
+        page.Latch();
+        auto buffer = reinterpret_cast<BufferPage*>(page.GetData());
+        buffer->count = static_cast<int32_t>(messages.size());
+        std::copy(messages.begin(), messages.end(), buffer->messages);
+        page.MarkDirty();
+        page.Unlatch();
+        return true;
+    }
+
+    // merge two sorted runs of messages. where both have a message for a
+    // key, the newer one wins
+    static auto Merge(const std::vector<Message>& newer,
+                      const std::vector<Message>& older)
+        -> std::vector<Message> {
+        auto merged = std::vector<Message>{};
+        merged.reserve(newer.size() + older.size());
+        auto i = std::size_t{0};
+        auto j = std::size_t{0};
+        while (i < newer.size() || j < older.size()) {
+            if (j == older.size() ||
+                (i < newer.size() && newer[i].key < older[j].key)) {
+                merged.push_back(newer[i++]);
+            } else if (i == newer.size() || older[j].key < newer[i].key) {
+                merged.push_back(older[j++]);
+            } else {
+                merged.push_back(newer[i++]);
+                j++;
+            }
+        }
+        return merged;
+    }
+
+    // queue a write at the root. buffered writers run one at a time
+    auto Enqueue(const Message& message) -> bool {
+        std::lock_guard<std::mutex> lk{write_latch_};
+        return Push({message});
+    }
+
+    // apply the batch to the root, and add levels above it for as long as
+    // it splits. the caller holds write_latch_, so that the pages latched
+    // exclusively are always one path down from the root
+    auto Push(std::vector<Message> batch) -> bool {
+        auto page = pool_.Fetch(GetRoot());
+        if (!page.IsValid()) return false;
+        page.Latch();
+        auto siblings = Siblings{};
+        auto ok = Apply(page, std::move(batch), siblings);
+        while (!siblings.empty()) {
+            auto root = pool_.New();
+            auto top = Cast(root);
+            top->level = Cast(page)->level + 1;
+            top->right = kInvalidPage;
+            auto keys = std::vector<T>{};
+            auto children = std::vector<PageId>{page.GetId()};
+            for (const auto& [separator, id] : siblings) {
+                keys.push_back(separator);
+                children.push_back(id);
+            }
+            siblings.clear();
+            ok = WriteInternal(root, keys, children, {}, siblings) && ok;
+            SetRoot(root.GetId());
+            page.Unlatch();
+            page = std::move(root);
+            page.Latch();
+        }
+        page.Unlatch();
+        return ok;
+    }
+
+    // apply the batch, sorted by key and newer than any message below, to
+    // the latched page. a leaf takes the writes in. an internal node adds
+    // them to its buffer, and then moves messages down to children, the
+    // fullest first, until the buffer fits in its page
+    // - the new right siblings the page split into are added to siblings
+    // - if a page cannot be read, nothing is written to this page, and false
+    //   is returned. messages already moved further down are left behind
+    //   too, which does no harm since applying one twice changes nothing
+    auto Apply(BufferPool::PageGuard& page, std::vector<Message> batch,
+               Siblings& siblings) -> bool {
+        auto node = Cast(page);
+        if (node->leaf) {
+            auto entries = std::vector<std::pair<T, K>>{};
+            entries.reserve(node->count);
+            for (auto i = 0; i < node->count; i++)
+                entries.emplace_back(node->keys[i], node->values[i]);
+            WriteLeaf(page, ApplyMessages(entries, batch), siblings);
+            return true;
+        }
+        auto buffer = std::vector<Message>{};
+        if (!ReadBuffer(node, buffer)) return false;
+        buffer = Merge(batch, buffer);
+        auto keys = std::vector<T>(node->keys, node->keys + node->count);
+        auto children = std::vector<PageId>(
+            node->children, node->children + node->count + 1);
+        while (buffer.size() > kBufferCapacity) {
+            auto fullest = std::size_t{0};
+            auto most = std::size_t{0};
+            for (std::size_t c = 0; c < children.size(); c++) {
+                auto [begin, end] = Bound(keys, buffer, c);
+                if (end - begin > most) {
+                    fullest = c;
+                    most = end - begin;
+                }
+            }
+            if (!FlushChild(keys, children, buffer, fullest)) return false;
+        }
+        return WriteInternal(page, keys, children, buffer, siblings);
+    }
+
+    // the messages of the sorted buffer bound for child c of an internal
+    // node with the keys, as a range of indexes into the buffer
+    static auto Bound(const std::vector<T>& keys,
+                      const std::vector<Message>& buffer, std::size_t c)
+        -> std::pair<std::size_t, std::size_t> {
+        auto below = [](const T& k, const Message& m) { return k < m.key; };
+        auto begin = c == 0 ? buffer.begin()
+                            : std::upper_bound(buffer.begin(), buffer.end(),
+                                               keys[c - 1], below);
+        auto end = c == keys.size() ? buffer.end()
+                                    : std::upper_bound(begin, buffer.end(),
+                                                       keys[c], below);
+        return {static_cast<std::size_t>(begin - buffer.begin()),
+                static_cast<std::size_t>(end - buffer.begin())};
+    }
+
+    // move the messages bound for child c out of the buffer and apply them
+    // to it, and add the siblings it split into to the keys and children
+    auto FlushChild(std::vector<T>& keys, std::vector<PageId>& children,
+                    std::vector<Message>& buffer, std::size_t c) -> bool {
+        auto [begin, end] = Bound(keys, buffer, c);
+        auto child = pool_.Fetch(children[c]);
+        if (!child.IsValid()) return false;
+        child.Latch();
+        auto split = Siblings{};
+        auto ok = Apply(child,
+                        std::vector<Message>(buffer.begin() + begin,
+                                             buffer.begin() + end),
+                        split);
+        child.Unlatch();
+        if (!ok) return false;
+        buffer.erase(buffer.begin() + begin, buffer.begin() + end);
+        for (std::size_t i = 0; i < split.size(); i++) {
+            keys.insert(keys.begin() + c + i, split[i].first);
+            children.insert(children.begin() + c + i + 1, split[i].second);
+        }
+        return true;
+    }
+
+    // the first of the items that go to part i of n, dividing them evenly
+    static inline auto PartBegin(std::size_t items, std::size_t i,
+                                 std::size_t n) -> std::size_t {
+        return items * i / n;
+    }
+
+    // write the entries to the latched leaf, spread over as many new right
+    // siblings as it takes to fit them. the siblings are filled in from the
+    // right and linked before the leaf is, so they are unreachable until the
+    // leaf is unlatched
+    void WriteLeaf(BufferPool::PageGuard& page,
+                   const std::vector<std::pair<T, K>>& entries,
+                   Siblings& siblings) {
+        auto node = Cast(page);
+        auto n = std::max<std::size_t>(
+            1, (entries.size() + kCapacity - 1) / kCapacity);
+        auto fill = [&](Page* target, std::size_t i) {
+            auto begin = PartBegin(entries.size(), i, n);
+            auto end = PartBegin(entries.size(), i + 1, n);
+            target->count = static_cast<int32_t>(end - begin);
+            for (auto j = begin; j < end; j++) {
+                target->keys[j - begin] = entries[j].first;
+                target->values[j - begin] = entries[j].second;
+            }
+        };
+        auto added = Siblings{};
+        for (auto i = n - 1; i > 0; i--) {
+            auto sibling = pool_.New();
+            auto target = Cast(sibling);
+            target->leaf = 1;
+            fill(target, i);
+            target->right = node->right;
+            target->has_high_key = node->has_high_key;
+            target->high_key = node->high_key;
+            node->right = sibling.GetId();
+            node->has_high_key = 1;
+            node->high_key = entries[PartBegin(entries.size(), i, n) - 1].first;
+            added.emplace_back(node->high_key, sibling.GetId());
+        }
+        fill(node, 0);
+        page.MarkDirty();
+        siblings.insert(siblings.end(), added.rbegin(), added.rend());
+    }
+
+    // write the keys, children and buffer to the latched internal node,
+    // spread over as many new right siblings as it takes, the way WriteLeaf
+    // does. the key between two parts moves up instead of staying in either,
+    // and each part keeps the messages bound for its children
+    auto WriteInternal(BufferPool::PageGuard& page, const std::vector<T>& keys,
+                       const std::vector<PageId>& children,
+                       const std::vector<Message>& buffer, Siblings& siblings)
+        -> bool {
+        auto node = Cast(page);
+        auto n = (children.size() + kCapacity) / (kCapacity + 1);
+        auto ok = true;
+        // the messages at or above the part's lower bound, taken by the part
+        auto taken = buffer.size();
+        auto fill = [&](Page* target, std::size_t i) {
+            auto begin = PartBegin(children.size(), i, n);
+            auto end = PartBegin(children.size(), i + 1, n);
+            target->count = static_cast<int32_t>(end - begin - 1);
+            std::copy(keys.begin() + begin, keys.begin() + end - 1,
+                      target->keys);
+            std::copy(children.begin() + begin, children.begin() + end,
+                      target->children);
+            auto first = i == 0 ? buffer.begin()
+                                : std::upper_bound(
+                                      buffer.begin(), buffer.begin() + taken,
+                                      keys[begin - 1],
+                                      [](const T& k, const Message& m) {
+                                          return k < m.key;
+                                      });
+            auto from = static_cast<std::size_t>(first - buffer.begin());
+            ok = WriteBuffer(target, std::span<const Message>{buffer}.subspan(
+                                         from, taken - from)) &&
+                 ok;
+            taken = from;
+        };
+        auto added = Siblings{};
+        for (auto i = n - 1; i > 0; i--) {
+            auto sibling = pool_.New();
+            auto target = Cast(sibling);
+            target->level = node->level;
+            fill(target, i);
+            target->right = node->right;
+            target->has_high_key = node->has_high_key;
+            target->high_key = node->high_key;
+            node->right = sibling.GetId();
+            node->has_high_key = 1;
+            node->high_key = keys[PartBegin(children.size(), i, n) - 1];
+            added.emplace_back(node->high_key, sibling.GetId());
+        }
+        fill(node, 0);
+        page.MarkDirty();
+        siblings.insert(siblings.end(), added.rbegin(), added.rend());
+        return ok;
+    }
+
+    BufferPool pool_;
+    // only ever changes from a root to the new root above it when it splits
+    std::atomic<PageId> root_;
+    // held by buffered writers and by the buffer flushes of buffered scans
+    std::mutex write_latch_;
+};
@@ -0,0 +1,920 @@
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <limits>
+#include <map>
+#include <memory>
+#include <numeric>
+#include <random>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "main/tree.h"
+
+namespace {
+
+constexpr int kKeys = 5000;
+
+std::atomic<int> failures{0};
+
+// report a failed check and carry on, so that one run shows every failure
+#define CHECK(condition)                                                \
+    do {                                                                \
+        if (!(condition)) {                                             \
+            std::fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, \
+                         __LINE__, #condition);                         \
+            failures++;                                                 \
+        }                                                               \
+    } while (false)
+
+// the i-th key of a test, in the same order for every key type
+template <typename T>
+auto MakeKey(int i) -> T {
+    if constexpr (std::is_same_v<T, std::string>) {
+        auto key = std::to_string(i);
+        return std::string(8 - key.size(), '0') + key;
+    } else {
+        return static_cast<T>(i);
+    }
+}
+
+// a scratch directory for files, removed with the test
+class TempDir {
+   public:
+    explicit TempDir(const std::string& name)
+        : path_{std::filesystem::temp_directory_path() /
+                ("memorytree_test_" + std::to_string(::getpid()) + "_" +
+                 name)} {
+        std::filesystem::remove_all(path_);
+        std::filesystem::create_directories(path_);
+    }
+
+    ~TempDir() { std::filesystem::remove_all(path_); }
+
+    auto Path(const std::string& name) const -> std::string {
+        return (path_ / name).string();
+    }
+
+   private:
+    std::filesystem::path path_;
+};
+
+template <typename T>
+void TestSearch() {
+    auto tree = Tree<T, uint64_t>{};
+    auto order = std::vector<int>(kKeys);
+    std::iota(order.begin(), order.end(), 0);
+    std::shuffle(order.begin(), order.end(), std::mt19937{7});
+    for (auto i : order)
+        if (i % 2 == 0) CHECK(tree.Insert(MakeKey<T>(i), i));
+    CHECK(!tree.Insert(MakeKey<T>(0), 1));
+    for (auto i = 0; i < kKeys; i++) {
+        auto found = tree.Search(MakeKey<T>(i));
+        if (i % 2 == 0)
+            CHECK(found == static_cast<uint64_t>(i));
+        else
+            CHECK(!found.has_value());
+    }
+}
+
+template <typename T>
+void TestScan() {
+    auto tree = Tree<T, uint64_t>{};
+    for (auto i = kKeys - 1; i >= 0; i--) tree.Insert(MakeKey<T>(i), i);
+    auto expected = 100;
+    tree.Scan(MakeKey<T>(100), MakeKey<T>(3999),
+              [&](const T& key, uint64_t val) {
+                  CHECK(key == MakeKey<T>(expected));
+                  CHECK(val == static_cast<uint64_t>(expected));
+                  expected++;
+              });
+    CHECK(expected == 4000);
+}
+
+template <typename T>
+void TestWrites() {
+    auto tree = Tree<T, uint64_t>{};
+    for (auto i = 0; i < kKeys; i++) tree.Insert(MakeKey<T>(i), i);
+    for (auto i = 0; i < kKeys; i += 3) CHECK(tree.Erase(MakeKey<T>(i)));
+    CHECK(!tree.Erase(MakeKey<T>(0)));
+    // an upsert reports whether it inserted or replaced
+    CHECK(tree.Upsert(MakeKey<T>(1), 100) == UpsertResult::kReplaced);
+    CHECK(tree.Upsert(MakeKey<T>(kKeys), kKeys) == UpsertResult::kInserted);
+    CHECK(tree.CompareExchange(MakeKey<T>(2), 2, 200));
+    CHECK(!tree.CompareExchange(MakeKey<T>(4), 3, 400));
+    CHECK(tree.Update(MakeKey<T>(5), [](uint64_t& val) { val += 1; }));
+    CHECK(tree.Search(MakeKey<T>(1)) == 100u);
+    CHECK(tree.Search(MakeKey<T>(2)) == 200u);
+    CHECK(tree.Search(MakeKey<T>(4)) == 4u);
+    CHECK(tree.Search(MakeKey<T>(5)) == 6u);
+    CHECK(tree.Search(MakeKey<T>(kKeys)) == static_cast<uint64_t>(kKeys));
+    auto count = 0;
+    tree.Scan(MakeKey<T>(0), MakeKey<T>(kKeys - 1),
+              [&](const T& key, uint64_t) {
+                  // every third key from 0 on is gone
+                  CHECK(key == MakeKey<T>(count + count / 2 + 1));
+                  count++;
+              });
+    CHECK(count == kKeys - (kKeys + 2) / 3);
+}
+
+template <typename T>
+void TestKeyType() {
+    TestSearch<T>();
+    TestScan<T>();
+    TestWrites<T>();
+}
+
+void TestTail() {
+    // ascending inserts from several threads all land in the rightmost leaf
+    auto tree = Tree<uint64_t, uint64_t>{};
+    constexpr uint64_t kThreads = 4;
+    constexpr uint64_t kPerThread = 20000;
+    auto next = std::atomic<uint64_t>{0};
+    auto threads = std::vector<std::thread>{};
+    for (uint64_t t = 0; t < kThreads; t++)
+        threads.emplace_back([&] {
+            for (uint64_t i = 0; i < kPerThread; i++) {
+                auto key = next.fetch_add(1);
+                CHECK(tree.Insert(key, key));
+            }
+        });
+    for (auto& thread : threads) thread.join();
+    auto expected = uint64_t{0};
+    tree.Scan(0, kThreads * kPerThread, [&](uint64_t key, uint64_t val) {
+        CHECK(key == expected);
+        CHECK(val == expected);
+        expected++;
+    });
+    CHECK(expected == kThreads * kPerThread);
+}
+
+void TestCompaction() {
+    auto tree = Tree<uint64_t, uint64_t>{};
+    for (uint64_t i = 0; i < kKeys; i++) tree.Insert(i, i);
+    for (uint64_t i = 0; i < kKeys; i++)
+        if (i % 10 != 0) tree.Erase(i);
+    CHECK(tree.Compact() > 0);
+    for (uint64_t i = 0; i < kKeys; i++)
+        CHECK(tree.Search(i).has_value() == (i % 10 == 0));
+    // the first pass only notes which leaves are idle, the second packs them
+    tree.Freeze();
+    CHECK(tree.Freeze() > 0);
+    for (uint64_t i = 0; i < kKeys; i++)
+        CHECK(tree.Search(i).has_value() == (i % 10 == 0));
+    // pack until there is nothing left to pack
+    while (tree.Freeze() > 0) {
+    }
+    // failed writes leave cold leaves cold, so there is nothing new to pack
+    for (uint64_t i = 0; i < kKeys / 2; i++) {
+        CHECK(!tree.Erase(i * 10 + 1));
+        CHECK(!tree.CompareExchange(i * 10, i * 10 + 1, 0));
+        CHECK(!tree.Update(i * 10 + 1, [](uint64_t& val) { val++; }));
+    }
+    tree.Freeze();
+    CHECK(tree.Freeze() == 0);
+    for (uint64_t i = 0; i < kKeys; i++)
+        CHECK(tree.Search(i).has_value() == (i % 10 == 0));
+    // writing to a cold leaf thaws it
+    CHECK(tree.Insert(1, 1));
+    CHECK(tree.Erase(10));
+    CHECK(tree.CompareExchange(20, 20, 21));
+    CHECK(tree.Search(20) == 21u);
+    tree.Freeze();
+    CHECK(tree.Freeze() > 0);
+    auto count = 0;
+    tree.Scan(0, kKeys, [&](uint64_t, uint64_t) { count++; });
+    CHECK(count == kKeys / 10);
+}
+
+void TestConcurrentWrites() {
+    // every thread owns the keys equal to its index modulo kThreads, inserts
+    // them in random order and erases every other one, while compaction runs
+    auto tree = Tree<uint64_t, uint64_t>{};
+    constexpr uint64_t kThreads = 8;
+    constexpr uint64_t kPerThread = 10000;
+    tree.StartCompaction(std::chrono::milliseconds{1});
+    auto threads = std::vector<std::thread>{};
+    for (uint64_t t = 0; t < kThreads; t++)
+        threads.emplace_back([&, t] {
+            auto keys = std::vector<uint64_t>(kPerThread);
+            for (uint64_t i = 0; i < kPerThread; i++)
+                keys[i] = i * kThreads + t;
+            std::shuffle(keys.begin(), keys.end(), std::mt19937_64{t});
+            for (auto key : keys) CHECK(tree.Insert(key, key));
+            for (auto key : keys)
+                if (key / kThreads % 2 == 1) CHECK(tree.Erase(key));
+            for (auto key : keys)
+                CHECK(tree.Search(key).has_value() ==
+                      (key / kThreads % 2 == 0));
+        });
+    for (auto& thread : threads) thread.join();
+    tree.StopCompaction();
+    auto count = uint64_t{0};
+    tree.Scan(0, kThreads * kPerThread, [&](uint64_t key, uint64_t val) {
+        CHECK(key / kThreads % 2 == 0);
+        CHECK(key == val);
+        count++;
+    });
+    CHECK(count == kThreads * kPerThread / 2);
+}
+
+void TestRecover() {
+    auto dir = TempDir{"recover"};
+    {
+        auto log = WriteAheadLog{dir.Path("log")};
+        auto tree = Tree<uint64_t, uint64_t>{};
+        CHECK(tree.Recover(dir.Path("snapshot"), log));
+        for (uint64_t i = 0; i < 1000; i++) tree.Insert(i, i);
+        CHECK(tree.Checkpoint(dir.Path("snapshot")));
+        for (uint64_t i = 0; i < 1000; i += 2) tree.Upsert(i, i + 1000);
+        tree.Erase(1);
+    }
+    auto log = WriteAheadLog{dir.Path("log")};
+    auto tree = Tree<uint64_t, uint64_t>{};
+    CHECK(tree.Recover(dir.Path("snapshot"), log));
+    CHECK(!tree.Search(1).has_value());
+    for (uint64_t i = 2; i < 1000; i++)
+        CHECK(tree.Search(i) == (i % 2 == 0 ? i + 1000 : i));
+    // recovering again would replay over what is already there
+    CHECK(!tree.Recover(dir.Path("snapshot"), log));
+    // nothing that bypasses the log is let in once it is attached
+    auto entries = std::vector<std::pair<uint64_t, uint64_t>>{{5000, 5000}};
+    auto other = Tree<uint64_t, uint64_t>{};
+    other.Insert(5000, 5000);
+    CHECK(!tree.MergeFrom(other));
+    auto empty = Tree<uint64_t, uint64_t>{};
+    auto empty_log = WriteAheadLog{dir.Path("empty")};
+    CHECK(empty.Recover(dir.Path("none"), empty_log));
+    CHECK(!empty.BulkLoad(entries.begin(), entries.end()));
+    CHECK(!empty.ParallelBuild(entries));
+    CHECK(empty.Insert(1, 1));
+}
+
+void TestFailedLog() {
+    // a log whose segment cannot be created fails from the start, and every
+    // write is refused rather than applied and reported durable
+    auto dir = TempDir{"failed_log"};
+    auto log = WriteAheadLog{dir.Path("missing/log")};
+    CHECK(!log.IsHealthy());
+    auto tree = Tree<uint64_t, uint64_t>{};
+    CHECK(tree.Recover(dir.Path("snapshot"), log));
+    CHECK(!tree.Insert(1, 1));
+    CHECK(tree.Upsert(1, 1) == UpsertResult::kFailed);
+    auto entries = std::vector<std::pair<uint64_t, uint64_t>>{{2, 2}};
+    CHECK(tree.InsertBatch(entries) == -1);
+    CHECK(!tree.Search(1).has_value());
+    CHECK(!tree.Search(2).has_value());
+}
+
+// the key the i-th insert of TestPaged writes, spread over the key space
+auto PagedKey(uint64_t i) -> uint64_t { return i * 2654435761u % 1000003; }
+
+void TestPaged() {
+    auto dir = TempDir{"paged"};
+    auto path = dir.Path("tree");
+    constexpr uint64_t kCount = 40000;
+    {
+        // a small pool, so that dirty pages are evicted along the way
+        auto tree = PagedTree<uint64_t, uint64_t>::Open(path, 32);
+        CHECK(tree != nullptr);
+        if (tree == nullptr) return;
+        constexpr uint64_t kThreads = 4;
+        auto threads = std::vector<std::thread>{};
+        for (uint64_t t = 0; t < kThreads; t++)
+            threads.emplace_back([&, t] {
+                for (uint64_t i = t; i < kCount; i += kThreads)
+                    CHECK(tree->Insert(PagedKey(i), i));
+            });
+        for (auto& thread : threads) thread.join();
+        for (uint64_t i = 0; i < kCount; i += 2)
+            CHECK(tree->Erase(PagedKey(i)));
+        CHECK(tree->Flush());
+    }
+    auto tree = PagedTree<uint64_t, uint64_t>::Open(path, 16);
+    CHECK(tree != nullptr);
+    if (tree == nullptr) return;
+    auto expected = std::map<uint64_t, uint64_t>{};
+    for (uint64_t i = 1; i < kCount; i += 2) expected[PagedKey(i)] = i;
+    auto it = expected.begin();
+    tree->Scan(0, UINT64_MAX, [&](uint64_t key, uint64_t val) {
+        CHECK(it != expected.end());
+        if (it == expected.end()) return;
+        CHECK(key == it->first);
+        CHECK(val == it->second);
+        ++it;
+    });
+    CHECK(it == expected.end());
+    auto keys = std::vector<uint64_t>{};
+    for (auto [key, val] : expected) keys.push_back(key);
+    std::shuffle(keys.begin(), keys.end(), std::mt19937_64{1});
+    auto ring = IoRing{32};
+    auto found = tree->SearchBatch(keys, ring);
+    for (std::size_t i = 0; i < keys.size(); i++)
+        CHECK(found[i] == expected[keys[i]]);
+}
+
+void TestBatch() {
+    auto tree = Tree<uint64_t, uint64_t>{};
+    // unsorted, with a key repeated in the batch
+    auto entries = std::vector<std::pair<uint64_t, uint64_t>>{};
+    for (uint64_t i = 0; i < kKeys; i++)
+        entries.emplace_back(i * 7919 % kKeys * 2, i);
+    entries.emplace_back(entries.front());
+    CHECK(tree.InsertBatch(entries) == kKeys);
+    // keys already in the tree are skipped
+    CHECK(tree.InsertBatch(std::span{entries}.first(10)) == 0);
+    auto keys = std::vector<uint64_t>{};
+    for (uint64_t i = 2 * kKeys; i-- > 0;) keys.push_back(i);
+    auto found = tree.LookupBatch(keys, BatchMode::kSorted);
+    for (std::size_t i = 0; i < keys.size(); i++)
+        CHECK(found[i] == tree.Search(keys[i]));
+    CHECK(found.front() == std::nullopt);
+    CHECK(found.back() == 0u);
+}
+
+void TestInterleaved() {
+    // more keys than descents run at once, over a tree several levels deep,
+    // while another thread keeps splitting leaves
+    auto tree = Tree<uint64_t, uint64_t>{};
+    constexpr uint64_t kCount = 100000;
+    for (uint64_t i = 0; i < kCount; i++) tree.Insert(i * 2, i);
+    auto writer = std::thread{[&] {
+        for (uint64_t i = 0; i < kCount; i++) tree.Insert(i * 2 + 1, i);
+    }};
+    auto keys = std::vector<uint64_t>{};
+    for (uint64_t i = 0; i < kCount; i++) keys.push_back(i * 7919 % kCount * 2);
+    keys.push_back(4 * kCount);
+    for (auto round = 0; round < 5; round++) {
+        auto found = tree.LookupBatch(keys, BatchMode::kInterleaved);
+        for (std::size_t i = 0; i < keys.size(); i++)
+            CHECK(found[i] == (keys[i] < 2 * kCount
+                                   ? std::optional<uint64_t>{keys[i] / 2}
+                                   : std::nullopt));
+    }
+    writer.join();
+}
+
+void TestBulkLoad() {
+    // sorted, with a repeated key, at a fill factor that leaves room
+    auto entries = std::vector<std::pair<uint64_t, uint64_t>>{};
+    for (uint64_t i = 0; i < kKeys; i++) entries.emplace_back(i * 2, i);
+    entries.insert(entries.begin() + 10, entries[10]);
+    auto tree = Tree<uint64_t, uint64_t>{};
+    CHECK(tree.BulkLoad(entries.begin(), entries.end(), 0.7));
+    CHECK(!tree.BulkLoad(entries.begin(), entries.end()));
+    for (uint64_t i = 0; i < 2 * kKeys; i++)
+        CHECK(tree.Search(i) == (i % 2 == 0 ? std::optional<uint64_t>{i / 2}
+                                            : std::nullopt));
+    // the loaded tree takes writes like any other
+    for (uint64_t i = 1; i < 2 * kKeys; i += 2) CHECK(tree.Insert(i, i));
+    auto count = 0;
+    tree.Scan(0, 2 * kKeys, [&](uint64_t key, uint64_t) {
+        CHECK(key == static_cast<uint64_t>(count));
+        count++;
+    });
+    CHECK(count == 2 * kKeys);
+    auto strings = Tree<std::string, uint64_t>{};
+    auto keys = std::vector<std::pair<std::string, uint64_t>>{};
+    for (auto i = 0; i < kKeys; i++)
+        keys.emplace_back(MakeKey<std::string>(i), i);
+    CHECK(strings.BulkLoad(keys.begin(), keys.end(), 1.0, true));
+    for (auto i = 0; i < kKeys; i++)
+        CHECK(strings.Search(MakeKey<std::string>(i)) ==
+              static_cast<uint64_t>(i));
+}
+
+void TestSnapshot() {
+    auto dir = TempDir{"snapshot"};
+    auto tree = Tree<uint64_t, uint64_t>{};
+    for (uint64_t i = 0; i < kKeys; i++) tree.Insert(i * 3, i);
+    CHECK(tree.SaveSnapshot(dir.Path("snapshot")));
+    auto snapshot = Snapshot<uint64_t, uint64_t>::Open(dir.Path("snapshot"));
+    CHECK(snapshot != nullptr);
+    if (snapshot == nullptr) return;
+    CHECK(snapshot->GetCount() == kKeys);
+    for (uint64_t i = 0; i < 3 * kKeys + 3; i++)
+        CHECK(snapshot->Search(i) == (i % 3 == 0 && i < 3 * kKeys
+                                          ? std::optional<uint64_t>{i / 3}
+                                          : std::nullopt));
+    auto expected = uint64_t{34};
+    snapshot->Scan(100, 200, [&](uint64_t key, uint64_t val) {
+        CHECK(key == expected * 3);
+        CHECK(val == expected);
+        expected++;
+    });
+    CHECK(expected == 67);
+    auto count = uint64_t{0};
+    snapshot->ForEach([&](uint64_t key, uint64_t) {
+        CHECK(key == count * 3);
+        count++;
+    });
+    CHECK(count == kKeys);
+    // saving again replaces the file, while the old mapping stays valid
+    tree.Erase(0);
+    CHECK(tree.SaveSnapshot(dir.Path("snapshot")));
+    CHECK(snapshot->Search(0) == 0u);
+    auto saved = Snapshot<uint64_t, uint64_t>::Open(dir.Path("snapshot"));
+    CHECK(saved != nullptr && saved->GetCount() == kKeys - 1);
+    // a snapshot of other types, or of nothing, is refused
+    CHECK((Snapshot<uint32_t, uint64_t>::Open(dir.Path("snapshot")) ==
+           nullptr));
+    CHECK((Snapshot<uint64_t, uint64_t>::Open(dir.Path("none")) == nullptr));
+    auto empty = Tree<uint64_t, uint64_t>{};
+    CHECK(empty.SaveSnapshot(dir.Path("empty")));
+    auto none = Snapshot<uint64_t, uint64_t>::Open(dir.Path("empty"));
+    CHECK(none != nullptr && none->GetCount() == 0);
+    CHECK(none != nullptr && !none->Search(0).has_value());
+}
+
+void TestStats() {
+    auto tree = Tree<uint64_t, uint64_t>{};
+    auto threads = std::vector<std::thread>{};
+    for (uint64_t t = 0; t < 4; t++)
+        threads.emplace_back([&, t] {
+            for (uint64_t i = 0; i < kKeys; i++) tree.Insert(i * 4 + t, i);
+        });
+    for (auto& thread : threads) thread.join();
+    auto stats = tree.Stats();
+    auto splits = uint64_t{0};
+    for (auto count : stats.splits) splits += count;
+    if constexpr (kCollectStats) {
+        // every split but the root's adds a node, and there are many leaves
+        CHECK(stats.splits[0] > 0);
+        CHECK(stats.root_promotions > 0);
+        CHECK(stats.max_depth == stats.root_promotions + 1);
+        CHECK(splits >= stats.root_promotions);
+    } else {
+        CHECK(splits == 0);
+        CHECK(stats.max_depth == 0);
+        CHECK(stats.right_moves == 0);
+        CHECK(stats.latch_waits == 0);
+    }
+}
+
+// the entries of a sharded tree's full scan, which must come out in order
+template <typename Sharded>
+auto ScanAll(Sharded& tree) -> std::vector<std::pair<uint64_t, uint64_t>> {
+    auto entries = std::vector<std::pair<uint64_t, uint64_t>>{};
+    tree.Scan(0, UINT64_MAX, [&](uint64_t key, uint64_t val) {
+        CHECK(entries.empty() || entries.back().first < key);
+        entries.emplace_back(key, val);
+    });
+    return entries;
+}
+
+void TestSharded() {
+    auto hashed = ShardedTree<uint64_t, uint64_t>{8};
+    CHECK(hashed.GetShardCount() == 8);
+    for (uint64_t i = 0; i < kKeys; i++) CHECK(hashed.Insert(i, i));
+    CHECK(!hashed.Insert(0, 1));
+    CHECK(hashed.Erase(1));
+    CHECK(hashed.Update(2, [](uint64_t& val) { val = 20; }));
+    CHECK(hashed.CompareExchange(3, 3, 30));
+    CHECK(hashed.Upsert(4, 40) == UpsertResult::kReplaced);
+    CHECK(hashed.Upsert(kKeys, kKeys) == UpsertResult::kInserted);
+    CHECK(hashed.Erase(kKeys));
+    CHECK(hashed.Search(2) == 20u);
+    CHECK(hashed.Search(3) == 30u);
+    CHECK(!hashed.SplitShard(100));
+    CHECK(ScanAll(hashed).size() == kKeys - 1);
+    auto count = 0;
+    hashed.Scan(100, 199, [&](uint64_t key, uint64_t) {
+        CHECK(key == static_cast<uint64_t>(100 + count));
+        count++;
+    });
+    CHECK(count == 100);
+
+    // range partitioned, with shards split and merged under writers
+    auto ranged = ShardedTree<uint64_t, uint64_t>{std::vector<uint64_t>{
+        20000, 40000, 60000}};
+    CHECK(ranged.GetShardCount() == 4);
+    constexpr uint64_t kCount = 80000;
+    auto writers = std::vector<std::thread>{};
+    for (uint64_t t = 0; t < 4; t++)
+        writers.emplace_back([&, t] {
+            for (auto i = t; i < kCount; i += 4) CHECK(ranged.Insert(i, i));
+        });
+    for (uint64_t key = 10000; key < kCount; key += 20000)
+        CHECK(ranged.SplitShard(key));
+    CHECK(!ranged.SplitShard(10000));
+    CHECK(ranged.MergeShards(0));
+    CHECK(ranged.MergeShards(2));
+    for (auto& writer : writers) writer.join();
+    CHECK(ranged.GetShardCount() == 6);
+    CHECK(!ranged.MergeShards(5));
+    auto entries = ScanAll(ranged);
+    CHECK(entries.size() == kCount);
+    for (uint64_t i = 0; i < entries.size(); i++)
+        CHECK(entries[i].first == i && entries[i].second == i);
+    for (uint64_t i = 0; i < kCount; i += 997) CHECK(ranged.Search(i) == i);
+}
+
+void TestParallelBuild() {
+    // enough entries for several runs, shuffled, with every key twice: the
+    // value that comes first is kept
+    constexpr uint64_t kCount = 200000;
+    auto entries = std::vector<std::pair<uint64_t, uint64_t>>{};
+    for (uint64_t i = 0; i < kCount; i++) entries.emplace_back(i * 2, i);
+    std::shuffle(entries.begin(), entries.end(), std::mt19937_64{3});
+    auto first = std::map<uint64_t, uint64_t>{};
+    for (auto [key, val] : entries) first.emplace(key, val);
+    for (uint64_t i = 0; i < kCount; i++)
+        entries.emplace_back(i * 2, kCount + i);
+    auto tree = Tree<uint64_t, uint64_t>{};
+    CHECK(tree.ParallelBuild(entries, 0.8));
+    CHECK(!tree.ParallelBuild(entries));
+    auto it = first.begin();
+    tree.Scan(0, UINT64_MAX, [&](uint64_t key, uint64_t val) {
+        CHECK(it != first.end());
+        if (it == first.end()) return;
+        CHECK(key == it->first && val == it->second);
+        ++it;
+    });
+    CHECK(it == first.end());
+
+    // fold a delta holding odd keys and a few new values into the tree
+    // while another thread reads it
+    auto delta = Tree<uint64_t, uint64_t>{};
+    for (uint64_t i = 0; i < kCount; i += 100) delta.Insert(i * 2 + 1, i);
+    for (uint64_t i = 0; i < kCount; i += 1000) delta.Insert(i * 2, 7);
+    auto reading = std::atomic<bool>{true};
+    auto reader = std::thread{[&] {
+        while (reading.load())
+            for (uint64_t i = 2; i < kCount; i += 9973)
+                CHECK(tree.Search(i * 2).has_value());
+    }};
+    CHECK(tree.MergeFrom(delta, 0.9));
+    reading.store(false);
+    reader.join();
+    for (uint64_t i = 0; i < kCount; i++) {
+        CHECK(tree.Search(i * 2) == (i % 1000 == 0 ? 7 : first[i * 2]));
+        CHECK(tree.Search(i * 2 + 1) == (i % 100 == 0
+                                             ? std::optional<uint64_t>{i}
+                                             : std::nullopt));
+    }
+    // delta is left as it is
+    CHECK(delta.Search(1) == 0u);
+    auto empty = Tree<uint64_t, uint64_t>{};
+    CHECK(empty.MergeFrom(delta));
+    CHECK(empty.Search(201) == 100u);
+}
+
+void TestBuffered() {
+    auto dir = TempDir{"buffered"};
+    auto path = dir.Path("tree");
+    using Buffered = PagedTree<uint64_t, uint64_t, 4096, true>;
+    constexpr uint64_t kCount = 50000;
+    auto expected = std::map<uint64_t, uint64_t>{};
+    {
+        auto tree = Buffered::Open(path, 64);
+        CHECK(tree != nullptr);
+        if (tree == nullptr) return;
+        // enough writes for buffers to fill and be moved down, with keys
+        // overwritten and erased while their messages are still buffered
+        for (uint64_t i = 0; i < kCount; i++) {
+            auto key = PagedKey(i);
+            tree->Insert(key, i);
+            expected[key] = i;
+            if (i % 3 == 0) {
+                tree->Insert(key, i + 1);
+                expected[key] = i + 1;
+            }
+            if (i % 5 == 0) {
+                tree->Erase(PagedKey(i / 2));
+                expected.erase(PagedKey(i / 2));
+            }
+        }
+        for (uint64_t i = 0; i < kCount; i += 7)
+            CHECK(tree->Search(PagedKey(i)) ==
+                  (expected.contains(PagedKey(i))
+                       ? std::optional<uint64_t>{expected[PagedKey(i)]}
+                       : std::nullopt));
+        // a scan lays the buffered messages over the leaves, taking in the
+        // keys that only a buffer holds and leaving out the erased ones
+        auto it = expected.lower_bound(250000);
+        tree->Scan(250000, 750000, [&](uint64_t key, uint64_t val) {
+            CHECK(it != expected.end() && it->first <= 750000);
+            if (it == expected.end()) return;
+            CHECK(key == it->first && val == it->second);
+            ++it;
+        });
+        CHECK(it == expected.upper_bound(750000));
+        CHECK(tree->Flush());
+    }
+    // a buffered file is refused in the other mode
+    CHECK((PagedTree<uint64_t, uint64_t>::Open(path, 16) == nullptr));
+    auto tree = Buffered::Open(path, 16);
+    CHECK(tree != nullptr);
+    if (tree == nullptr) return;
+    auto it = expected.begin();
+    tree->Scan(0, UINT64_MAX, [&](uint64_t key, uint64_t val) {
+        CHECK(it != expected.end());
+        if (it == expected.end()) return;
+        CHECK(key == it->first && val == it->second);
+        ++it;
+    });
+    CHECK(it == expected.end());
+}
+
+// check KeySearch against std::lower_bound for every key in the array and
+// every key next to one, on arrays long enough to be interpolated
+template <typename T>
+void CheckLowerBound(const std::vector<T>& keys) {
+    CHECK(keys.size() >= std::size_t{InterpolationKeySearch<T>::kMinKeys});
+    auto count = static_cast<int>(keys.size());
+    auto check = [&](T key) {
+        auto expected = std::lower_bound(keys.begin(), keys.end(), key);
+        CHECK(KeySearch<T>::LowerBound(keys.data(), count, key) ==
+              expected - keys.begin());
+    };
+    for (auto key : keys) {
+        check(key);
+        if (key != std::numeric_limits<T>::min()) check(key - 1);
+        if (key != std::numeric_limits<T>::max()) check(key + 1);
+    }
+    check(std::numeric_limits<T>::min());
+    check(std::numeric_limits<T>::max());
+}
+
+template <typename T>
+void CheckInterpolation() {
+    constexpr auto kCount = 4 * InterpolationKeySearch<T>::kMinKeys;
+    auto uniform = std::vector<T>{};
+    for (auto i = 0; i < kCount; i++) uniform.push_back(static_cast<T>(i * 3));
+    CheckLowerBound(uniform);
+    // skewed so that interpolating guesses far from the answer
+    auto skewed = std::vector<T>{};
+    for (auto i = 0; i < kCount - 1; i++) skewed.push_back(static_cast<T>(i));
+    skewed.push_back(std::numeric_limits<T>::max());
+    CheckLowerBound(skewed);
+    // spanning the whole range of the type, negative keys included
+    auto wide = std::vector<T>{std::numeric_limits<T>::min()};
+    auto step = static_cast<T>(std::numeric_limits<T>::max() / kCount);
+    if constexpr (std::is_signed_v<T>) step *= 2;
+    for (auto i = 1; i < kCount - 1; i++) wide.push_back(wide.back() + step);
+    wide.push_back(std::numeric_limits<T>::max());
+    CheckLowerBound(wide);
+}
+
+void TestInterpolation() {
+    CheckInterpolation<int32_t>();
+    CheckInterpolation<int64_t>();
+    CheckInterpolation<uint64_t>();
+    // nodes wide enough for the leaves and inner nodes to be interpolated
+    auto tree = Tree<uint64_t, uint64_t, 512>{};
+    for (uint64_t i = 0; i < 100000; i++) tree.Insert(i * i, i);
+    for (uint64_t i = 0; i < 100000; i += 7) {
+        CHECK(tree.Search(i * i) == i);
+        CHECK(i < 2 || !tree.Search(i * i - 1).has_value());
+    }
+}
+
+void TestNuma() {
+    CHECK(Numa::NodeCount() >= 1);
+    CHECK(Numa::CurrentNode() >= 0 && Numa::CurrentNode() < Numa::NodeCount());
+    // arenas placed on a node, interleaved or anywhere hand out usable,
+    // distinct blocks, and reuse what was given back
+    for (auto node : {0, Numa::kInterleave, Numa::kAnyNode}) {
+        auto arena = NodeArena{200, node};
+        auto blocks = std::vector<void*>{};
+        for (auto i = 0; i < 10000; i++) {
+            blocks.push_back(arena.Allocate());
+            std::memset(blocks.back(), i, 200);
+        }
+        std::sort(blocks.begin(), blocks.end());
+        CHECK(std::adjacent_find(blocks.begin(), blocks.end()) ==
+              blocks.end());
+        auto freed = blocks.back();
+        arena.Deallocate(freed);
+        CHECK(arena.Allocate() == freed);
+    }
+    auto local = std::vector<uint64_t, NumaAllocator<uint64_t>>(
+        1000, 7, NumaAllocator<uint64_t>{0});
+    CHECK(std::count(local.begin(), local.end(), 7u) == 1000);
+
+    // descents start from the upper-level copies, which go stale as the
+    // tree keeps splitting and are dropped once compaction retires nodes
+    auto tree = Tree<uint64_t, uint64_t>{};
+    constexpr uint64_t kCount = 100000;
+    for (uint64_t i = 0; i < kCount; i += 2) tree.Insert(i, i);
+    tree.ReplicateUpperLevels(64);
+    auto threads = std::vector<std::thread>{};
+    threads.emplace_back([&] {
+        for (uint64_t i = 1; i < kCount; i += 2) tree.Insert(i, i);
+    });
+    threads.emplace_back([&] {
+        for (uint64_t i = 0; i < kCount; i += 2) CHECK(tree.Search(i) == i);
+    });
+    // interleaved batches start their descents from the copies too
+    threads.emplace_back([&] {
+        auto even = std::vector<uint64_t>{};
+        for (uint64_t i = 0; i < kCount; i += 2) even.push_back(i);
+        auto found = tree.LookupBatch(even, BatchMode::kInterleaved);
+        for (std::size_t i = 0; i < even.size(); i++)
+            CHECK(found[i] == even[i]);
+    });
+    for (auto& thread : threads) thread.join();
+    for (uint64_t i = 0; i < kCount; i += 3) CHECK(tree.Erase(i));
+    tree.Compact();
+    auto keys = std::vector<uint64_t>{};
+    for (uint64_t i = 0; i < kCount; i++) keys.push_back(i);
+    for (auto mode : {BatchMode::kSorted, BatchMode::kInterleaved}) {
+        auto found = tree.LookupBatch(keys, mode);
+        for (uint64_t i = 0; i < kCount; i++)
+            CHECK(found[i] == (i % 3 == 0 ? std::nullopt
+                                          : std::optional<uint64_t>{i}));
+    }
+    tree.ReplicateUpperLevels(0);
+    for (uint64_t i = 1; i < kCount; i += 3) CHECK(tree.Search(i) == i);
+}
+
+void TestEpoch() {
+    // a manager only allocates slots for the threads that use it, and trees
+    // share one rather than each carrying their own
+    CHECK(sizeof(EpochManager) < 512);
+    CHECK(sizeof(Tree<uint64_t, uint64_t>) < 1024);
+
+    auto freed = std::atomic<int>{0};
+    auto count = [](void* context, void*) {
+        static_cast<std::atomic<int>*>(context)->fetch_add(1);
+    };
+    auto manager = EpochManager{};
+    // what a thread retires is not left to that thread to free, even once
+    // it has exited
+    std::thread{[&] {
+        auto guard = manager.Pin();
+        for (auto i = 0; i < 10; i++) manager.Retire(nullptr, count, &freed);
+    }}.join();
+    CHECK(freed == 0);
+    manager.Synchronize();
+    CHECK(freed == 10);
+
+    // a pinned reader holds up reclamation, and Synchronize waits for it
+    // but not for the caller's own pin
+    auto pinned = std::atomic<bool>{false};
+    auto release = std::atomic<bool>{false};
+    auto reader = std::thread{[&] {
+        auto guard = manager.Pin();
+        pinned = true;
+        while (!release) std::this_thread::yield();
+    }};
+    while (!pinned) std::this_thread::yield();
+    manager.Retire(nullptr, count, &freed);
+    manager.Reclaim();
+    CHECK(freed == 10);
+    release = true;
+    reader.join();
+    {
+        // returns, but frees nothing the caller could still be reading
+        auto guard = manager.Pin();
+        manager.Synchronize();
+    }
+    manager.Synchronize();
+    CHECK(freed == 11);
+
+    // what is retired for a context goes as soon as it is released
+    auto other = std::atomic<int>{0};
+    {
+        auto guard = manager.Pin();
+        manager.Retire(nullptr, count, &other);
+        manager.Release(&freed);
+        manager.Release(&other);
+    }
+    CHECK(other == 1);
+}
+
+void TestLongKeys() {
+    // the key heap grows with the node, not to a fixed floor
+    CHECK(sizeof(Node<std::string, uint64_t>) < 1024);
+
+    // keys far longer than any node, some sharing long prefixes, and some
+    // longer than a 16-bit length, are spilled out of the nodes
+    constexpr int kCount = 2000;
+    auto key = [](int i) {
+        auto id = MakeKey<std::string>(i);
+        auto length = std::size_t{8} << (i % 8);
+        if (i % 500 == 0) length = 70000;
+        auto pad = std::string(length, static_cast<char>('a' + i % 5));
+        return (i % 2 == 0 ? pad + id : id + pad);
+    };
+    auto tree = Tree<std::string, uint64_t>{};
+    auto expected = std::map<std::string, uint64_t>{};
+    for (auto i = 0; i < kCount; i++) {
+        CHECK(tree.Insert(key(i), i));
+        expected.emplace(key(i), i);
+    }
+    CHECK(!tree.Insert(key(7), 0));
+    for (auto i = 0; i < kCount; i++) CHECK(tree.Search(key(i)) == i);
+    CHECK(!tree.Search(key(3).substr(1)).has_value());
+
+    // readers race erases, and the compaction that merges the emptied
+    // leaves moves spilled keys between nodes
+    auto threads = std::vector<std::thread>{};
+    threads.emplace_back([&] {
+        for (auto i = 0; i < kCount; i += 3) CHECK(tree.Erase(key(i)));
+        tree.Compact();
+    });
+    threads.emplace_back([&] {
+        for (auto i = 1; i < kCount; i += 3) CHECK(tree.Search(key(i)) == i);
+    });
+    for (auto& thread : threads) thread.join();
+    for (auto i = 0; i < kCount; i += 3) expected.erase(key(i));
+    for (auto i = 2; i < kCount; i += 3)
+        CHECK(tree.Upsert(key(i), 0) == UpsertResult::kReplaced);
+    for (auto i = 2; i < kCount; i += 3) expected[key(i)] = 0;
+    auto it = expected.begin();
+    tree.Scan(expected.begin()->first, expected.rbegin()->first,
+              [&](const std::string& k, uint64_t val) {
+                  CHECK(it != expected.end() && k == it->first &&
+                        val == it->second);
+                  ++it;
+              });
+    CHECK(it == expected.end());
+}
+
+void TestRingRegistration() {
+    auto dir = TempDir{"ring"};
+    auto first = std::make_unique<BufferPool>(dir.Path("first"), 4096, 4);
+    auto second = BufferPool{dir.Path("second"), 4096, 4};
+    auto id = first->GetPoolId();
+    CHECK(id != 0);
+    CHECK(second.GetPoolId() != id);
+    auto ring = IoRing{8};
+    if (!ring.IsOpen()) return;
+    // registrations are told apart by pool id, not address
+    CHECK(ring.RegisterBuffers(id, first->GetFrameBuffers()));
+    CHECK(ring.IsRegistered(id));
+    CHECK(!ring.IsRegistered(second.GetPoolId()));
+    // a pool about to free its frames takes them out of the ring
+    IoRing::Unregister(id);
+    CHECK(!ring.IsRegistered(id));
+    first.reset();
+    first = std::make_unique<BufferPool>(dir.Path("first"), 4096, 4);
+    CHECK(first->GetPoolId() != id);
+    CHECK(!ring.IsRegistered(first->GetPoolId()));
+    // a refusal is remembered rather than asked again
+    auto bad = std::vector<iovec>{{nullptr, 4096}};
+    CHECK(!ring.RegisterBuffers(second.GetPoolId(), bad));
+    CHECK(ring.IsRefused(second.GetPoolId()));
+    CHECK(!ring.RegisterBuffers(second.GetPoolId(),
+                                second.GetFrameBuffers()));
+    CHECK(ring.RegisterBuffers(first->GetPoolId(), first->GetFrameBuffers()));
+    CHECK(!ring.IsRefused(first->GetPoolId()));
+}
+
+struct Case {
+    std::string_view name;
+    void (*run)();
+};
+
+constexpr Case kCases[] = {
+    {"int32", TestKeyType<int32_t>},
+    {"int64", TestKeyType<int64_t>},
+    {"uint64", TestKeyType<uint64_t>},
+    {"string", TestKeyType<std::string>},
+    {"tail", TestTail},
+    {"compaction", TestCompaction},
+    {"concurrent", TestConcurrentWrites},
+    {"recover", TestRecover},
+    {"failed_log", TestFailedLog},
+    {"paged", TestPaged},
+    {"batch", TestBatch},
+    {"interleaved", TestInterleaved},
+    {"bulk_load", TestBulkLoad},
+    {"snapshot", TestSnapshot},
+    {"stats", TestStats},
+    {"sharded", TestSharded},
+    {"parallel_build", TestParallelBuild},
+    {"buffered", TestBuffered},
+    {"interpolation", TestInterpolation},
+    {"numa", TestNuma},
+    {"epoch", TestEpoch},
+    {"long_keys", TestLongKeys},
+    {"ring_registration", TestRingRegistration},
+};
+
+}  // namespace
+
+// run the case named on the command line, or every case
+auto main(int argc, char** argv) -> int {
+    auto ran = 0;
+    for (const auto& test : kCases) {
+        if (argc > 1 && test.name != argv[1]) continue;
+        test.run();
+        ran++;
+    }
+    if (ran == 0) {
+        std::fprintf(stderr, "no test named %s\n", argv[1]);
+        return 1;
+    }
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,322 @@
+#pragma once
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <utility>
+
+/**
+ * How keys and values are written into log records. Trivially copyable types
+ * are written byte for byte, and strings with a length in front.
+ * - Encode(val, out) appends val to out
+ * - Decode(in, val) reads val from the front of in and drops it from in, or
+ *   returns false if in is too short
+ */
+template <typename T>
+class LogCodec {
+    static_assert(std::is_trivially_copyable_v<T>,
+                  "logged keys and values must be trivially copyable or "
+                  "strings");
+
+   public:
+    static void Encode(const T& val, std::string& out) {
+        out.append(reinterpret_cast<const char*>(&val), sizeof(T));
+    }
+
+    static auto Decode(std::string_view& in, T& val) -> bool {
+        if (in.size() < sizeof(T)) return false;
+        std::memcpy(&val, in.data(), sizeof(T));
+        in.remove_prefix(sizeof(T));
+        return true;
+    }
+};
+
+template <>
+class LogCodec<std::string> {
+   public:
+    static void Encode(const std::string& val, std::string& out) {
+        LogCodec<uint32_t>::Encode(static_cast<uint32_t>(val.size()), out);
+        out.append(val);
+    }
+
+    static auto Decode(std::string_view& in, std::string& val) -> bool {
+        auto size = uint32_t{0};
+        if (!LogCodec<uint32_t>::Decode(in, size) || in.size() < size)
+            return false;
+        val.assign(in.data(), size);
+        in.remove_prefix(size);
+        return true;
+    }
+};
+
+/**
+ * A write-ahead log of opaque records with group commit. Appending a record
+ * only copies it into an in-memory buffer; Commit then waits until it is on
+ * disk. Whichever committing thread finds no write in progress becomes the
+ * leader: it waits out the durability window, so that more records can join
+ * the group, then writes the whole buffer with one write and one fdatasync,
+ * and wakes every thread whose record went out with it. A zero window writes
+ * right away, which still batches every record appended while the previous
+ * write was running.
+ * - The log lives in numbered segment files next to path, and path.checkpoint
+ *   names the first segment recovery has to replay. Rotate() starts a new
+ *   segment, and Truncate() drops the segments a checkpoint has covered
+ * - A new segment is started every time a log is opened, so a record torn by
+ *   a crash is only ever at the end of a segment that is never appended to
+ *   again. Replay() stops at the first record with a bad checksum
+ * - A failed write or sync is sticky: every later commit returns false
+ */
+class WriteAheadLog {
+   public:
+    explicit WriteAheadLog(
+        const std::string& path,
+        std::chrono::microseconds window = std::chrono::microseconds{0})
+        : path_{path},
+          window_{window},
+          first_{ReadCheckpoint()},
+          segment_{first_},
+          fd_{-1},
+          appended_{0},
+          durable_{0},
+          flushing_{false},
+          failed_{false} {
+        // segments from first_ on are contiguous, and the first one past the
+        // end becomes the one appended to
+        while (::access(SegmentPath(segment_).c_str(), F_OK) == 0) segment_++;
+        fd_ = OpenSegment(segment_);
+        failed_ = fd_ < 0;
+    }
+
+    WriteAheadLog(const WriteAheadLog&) = delete;
+    auto operator=(const WriteAheadLog&) -> WriteAheadLog& = delete;
+
+    /**
+     * Write out whatever is still buffered. No thread may be appending
+     */
+    ~WriteAheadLog() {
+        Commit(appended_);
+        if (fd_ >= 0) ::close(fd_);
+    }
+
+    /**
+     * Whether every write and sync so far has worked. Does not wait for a
+     * write in progress
+     */
+    inline auto IsHealthy() const -> bool {
+        return !failed_.load(std::memory_order_acquire);
+    }
+
+    /**
+     * Buffer the record, and return the position to pass to Commit to wait
+     * for it to be durable. Positions are always above 0
+     */
+    auto Append(std::string_view record) -> uint64_t {
+        auto header = std::array<uint32_t, 2>{
+            static_cast<uint32_t>(record.size()), Checksum(record)};
+        std::lock_guard<std::mutex> lk{latch_};
+        buffer_.append(reinterpret_cast<const char*>(header.data()),
+                       sizeof(header));
+        buffer_.append(record);
+        appended_ += sizeof(header) + record.size();
+        return appended_;
+    }
+
+    /**
+     * Wait until every record up to the position is durable. Returns false
+     * if the log has failed
+     */
+    auto Commit(uint64_t position) -> bool {
+        std::unique_lock<std::mutex> lk{latch_};
+        while (durable_ < position && !failed_) {
+            if (flushing_) {
+                // a leader is writing. the record either went out with its
+                // group or is picked up by the next leader
+                flushed_.wait(lk);
+                continue;
+            }
+            flushing_ = true;
+            if (window_.count() > 0) {
+                lk.unlock();
+                std::this_thread::sleep_for(window_);
+                lk.lock();
+            }
+            auto target = appended_;
+            std::swap(buffer_, writing_);
+            auto fd = fd_;
+            lk.unlock();
+            auto ok = WriteAll(fd, writing_) && ::fdatasync(fd) == 0;
+            writing_.clear();
+            lk.lock();
+            failed_ = failed_ || !ok;
+            durable_ = target;
+            flushing_ = false;
+            flushed_.notify_all();
+        }
+        return !failed_;
+    }
+
+    /**
+     * Make everything appended so far durable in the current segment and
+     * start a new one. Returns the number of the new segment, which is the
+     * first one a checkpoint started from here on has to replay
+     */
+    auto Rotate() -> std::optional<uint64_t> {
+        std::unique_lock<std::mutex> lk{latch_};
+        flushed_.wait(lk, [&] { return !flushing_; });
+        auto ok = !failed_ && WriteAll(fd_, buffer_) && ::fdatasync(fd_) == 0;
+        buffer_.clear();
+        durable_ = appended_;
+        auto fd = ok ? OpenSegment(segment_ + 1) : -1;
+        if (fd < 0) {
+            failed_ = true;
+            flushed_.notify_all();
+            return std::nullopt;
+        }
+        ::close(fd_);
+        fd_ = fd;
+        segment_++;
+        flushed_.notify_all();
+        return segment_;
+    }
+
+    /**
+     * Record that recovery can start from the segment, and delete the
+     * segments before it. Call it once a checkpoint covering them is durable
+     */
+    auto Truncate(uint64_t segment) -> bool {
+        std::lock_guard<std::mutex> lk{truncate_latch_};
+        auto temp_path = path_ + ".checkpoint.tmp";
+        auto fd = ::open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) return false;
+        auto ok = ::write(fd, &segment, sizeof(segment)) == sizeof(segment) &&
+                  ::fsync(fd) == 0;
+        ::close(fd);
+        ok = ok && std::rename(temp_path.c_str(),
+                               (path_ + ".checkpoint").c_str()) == 0;
+        if (!ok) return false;
+        for (; first_ < segment; first_++)
+            ::unlink(SegmentPath(first_).c_str());
+        return true;
+    }
+
+    /**
+     * Call fn(record) for every record recovery has to replay, oldest first,
+     * as a string_view that is only valid during the call. Records appended
+     * through this log are not replayed
+     */
+    template <typename F>
+    void Replay(F&& fn) {
+        auto contents = std::string{};
+        for (auto segment = first_; segment < segment_; segment++) {
+            if (!ReadSegment(segment, contents)) continue;
+            auto in = std::string_view{contents};
+            auto header = std::array<uint32_t, 2>{};
+            while (in.size() >= sizeof(header)) {
+                std::memcpy(header.data(), in.data(), sizeof(header));
+                in.remove_prefix(sizeof(header));
+                if (in.size() < header[0]) break;
+                auto record = in.substr(0, header[0]);
+                if (Checksum(record) != header[1]) break;
+                fn(record);
+                in.remove_prefix(header[0]);
+            }
+        }
+    }
+
+   private:
+    // CRC-32 (IEEE), enough to tell a record torn by a crash from a whole one
+    static auto Checksum(std::string_view data) -> uint32_t {
+        static constexpr auto kTable = [] {
+            auto table = std::array<uint32_t, 256>{};
+            for (uint32_t i = 0; i < 256; i++) {
+                auto crc = i;
+                for (auto bit = 0; bit < 8; bit++)
+                    crc = crc & 1 ? 0xedb88320 ^ (crc >> 1) : crc >> 1;
+                table[i] = crc;
+            }
+            return table;
+        }();
+        auto crc = ~uint32_t{0};
+        for (auto c : data)
+            crc = kTable[(crc ^ static_cast<uint8_t>(c)) & 0xff] ^ (crc >> 8);
+        return ~crc;
+    }
+
+    auto SegmentPath(uint64_t segment) const -> std::string {
+        return path_ + "." + std::to_string(segment);
+    }
+
+    auto OpenSegment(uint64_t segment) const -> int {
+        return ::open(SegmentPath(segment).c_str(),
+                      O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    }
+
+    auto ReadCheckpoint() const -> uint64_t {
+        auto segment = uint64_t{0};
+        auto fd = ::open((path_ + ".checkpoint").c_str(), O_RDONLY);
+        if (fd < 0) return 0;
+        if (::read(fd, &segment, sizeof(segment)) != sizeof(segment))
+            segment = 0;
+        ::close(fd);
+        return segment;
+    }
+
+    auto ReadSegment(uint64_t segment, std::string& contents) const -> bool {
+        auto fd = ::open(SegmentPath(segment).c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        auto size = ::lseek(fd, 0, SEEK_END);
+        contents.resize(size < 0 ? 0 : size);
+        auto read = ::pread(fd, contents.data(), contents.size(), 0);
+        ::close(fd);
+        if (read < 0) return false;
+        contents.resize(read);
+        return true;
+    }
+
+    static auto WriteAll(int fd, std::string_view data) -> bool {
+        while (!data.empty()) {
+            auto written = ::write(fd, data.data(), data.size());
+            if (written < 0 && errno == EINTR) continue;
+            if (written < 0) return false;
+            data.remove_prefix(written);
+        }
+        return true;
+    }
+
+    std::string path_;
+    std::chrono::microseconds window_;
+    // the first segment recovery replays
+    uint64_t first_;
+    // the segment being appended to
+    uint64_t segment_;
+    int fd_;
+    // guards everything below, and fd_ and segment_ once the log is open
+    std::mutex latch_;
+    // signalled whenever a leader finishes writing
+    std::condition_variable flushed_;
+    std::string buffer_;
+    // the group the leader is writing. only the leader touches it
+    std::string writing_;
+    // positions count bytes appended since the log was opened
+    uint64_t appended_;
+    uint64_t durable_;
+    bool flushing_;
+    // only ever set, under latch_, but read without it by IsHealthy
+    std::atomic<bool> failed_;
+    // only one truncation at a time
+    std::mutex truncate_latch_;
+};